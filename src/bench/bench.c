@@ -0,0 +1,185 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "bench.h"
+
+/* Revision the benchmark is built from, the Makefile passes it. */
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+static const char *revision = BENCH_REVISION;
+static const char *filter = NULL;
+/* Each op is repeated for at least this time, the best of the runs is
+ * reported.
+ */
+static uint64_t min_ns = 100000000ULL;
+static int runs = 5;
+static int failures = 0;
+
+bool bench_enabled(const char *name)
+{
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+void bench_report(const char *name, const char *variant, uint64_t items,
+                  uint64_t iters, uint64_t ns)
+{
+    double per_op = iters > 0 ? (double) ns / iters : 0;
+
+    printf("{\"revision\": \"%s\", \"bench\": \"%s\", \"variant\": \"%s\", "
+           "\"items\": %llu, \"iters\": %llu, \"ns_per_op\": %.2f, "
+           "\"ns_per_item\": %.3f}\n", revision, name, variant,
+           (unsigned long long) items, (unsigned long long) iters, per_op,
+           items > 0 ? per_op / items : per_op);
+    fflush(stdout);
+}
+
+/* Reports a broken invariant, the run ends with a failure status. */
+void bench_fail(const char *name, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", name, what);
+    failures++;
+}
+
+void bench_run(const char *name, const char *variant, uint64_t items,
+               bench_func_t func, void *arg)
+{
+    uint64_t iters = 1, ns, best;
+    int i;
+
+    if(!bench_enabled(name)) {
+        return;
+    }
+
+    /* Scale the number of iterations up to the time of a run. */
+    while((ns = func(arg, iters)) < min_ns) {
+        if(ns < min_ns / 100) {
+            iters *= 10;
+        } else {
+            iters = iters * min_ns / ns + 1;
+        }
+    }
+
+    best = ns;
+    for(i = 1; i < runs; i++) {
+        if((ns = func(arg, iters)) < best) {
+            best = ns;
+        }
+    }
+
+    bench_report(name, variant, items, iters, best);
+}
+
+/* Parses "16,64,254" into `values'. */
+static int bench_params_parse(char *list, int *values)
+{
+    char *item;
+    int n = 0;
+
+    for(item = strtok(list, ","); item != NULL && n < BENCH_PARAMS_MAX;
+        item = strtok(NULL, ",")) {
+        if((values[n] = atoi(item)) > 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-b bullets] [-f filter] [-p players] [-r runs]\n"
+            "          [-t ms]\n"
+            "  -b bullets  comma separated counts of bullets (100,1000,10000)\n"
+            "  -f filter   run benchmarks whose name contains this string\n"
+            "  -p players  comma separated counts of players (16,64,254)\n"
+            "  -r runs     runs of each benchmark, the best one is reported (5)\n"
+            "  -t ms       minimal time of a run (100)\n"
+            "Run from the top of the tree, maps are loaded from data/maps.\n"
+            "BENCH_REVISION overrides the revision put into the results.\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_params params;
+    char players[] = "16,64,254", bullets[] = "100,1000,10000";
+    int opt;
+
+    params.nplayers = bench_params_parse(players, params.players);
+    params.nbullets = bench_params_parse(bullets, params.bullets);
+
+    while((opt = getopt(argc, argv, "b:f:p:r:t:")) != -1) {
+        switch(opt) {
+        case 'b':
+            params.nbullets = bench_params_parse(optarg, params.bullets);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'p':
+            params.nplayers = bench_params_parse(optarg, params.players);
+            break;
+        case 'r':
+            if((runs = atoi(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            if(atoi(optarg) < 1) {
+                usage(argv[0]);
+            }
+            min_ns = atoi(optarg) * 1000000ULL;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* Only warnings of the server's code are interesting here. */
+    log_level = LOG_WARN;
+    if(getenv("BENCH_REVISION") != NULL) {
+        revision = getenv("BENCH_REVISION");
+    }
+    ticks_calibrate();
+
+    bench_msg();
+    bench_map();
+    bench_world(&params);
+    bench_timers();
+
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
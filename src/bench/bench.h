@@ -0,0 +1,59 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* Microbenchmarks of the server's primitives. Every result is printed as
+ * one JSON object per line:
+ *     {"revision": ..., "bench": ..., "variant": ..., "items": ...,
+ *      "iters": ..., "ns_per_op": ..., "ns_per_item": ...}
+ * where an op is one call of the measured code and items is the amount
+ * of work in it (players, bullets, cells, ...), so results can be
+ * compared across commits.
+ */
+#define BENCH_PARAMS_MAX 16
+
+/* Runs the measured code `iters' times, returns elapsed nanoseconds, so
+ * preparation between the calls is not counted.
+ */
+typedef uint64_t (*bench_func_t)(void*, uint64_t);
+
+struct bench_params {
+    int players[BENCH_PARAMS_MAX];
+    int nplayers;
+    int bullets[BENCH_PARAMS_MAX];
+    int nbullets;
+};
+
+bool bench_enabled(const char*);
+void bench_run(const char*, const char*, uint64_t, bench_func_t, void*);
+void bench_report(const char*, const char*, uint64_t, uint64_t, uint64_t);
+void bench_fail(const char*, const char*);
+
+void bench_msg(void);
+void bench_map(void);
+void bench_world(struct bench_params*);
+void bench_timers(void);
+
+#endif
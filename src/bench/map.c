@@ -0,0 +1,160 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Loading of maps: the ones in data/maps and generated large ones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "bench.h"
+
+struct bench_map_arg {
+    uint8_t *name;
+};
+
+static uint64_t bench_map_load(void *arg, uint64_t iters)
+{
+    struct bench_map_arg *a = arg;
+    uint64_t ns = 0, i;
+
+    for(i = 0; i < iters; i++) {
+        uint64_t t0 = ticks_get();
+        struct map *m = map_load(a->name);
+
+        ns += ticks_get() - t0;
+        if(m != NULL) {
+            map_unload(m);
+        }
+    }
+
+    return ns;
+}
+
+static void bench_map_one(const char *name)
+{
+    struct bench_map_arg a;
+    struct map *m;
+
+    a.name = (uint8_t *) name;
+    if((m = map_load(a.name)) == NULL) {
+        bench_fail("map_load", name);
+        return;
+    }
+
+    bench_run("map_load", name, (uint64_t) m->width * m->height,
+              bench_map_load, &a);
+    map_unload(m);
+}
+
+/* Writes a map of `side' x `side' cells to data/maps: walls around and
+ * `percent' of walls inside, placed in random blocks.
+ */
+static bool bench_map_generate(const char *name, int side, int percent)
+{
+    char path[4096];
+    char *row = malloc(side + 1);
+    FILE *f;
+    int w, h;
+
+    snprintf(path, sizeof(path), "data/maps/%s", name);
+    if(row == NULL || (f = fopen(path, "w")) == NULL) {
+        free(row);
+        return false;
+    }
+
+    srand(side);
+    row[side] = '\n';
+    for(h = 0; h < side; h++) {
+        for(w = 0; w < side; w++) {
+            bool border = w == 0 || h == 0 || w == side - 1 || h == side - 1;
+            bool block = ((w / 8) * 7919 + (h / 8) * 104729) % 100 < percent;
+
+            row[w] = border || (block && rand() % 4 != 0) ?
+                MAP_WALL : MAP_EMPTY;
+        }
+        fwrite(row, 1, side + 1, f);
+    }
+
+    fclose(f);
+    free(row);
+
+    return true;
+}
+
+void bench_map(void)
+{
+    static const struct {
+        const char *name;
+        int side;
+        int percent;
+    } generated[] = {
+        { "bench-1024-dense.map", 1024, 40 },
+        { "bench-4096-sparse.map", 4096, 5 },
+    };
+    struct dirent **entries;
+    int i, n;
+
+    if(!bench_enabled("map_load")) {
+        return;
+    }
+
+    if((n = scandir("data/maps", &entries, NULL, alphasort)) < 0) {
+        bench_fail("map_load", "data/maps can't be read, run from the top "
+                   "of the tree");
+        return;
+    }
+
+    for(i = 0; i < n; i++) {
+        size_t len = strlen(entries[i]->d_name);
+
+        if(len > 4 && strcmp(entries[i]->d_name + len - 4, ".map") == 0 &&
+           strncmp(entries[i]->d_name, "bench-", 6) != 0) {
+            bench_map_one(entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    for(i = 0; i < (int) (sizeof(generated) / sizeof(generated[0])); i++) {
+        char path[4096];
+
+        if(!bench_map_generate(generated[i].name, generated[i].side,
+                               generated[i].percent)) {
+            bench_fail("map_load", "data/maps is not writable");
+            return;
+        }
+
+        bench_map_one(generated[i].name);
+
+        snprintf(path, sizeof(path), "data/maps/%s", generated[i].name);
+        unlink(path);
+    }
+}
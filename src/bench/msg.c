@@ -0,0 +1,188 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Packing of messages of each type, one by one and in batches. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "bench.h"
+
+static const char *msg_names[] = {
+    "walk", "player_position", "player_hit", "player_killed",
+    "enemy_position", "shoot", "connect_ask", "connect_ok",
+    "connect_notify", "disconnect_server", "disconnect_client",
+    "disconnect_notify", "on_bonus", "map_explode"
+};
+
+struct bench_msg_arg {
+    struct msg m;
+    uint8_t buf[sizeof(struct msg)];
+    struct msg_batch batch;
+};
+
+/* A message of `type' with every field set. */
+static void bench_msg_fill(struct msg *m, uint8_t type)
+{
+    memset(m, 0, sizeof(struct msg));
+    m->header.seq = 123456;
+    m->header.id = 7;
+    m->type = type;
+
+    switch(type) {
+    case MSGTYPE_PLAYER_POSITION:
+    case MSGTYPE_ENEMY_POSITION:
+        m->event.player_position.pos_x = 1000;
+        m->event.player_position.pos_y = 2000;
+        break;
+    case MSGTYPE_PLAYER_HIT:
+        m->event.player_hit.hp = 42;
+        m->event.player_hit.armor = 17;
+        break;
+    case MSGTYPE_CONNECT_ASK:
+    case MSGTYPE_CONNECT_NOTIFY:
+    case MSGTYPE_DISCONNECT_NOTIFY:
+        strncpy((char *) m->event.connect_ask.nick, "benchmarker",
+                NICK_MAX_LEN);
+        break;
+    case MSGTYPE_CONNECT_OK:
+        m->event.connect_ok.ok = 1;
+        m->event.connect_ok.id = 7;
+        strncpy((char *) m->event.connect_ok.mapname, "default.map",
+                MAP_NAME_MAX_LEN);
+        break;
+    case MSGTYPE_ON_BONUS:
+        m->event.on_bonus.type = BONUSTYPE_WEAPON;
+        m->event.on_bonus.index = WEAPON_ROCKET;
+        break;
+    case MSGTYPE_MAP_EXPLODE:
+        m->event.map_explode.w = 300;
+        m->event.map_explode.h = 400;
+        m->event.map_explode.radius = MAP_EXPLODE_RADIUS_MAX;
+        memset(m->event.map_explode.mask, 0x5a, MAP_EXPLODE_MASK_LEN);
+        break;
+    default:
+        m->event.walk.direction = DIRECTION_UP;
+        break;
+    }
+}
+
+static uint64_t bench_msg_pack(void *arg, uint64_t iters)
+{
+    struct bench_msg_arg *a = arg;
+    uint64_t t0 = ticks_get(), i;
+
+    for(i = 0; i < iters; i++) {
+        msg_pack(&(a->m), a->buf);
+    }
+
+    return ticks_get() - t0;
+}
+
+static uint64_t bench_msg_unpack(void *arg, uint64_t iters)
+{
+    struct bench_msg_arg *a = arg;
+    uint64_t t0 = ticks_get(), i;
+
+    for(i = 0; i < iters; i++) {
+        msg_unpack(a->buf, &(a->m));
+    }
+
+    return ticks_get() - t0;
+}
+
+/* Fills the batch up and empties it. */
+static uint64_t bench_msg_batch_push(void *arg, uint64_t iters)
+{
+    struct bench_msg_arg *a = arg;
+    uint64_t ns = 0, i;
+    int j;
+
+    for(i = 0; i < iters; i++) {
+        uint64_t t0;
+
+        memset(&(a->batch), 0, sizeof(struct msg_batch));
+        t0 = ticks_get();
+        for(j = 0; j < MSGBATCH_INIT_SIZE; j++) {
+            msg_batch_push(&(a->batch), &(a->m));
+        }
+        ns += ticks_get() - t0;
+    }
+
+    return ns;
+}
+
+static uint64_t bench_msg_batch_pop(void *arg, uint64_t iters)
+{
+    struct bench_msg_arg *a = arg;
+    uint64_t ns = 0, i;
+    int j;
+
+    for(i = 0; i < iters; i++) {
+        uint64_t t0;
+
+        memset(&(a->batch), 0, sizeof(struct msg_batch));
+        for(j = 0; j < MSGBATCH_INIT_SIZE; j++) {
+            msg_batch_push(&(a->batch), &(a->m));
+        }
+
+        t0 = ticks_get();
+        while(msg_batch_pop(&(a->batch)) != NULL) {
+            ;
+        }
+        ns += ticks_get() - t0;
+    }
+
+    return ns;
+}
+
+void bench_msg(void)
+{
+    struct bench_msg_arg a;
+    struct msg check;
+    uint8_t type;
+
+    for(type = 0; type <= MSGTYPE_MAP_EXPLODE; type++) {
+        bench_msg_fill(&(a.m), type);
+        bench_run("msg_pack", msg_names[type], 1, bench_msg_pack, &a);
+
+        msg_pack(&(a.m), a.buf);
+        bench_run("msg_unpack", msg_names[type], 1, bench_msg_unpack, &a);
+
+        if(!msg_unpack(a.buf, &check) || check.type != type) {
+            bench_fail("msg_unpack", msg_names[type]);
+        }
+    }
+
+    bench_msg_fill(&(a.m), MSGTYPE_ENEMY_POSITION);
+    bench_run("msg_batch_push", "enemy_position", MSGBATCH_INIT_SIZE,
+              bench_msg_batch_push, &a);
+    bench_run("msg_batch_pop", "enemy_position", MSGBATCH_INIT_SIZE,
+              bench_msg_batch_pop, &a);
+}
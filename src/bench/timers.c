@@ -0,0 +1,116 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Microbenchmark of the timing wheel: 100k pending timers with random
+ * delays up to a few minutes of ticks, a quarter of them is cancelled.
+ * Reports the cost of add, cancel and of a tick, and checks every timer
+ * fires at its own tick.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "../server/timers.h"
+#include "bench.h"
+
+#define BENCH_TIMERS 100000
+#define BENCH_DELAY_MAX (10 * 60 * 5)
+
+struct bench_timer {
+    struct timer timer;
+    uint64_t due;
+};
+
+static struct timers timers;
+static uint64_t fired, late;
+
+static void bench_timer_func(void *arg)
+{
+    struct bench_timer *bt = arg;
+
+    fired++;
+    if(timers.now != bt->due) {
+        late++;
+    }
+}
+
+void bench_timers(void)
+{
+    struct bench_timer *bts;
+    uint64_t t0, t_add, t_cancel, t_ticks, max_tick = 0;
+    int i, cancelled = 0;
+
+    if(!bench_enabled("timers")) {
+        return;
+    }
+
+    bts = malloc(sizeof(struct bench_timer) * BENCH_TIMERS);
+    fired = late = 0;
+    srand(1);
+    timers_init(&timers, 0);
+
+    t0 = ticks_get();
+    for(i = 0; i < BENCH_TIMERS; i++) {
+        uint64_t delay = 1 + rand() % BENCH_DELAY_MAX;
+
+        timer_init(&(bts[i].timer), bench_timer_func, &(bts[i]));
+        bts[i].due = delay;
+        timers_add(&timers, &(bts[i].timer), delay);
+    }
+    t_add = ticks_get() - t0;
+
+    t0 = ticks_get();
+    for(i = 0; i < BENCH_TIMERS; i += 4) {
+        timers_cancel(&timers, &(bts[i].timer));
+        cancelled++;
+    }
+    t_cancel = ticks_get() - t0;
+
+    t0 = ticks_get();
+    for(i = 1; i <= BENCH_DELAY_MAX; i++) {
+        uint64_t t1 = ticks_get();
+
+        timers_advance(&timers, i);
+        if(ticks_get() - t1 > max_tick) {
+            max_tick = ticks_get() - t1;
+        }
+    }
+    t_ticks = ticks_get() - t0;
+
+    bench_report("timers_add", "timers=100000", 1, BENCH_TIMERS, t_add);
+    bench_report("timers_cancel", "timers=100000", 1, cancelled, t_cancel);
+    bench_report("timers_advance", "timers=100000", 1, BENCH_DELAY_MAX, t_ticks);
+    bench_report("timers_advance_max", "timers=100000", 1, 1, max_tick);
+
+    if(fired != (uint64_t) (BENCH_TIMERS - cancelled) || late != 0 ||
+       timers.count != 0) {
+        bench_fail("timers", "timers fired late, twice or not at all");
+    }
+
+    free(bts);
+}
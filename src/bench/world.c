@@ -0,0 +1,316 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Parts of the tick on a room with the given number of players and
+ * bullets: collision checks, moving of bullets and output for players.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "../server/timers.h"
+#include "../server/server.h"
+#include "../server/events.h"
+#include "../server/net.h"
+#include "../server/workers.h"
+#include "../server/rng.h"
+#include "../server/metrics.h"
+#include "../server/room.h"
+#include "../server/region.h"
+#include "bench.h"
+
+#define BENCH_WORLD_MAP "default.map"
+
+struct bench_world_arg {
+    struct room *r;
+    int nbullets;
+    /* Map and players as they were before bullets, see bench_world_save(). */
+    struct map_chunk **chunks;
+    struct map_bits **walls;
+    struct map_chunk *objs;
+    struct map_bits *bits;
+    struct player *players;
+};
+
+/* Random empty cell which nobody stands on, 1-based. */
+static void bench_world_cell(struct room *r, uint16_t *x, uint16_t *y)
+{
+    do {
+        *x = 1 + rng_range(&r->rng, r->map->width);
+        *y = 1 + rng_range(&r->rng, r->map->height);
+    } while(MAP_OBJ(r->map, *x - 1, *y - 1) != MAP_EMPTY ||
+            occupancy_has(r, *x, *y));
+}
+
+static struct room *bench_world_init(int nplayers)
+{
+    struct room *r;
+    struct player player;
+    struct net_route route;
+    int i;
+
+    if((r = room_init(0, (uint8_t *) BENCH_WORLD_MAP, 1, 1)) == NULL) {
+        return NULL;
+    }
+
+    memset(&route, 0, sizeof(route));
+    memset(&player, 0, sizeof(player));
+    player.route = &route;
+    player.nick = (uint8_t *) "bench";
+
+    for(i = 0; i < nplayers; i++) {
+        struct player *p;
+
+        if((p = players_occupy(r->players, &player)) == NULL) {
+            break;
+        }
+
+        bench_world_cell(r, &(p->pos_x), &(p->pos_y));
+        region_player_add(region_of(r, p->pos_x, p->pos_y), p);
+        occupancy_add(r, p->pos_x, p->pos_y);
+    }
+
+    return r;
+}
+
+static uint64_t bench_collision(void *arg, uint64_t iters)
+{
+    struct bench_world_arg *a = arg;
+    uint64_t t0 = ticks_get(), i;
+
+    for(i = 0; i < iters; i++) {
+        struct players_slot *slot;
+
+        for(slot = a->r->players->root; slot != NULL; slot = slot->next) {
+            collision_check_player(slot->p, a->r->map, a->r->players);
+        }
+    }
+
+    return ticks_get() - t0;
+}
+
+static uint64_t bench_region_collision(void *arg, uint64_t iters)
+{
+    struct bench_world_arg *a = arg;
+    uint64_t t0 = ticks_get(), i;
+
+    for(i = 0; i < iters; i++) {
+        struct players_slot *slot;
+
+        for(slot = a->r->players->root; slot != NULL; slot = slot->next) {
+            struct player *p = slot->p;
+
+            region_collision_check_player(region_of(a->r, p->pos_x, p->pos_y),
+                                          p, a->r->map);
+        }
+    }
+
+    return ticks_get() - t0;
+}
+
+/* Bullets break walls and hurt players, every move starts from the world
+ * saved here. Chunks shared by the map are not written, map_set() makes
+ * its own copy of them.
+ */
+static void bench_world_save(struct bench_world_arg *a)
+{
+    struct map *m = a->r->map;
+    size_t i, n = (size_t) m->chunks_w * m->chunks_h;
+
+    a->chunks = malloc(sizeof(struct map_chunk*) * n);
+    a->walls = malloc(sizeof(struct map_bits*) * n);
+    a->objs = malloc(sizeof(struct map_chunk) * n);
+    a->bits = malloc(sizeof(struct map_bits) * n);
+    a->players = malloc(sizeof(struct player) * MAX_PLAYERS);
+
+    for(i = 0; i < n; i++) {
+        a->chunks[i] = m->chunks[i];
+        a->walls[i] = m->walls[i];
+        if(!MAP_CHUNK_SHARED(m->chunks[i])) {
+            memcpy(&(a->objs[i]), m->chunks[i], sizeof(struct map_chunk));
+            memcpy(&(a->bits[i]), m->walls[i], sizeof(struct map_bits));
+        }
+    }
+
+    for(i = 0; i < MAX_PLAYERS; i++) {
+        if(a->r->players->slots[i] != NULL) {
+            memcpy(&(a->players[i]), a->r->players->slots[i]->p,
+                   sizeof(struct player));
+        }
+    }
+}
+
+static void bench_world_restore(struct bench_world_arg *a)
+{
+    struct map *m = a->r->map;
+    size_t i, n = (size_t) m->chunks_w * m->chunks_h;
+
+    for(i = 0; i < n; i++) {
+        if(m->chunks[i] != a->chunks[i]) {
+            free(m->chunks[i]);
+            free(m->walls[i]);
+            m->chunks[i] = a->chunks[i];
+            m->walls[i] = a->walls[i];
+        } else if(!MAP_CHUNK_SHARED(m->chunks[i])) {
+            memcpy(m->chunks[i], &(a->objs[i]), sizeof(struct map_chunk));
+            memcpy(m->walls[i], &(a->bits[i]), sizeof(struct map_bits));
+        }
+    }
+
+    for(i = 0; i < MAX_PLAYERS; i++) {
+        if(a->r->players->slots[i] != NULL) {
+            memcpy(a->r->players->slots[i]->p, &(a->players[i]),
+                   sizeof(struct player));
+        }
+    }
+}
+
+static void bench_world_forget(struct bench_world_arg *a)
+{
+    free(a->chunks);
+    free(a->walls);
+    free(a->objs);
+    free(a->bits);
+    free(a->players);
+}
+
+/* One move of `nbullets' fresh bullets, as the regions do it in a tick.
+ * Bullets are shot by the first player in random directions from random
+ * cells and are removed after the move, which the world forgets.
+ */
+static uint64_t bench_bullets_proceed(void *arg, uint64_t iters)
+{
+    struct bench_world_arg *a = arg;
+    struct room *r = a->r;
+    uint64_t ns = 0, i, t0;
+    uint16_t j;
+    int k;
+
+    for(i = 0; i < iters; i++) {
+        for(k = 0; k < a->nbullets; k++) {
+            struct bullet b;
+
+            b.player = r->players->root->p;
+            b.type = k % 4 == 0 ? WEAPON_ROCKET : WEAPON_GUN;
+            b.direction = rng_range(&r->rng, 4);
+            bench_world_cell(r, &b.x, &b.y);
+            b.sx = b.x;
+            b.sy = b.y;
+            bullets_add(region_of(r, b.x, b.y)->bullets, &b);
+        }
+
+        t0 = ticks_get();
+        for(j = 0; j < r->regions_count; j++) {
+            bullets_proceed(r, &(r->regions[j]));
+        }
+        ns += ticks_get() - t0;
+
+        for(j = 0; j < r->regions_count; j++) {
+            struct region *rg = &(r->regions[j]);
+
+            bullets_free(rg->bullets);
+            rg->bullets = bullets_init();
+            rg->bullets_handoff_count = 0;
+            rg->impacts_count = 0;
+        }
+
+        bench_world_restore(a);
+    }
+
+    return ns;
+}
+
+/* Output of a tick: visibility and batches of every player, then queueing
+ * of the datagrams. The queue is emptied instead of being flushed.
+ */
+static uint64_t bench_send_events(void *arg, uint64_t iters)
+{
+    struct bench_world_arg *a = arg;
+    uint64_t ns = 0, i, t0;
+
+    for(i = 0; i < iters; i++) {
+        t0 = ticks_get();
+        encode_events(a->r);
+        send_events(a->r);
+        ns += ticks_get() - t0;
+
+        a->r->sendq->count = 0;
+        a->r->sendq->data_len = 0;
+    }
+
+    return ns;
+}
+
+void bench_world(struct bench_params *params)
+{
+    struct bench_world_arg a;
+    char variant[64];
+    int i, j;
+
+    if(!bench_enabled("collision_check_player") &&
+       !bench_enabled("bullets_proceed") && !bench_enabled("send_events")) {
+        return;
+    }
+
+    stencils_init();
+
+    for(i = 0; i < params->nplayers; i++) {
+        uint64_t n;
+
+        if((a.r = bench_world_init(params->players[i])) == NULL) {
+            bench_fail("world", "map " BENCH_WORLD_MAP " can't be loaded");
+            break;
+        }
+
+        n = a.r->players->count;
+        snprintf(variant, sizeof(variant), "players=%llu",
+                 (unsigned long long) n);
+
+        bench_run("collision_check_player", variant, n, bench_collision, &a);
+        bench_run("region_collision_check_player", variant, n,
+                  bench_region_collision, &a);
+        bench_run("send_events", variant, n, bench_send_events, &a);
+
+        bench_world_save(&a);
+        for(j = 0; j < params->nbullets && n > 0; j++) {
+            a.nbullets = params->bullets[j];
+            snprintf(variant, sizeof(variant), "players=%llu,bullets=%d",
+                     (unsigned long long) n, a.nbullets);
+            bench_run("bullets_proceed", variant, a.nbullets,
+                      bench_bullets_proceed, &a);
+        }
+        bench_world_forget(&a);
+
+        room_free(a.r);
+    }
+
+    stencils_free();
+}
@@ -0,0 +1,627 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Load generator: many simulated players in one process. Every bot owns
+ * a UDP socket, all of them and a tick timer are serviced by a single
+ * epoll loop. Bots act once per server tick according to their behaviour
+ * and measure what they get back:
+ * - RTT is the time from a walk to the PLAYER_POSITION it caused, one walk
+ *   is timed at a time;
+ * - server sends at least one datagram per tick to every player (it sees
+ *   itself), so datagrams missing from the number of ticks since connect
+ *   are counted as lost.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "../cdata.h"
+#include "../server/rng.h"
+
+#define BOTS_MAX 65536
+#define BOT_EVENTS 256
+#define BOT_CONNECT_RETRY_NS 1000000000ULL
+#define BOT_RTT_TIMEOUT_NS 1000000000ULL
+
+enum bot_behaviour_enum_t {
+    BOT_WANDER = 0,
+    BOT_CHASE,
+    BOT_SPAM,
+    BOT_BEHAVIOURS
+};
+
+static const char *bot_behaviours[BOT_BEHAVIOURS] = {
+    "wander", "chase", "spam"
+};
+
+enum bot_state_enum_t {
+    BOT_CONNECTING = 0,
+    BOT_PLAYING,
+    BOT_REJECTED,
+    BOT_DISCONNECTED
+};
+
+struct bot {
+    int fd;
+    uint8_t id;
+    uint8_t behaviour;
+    uint8_t state;
+    uint8_t direction;
+    /* Steps left in the current direction. */
+    uint8_t steps;
+    uint32_t seq;
+    uint16_t pos_x;
+    uint16_t pos_y;
+    /* The nearest enemy from the last update, chasers go for it. */
+    bool target;
+    uint16_t target_x;
+    uint16_t target_y;
+    uint64_t asked;
+    uint64_t connected;
+    /* Send time of the walk being timed, 0 if none. */
+    uint64_t walk_sent;
+    uint64_t dgrams;
+    uint64_t bytes;
+    uint64_t rtt_sum;
+    uint64_t rtt_max;
+    uint64_t rtt_count;
+};
+
+static struct bot *bots;
+static int nbots = 100;
+static struct rng rng;
+static volatile sig_atomic_t bot_quit = 0;
+
+static void bot_send(struct bot *b, struct msg *m)
+{
+    uint8_t buf[sizeof(struct msg)];
+
+    m->header.id = b->id;
+    m->header.seq = b->seq++;
+    msg_pack(m, buf);
+
+    /* Lost sends are what the loss counters are for. */
+    if(send(b->fd, buf, sizeof(buf), 0) < 0 && errno != EAGAIN) {
+        perror("send");
+    }
+}
+
+static void bot_connect_ask(struct bot *b, int i, uint64_t now)
+{
+    struct msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = MSGTYPE_CONNECT_ASK;
+    snprintf((char *) m.event.connect_ask.nick, NICK_MAX_LEN, "bot%d", i);
+    bot_send(b, &m);
+    b->asked = now;
+}
+
+static void bot_walk(struct bot *b, uint64_t now)
+{
+    struct msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = MSGTYPE_WALK;
+    m.event.walk.direction = b->direction;
+    bot_send(b, &m);
+
+    if(b->walk_sent == 0 || now - b->walk_sent > BOT_RTT_TIMEOUT_NS) {
+        b->walk_sent = now;
+    }
+}
+
+static void bot_shoot(struct bot *b)
+{
+    struct msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = MSGTYPE_SHOOT;
+    m.event.shoot.direction = b->direction;
+    bot_send(b, &m);
+}
+
+static void bot_wander(struct bot *b, uint64_t now)
+{
+    if(b->steps == 0) {
+        b->direction = rng_range(&rng, 4);
+        b->steps = 1 + rng_range(&rng, 8);
+    }
+
+    b->steps--;
+    bot_walk(b, now);
+}
+
+/* Walks to the nearest enemy, shoots when it's on the same line. */
+static void bot_chase(struct bot *b, uint64_t now)
+{
+    int dx, dy;
+
+    if(!b->target) {
+        bot_wander(b, now);
+        return;
+    }
+
+    dx = b->target_x - b->pos_x;
+    dy = b->target_y - b->pos_y;
+
+    if(abs(dx) > abs(dy)) {
+        b->direction = dx < 0 ? DIRECTION_LEFT : DIRECTION_RIGHT;
+    } else {
+        b->direction = dy < 0 ? DIRECTION_UP : DIRECTION_DOWN;
+    }
+
+    if(dx == 0 || dy == 0) {
+        bot_shoot(b);
+    }
+    bot_walk(b, now);
+}
+
+/* Shoots every tick and turns now and then, walks every fourth tick. */
+static void bot_spam(struct bot *b, uint64_t now)
+{
+    if(b->steps == 0) {
+        b->direction = rng_range(&rng, 4);
+        b->steps = 4;
+    }
+
+    b->steps--;
+    bot_shoot(b);
+    if(b->steps == 0) {
+        bot_walk(b, now);
+    }
+}
+
+static void bots_tick(uint64_t now)
+{
+    int i;
+
+    for(i = 0; i < nbots; i++) {
+        struct bot *b = &bots[i];
+
+        switch(b->state) {
+        case BOT_CONNECTING:
+            if(now - b->asked >= BOT_CONNECT_RETRY_NS) {
+                bot_connect_ask(b, i, now);
+            }
+            break;
+        case BOT_PLAYING:
+            switch(b->behaviour) {
+            case BOT_WANDER:
+                bot_wander(b, now);
+                break;
+            case BOT_CHASE:
+                bot_chase(b, now);
+                break;
+            case BOT_SPAM:
+                bot_spam(b, now);
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void bot_on_msg(struct bot *b, struct msg *m, uint64_t now)
+{
+    switch(m->type) {
+    case MSGTYPE_CONNECT_OK:
+        if(b->state != BOT_CONNECTING) {
+            break;
+        }
+        if(m->event.connect_ok.ok) {
+            b->id = m->event.connect_ok.id;
+            b->state = BOT_PLAYING;
+            b->connected = now;
+        } else {
+            b->state = BOT_REJECTED;
+        }
+        break;
+    case MSGTYPE_PLAYER_POSITION:
+        b->pos_x = m->event.player_position.pos_x;
+        b->pos_y = m->event.player_position.pos_y;
+        if(b->walk_sent != 0) {
+            uint64_t rtt = now - b->walk_sent;
+
+            b->rtt_sum += rtt;
+            b->rtt_count++;
+            if(rtt > b->rtt_max) {
+                b->rtt_max = rtt;
+            }
+            b->walk_sent = 0;
+        }
+        break;
+    case MSGTYPE_ENEMY_POSITION: {
+        uint16_t x = m->event.enemy_position.pos_x;
+        uint16_t y = m->event.enemy_position.pos_y;
+
+        /* Player sees itself too. */
+        if(x == b->pos_x && y == b->pos_y) {
+            break;
+        }
+        if(!b->target ||
+           abs(x - b->pos_x) + abs(y - b->pos_y) <
+           abs(b->target_x - b->pos_x) + abs(b->target_y - b->pos_y)) {
+            b->target = true;
+            b->target_x = x;
+            b->target_y = y;
+        }
+        break;
+    }
+    case MSGTYPE_DISCONNECT_SERVER:
+        b->state = BOT_DISCONNECTED;
+        break;
+    default:
+        break;
+    }
+}
+
+static void bot_recv(struct bot *b, uint64_t now)
+{
+    uint8_t buf[MSGBATCH_BYTES];
+    ssize_t len;
+
+    while((len = recv(b->fd, buf, sizeof(buf), 0)) > 0) {
+        struct msg m;
+        int i, n = buf[0];
+
+        if(b->state == BOT_PLAYING) {
+            b->dgrams++;
+            b->bytes += len;
+        }
+
+        if(len < 1 + n * (ssize_t) sizeof(struct msg)) {
+            WARN("bot %u: batch is truncated.\n", b->id);
+            continue;
+        }
+
+        b->target = false;
+        for(i = 0; i < n; i++) {
+            if(msg_unpack(&buf[1 + i * sizeof(struct msg)], &m)) {
+                bot_on_msg(b, &m, now);
+            }
+        }
+    }
+}
+
+static double bot_loss(struct bot *b, uint64_t now)
+{
+    uint64_t expected = (now - b->connected) / TICK_NS;
+
+    if(expected == 0 || b->dgrams >= expected) {
+        return 0;
+    }
+
+    return 100.0 * (expected - b->dgrams) / expected;
+}
+
+static double bot_rate(struct bot *b, uint64_t now)
+{
+    if(now <= b->connected) {
+        return 0;
+    }
+
+    return b->dgrams * 1e9 / (now - b->connected);
+}
+
+/* One line over all bots: their states, mean RTT, worst RTT, mean update
+ * rate and loss of playing bots.
+ */
+static void bots_report(uint64_t now)
+{
+    uint64_t rtt_sum = 0, rtt_count = 0, rtt_max = 0;
+    double rate = 0, loss = 0;
+    int i, states[BOT_DISCONNECTED + 1] = {0};
+
+    for(i = 0; i < nbots; i++) {
+        struct bot *b = &bots[i];
+
+        states[b->state]++;
+        if(b->state != BOT_PLAYING) {
+            continue;
+        }
+
+        rtt_sum += b->rtt_sum;
+        rtt_count += b->rtt_count;
+        if(b->rtt_max > rtt_max) {
+            rtt_max = b->rtt_max;
+        }
+        rate += bot_rate(b, now);
+        loss += bot_loss(b, now);
+    }
+
+    printf("bots: %d playing, %d connecting, %d rejected, %d disconnected; "
+           "rtt avg %.2f ms, max %.2f ms; %.2f updates/s; loss %.2f%%\n",
+           states[BOT_PLAYING], states[BOT_CONNECTING], states[BOT_REJECTED],
+           states[BOT_DISCONNECTED],
+           rtt_count > 0 ? rtt_sum / 1e6 / rtt_count : 0, rtt_max / 1e6,
+           states[BOT_PLAYING] > 0 ? rate / states[BOT_PLAYING] : 0,
+           states[BOT_PLAYING] > 0 ? loss / states[BOT_PLAYING] : 0);
+    fflush(stdout);
+}
+
+static void bots_report_each(uint64_t now)
+{
+    int i;
+
+    printf("%-6s %-6s %-3s %12s %12s %10s %10s %8s\n", "bot", "kind", "id",
+           "rtt_avg_ms", "rtt_max_ms", "samples", "updates/s", "loss%");
+    for(i = 0; i < nbots; i++) {
+        struct bot *b = &bots[i];
+
+        if(b->connected == 0) {
+            printf("%-6d %-6s %-3s %12s %12s %10s %10s %8s\n", i,
+                   bot_behaviours[b->behaviour], "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+
+        printf("%-6d %-6s %-3u %12.2f %12.2f %10llu %10.2f %8.2f\n", i,
+               bot_behaviours[b->behaviour], b->id,
+               b->rtt_count > 0 ? b->rtt_sum / 1e6 / b->rtt_count : 0,
+               b->rtt_max / 1e6, (unsigned long long) b->rtt_count,
+               bot_rate(b, now), bot_loss(b, now));
+    }
+}
+
+/* Parses "wander:2,chase:1" into weights of behaviours. */
+static bool bot_mix_parse(char *mix, int *weights)
+{
+    char *item;
+    int i;
+
+    memset(weights, 0, sizeof(int) * BOT_BEHAVIOURS);
+
+    for(item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        int weight = 1;
+
+        if(colon != NULL) {
+            *colon = '\0';
+            if((weight = atoi(colon + 1)) < 0) {
+                return false;
+            }
+        }
+
+        for(i = 0; i < BOT_BEHAVIOURS; i++) {
+            if(strcmp(item, bot_behaviours[i]) == 0) {
+                weights[i] += weight;
+                break;
+            }
+        }
+        if(i == BOT_BEHAVIOURS) {
+            return false;
+        }
+    }
+
+    for(i = 0; i < BOT_BEHAVIOURS; i++) {
+        if(weights[i] > 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void bot_stop(int signum)
+{
+    (void) signum;
+    bot_quit = 1;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-d seconds] [-H host] [-m mix] [-n bots] [-p port]\n"
+            "          [-s seconds] [-S seed]\n"
+            "  -d seconds  stop after this time, 0 runs until SIGINT\n"
+            "  -H host     server's address (localhost)\n"
+            "  -m mix      behaviours and their weights, e.g.\n"
+            "              wander:2,chase:1,spam:1 (wander)\n"
+            "  -n bots     number of simulated players (1..%d)\n"
+            "  -p port     server's port (6006)\n"
+            "  -s seconds  summary at this interval (5), 0 disables it\n"
+            "  -S seed     seed of bots' decisions\n",
+            name, BOTS_MAX);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints, *addr = NULL;
+    struct epoll_event ev, events[BOT_EVENTS];
+    struct itimerspec period;
+    struct rlimit rl;
+    char *host = "localhost", *port = "6006", mixdefault[] = "wander";
+    char *mix = mixdefault;
+    int weights[BOT_BEHAVIOURS], total = 0;
+    int err, i, opt, epfd, tfd;
+    int duration = 0, interval = 5;
+    uint64_t seed = 0, now, start, reported;
+
+    while((opt = getopt(argc, argv, "d:H:m:n:p:s:S:")) != -1) {
+        switch(opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'n':
+            nbots = atoi(optarg);
+            if(nbots < 1 || nbots > BOTS_MAX) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 's':
+            interval = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if(!bot_mix_parse(mix, weights)) {
+        usage(argv[0]);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_ADDRCONFIG;
+    hints.ai_socktype = SOCK_DGRAM;
+    err = getaddrinfo(host, port, &hints, &addr);
+    if(err != 0)
+        error(EXIT_FAILURE, 0, "getaddrinfo: %s", gai_strerror(err));
+
+    /* A socket per bot. */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    rng_seed(&rng, seed, 0);
+    bots = calloc(nbots, sizeof(struct bot));
+
+    for(i = 0; i < BOT_BEHAVIOURS; i++) {
+        total += weights[i];
+    }
+
+    for(i = 0; i < nbots; i++) {
+        struct bot *b = &bots[i];
+        int slot = i % total;
+
+        /* Mix is kept exact: behaviours are dealt out by their weights. */
+        for(b->behaviour = 0; slot >= weights[b->behaviour]; b->behaviour++) {
+            slot -= weights[b->behaviour];
+        }
+
+        b->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK,
+                       addr->ai_protocol);
+        if(b->fd < 0 || connect(b->fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+            perror("bot socket");
+            exit(EXIT_FAILURE);
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev);
+    }
+    freeaddrinfo(addr);
+
+    /* Bots act once per server's tick. */
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    period.it_interval.tv_sec = TICK_NS / 1000000000ULL;
+    period.it_interval.tv_nsec = TICK_NS % 1000000000ULL;
+    period.it_value = period.it_interval;
+    timerfd_settime(tfd, 0, &period, NULL);
+    ev.events = EPOLLIN;
+    ev.data.u32 = BOTS_MAX;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    signal(SIGINT, bot_stop);
+    signal(SIGTERM, bot_stop);
+
+    start = reported = ticks_get();
+    bots_tick(start);
+
+    while(!bot_quit) {
+        int n = epoll_wait(epfd, events, BOT_EVENTS, -1);
+
+        now = ticks_get();
+
+        for(i = 0; i < n; i++) {
+            if(events[i].data.u32 == BOTS_MAX) {
+                uint64_t expirations;
+
+                if(read(tfd, &expirations, sizeof(expirations)) > 0) {
+                    bots_tick(now);
+                }
+            } else {
+                bot_recv(&bots[events[i].data.u32], now);
+            }
+        }
+
+        if(interval > 0 && now - reported >= interval * 1000000000ULL) {
+            bots_report(now);
+            reported = now;
+        }
+
+        if(duration > 0 && now - start >= duration * 1000000000ULL) {
+            break;
+        }
+    }
+
+    now = ticks_get();
+    for(i = 0; i < nbots; i++) {
+        if(bots[i].state == BOT_PLAYING) {
+            struct msg m;
+
+            memset(&m, 0, sizeof(m));
+            m.type = MSGTYPE_DISCONNECT_CLIENT;
+            m.event.disconnect_client.stub = 1;
+            bot_send(&bots[i], &m);
+        }
+    }
+
+    bots_report_each(now);
+    bots_report(now);
+
+    for(i = 0; i < nbots; i++) {
+        close(bots[i].fd);
+    }
+    close(tfd);
+    close(epfd);
+    free(bots);
+
+    return 0;
+}
@@ -25,18 +25,24 @@
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <sys/time.h>
+#include <time.h>
 #ifdef __FreeBSD__
 #include <netinet/in.h>
 #endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "cdata.h"
+#ifdef _SERVER_
+#include "server/probes.h"
+#endif
 
 /* Bonuses. */
-struct weapon weapons[WEAPON_SLOTS_MAX] = {
+const struct weapon weapons[WEAPON_SLOTS_MAX] = {
     /*   NAME         INDEX    DMAX  DMIN  BSPEED  BDIST  BCOUNT  EMAP  ERAD */
     {   "gun",   WEAPON_GUN,     8,    2,    0,      0,    100,    1,    0  },
-    {  "rocket", WEAPON_ROCKET, 90,   40,    3,      0,     10,    1,    0  }
+    {  "rocket", WEAPON_ROCKET, 90,   40,    3,      0,     10,    1,    2  }
 };
 
 struct health healths[] = {
@@ -171,6 +177,8 @@ static void msgtype_map_explode_pack(struct msg *m, uint8_t *buf)
     buf += 2;
     pack16_int(buf, htons(m->event.map_explode.h));
     buf += 2;
+    *buf++ = m->event.map_explode.radius;
+    memcpy(buf, m->event.map_explode.mask, MAP_EXPLODE_MASK_LEN);
 }
 
 /* ... and for unpacking. */
@@ -215,7 +223,9 @@ static void msgtype_shoot_unpack(uint8_t *buf, struct msg *m)
 
 static void msgtype_connect_ask_unpack(uint8_t *buf, struct msg *m)
 {
-    strncpy((char *) m->event.connect_ask.nick, (char *) buf, NICK_MAX_LEN);
+    strncpy((char *) m->event.connect_ask.nick, (char *) buf,
+            NICK_MAX_LEN - 1);
+    m->event.connect_ask.nick[NICK_MAX_LEN - 1] = '\0';
 }
 
 static void msgtype_connect_ok_unpack(uint8_t *buf, struct msg *m)
@@ -224,12 +234,15 @@ static void msgtype_connect_ok_unpack(uint8_t *buf, struct msg *m)
     m->event.connect_ok.id = (uint8_t) *buf++;
 
     strncpy((char *) m->event.connect_ok.mapname,
-        (char *) buf, MAP_NAME_MAX_LEN);
+        (char *) buf, MAP_NAME_MAX_LEN - 1);
+    m->event.connect_ok.mapname[MAP_NAME_MAX_LEN - 1] = '\0';
 }
 
 static void msgtype_connect_notify_unpack(uint8_t *buf, struct msg *m)
 {
-    strncpy((char *) m->event.connect_notify.nick, (char *) buf, NICK_MAX_LEN);
+    strncpy((char *) m->event.connect_notify.nick, (char *) buf,
+            NICK_MAX_LEN - 1);
+    m->event.connect_notify.nick[NICK_MAX_LEN - 1] = '\0';
 }
 
 static void msgtype_disconnect_server_unpack(uint8_t *buf, struct msg *m)
@@ -245,7 +258,8 @@ static void msgtype_disconnect_client_unpack(uint8_t *buf, struct msg *m)
 static void msgtype_disconnect_notify_unpack(uint8_t *buf, struct msg *m)
 {
     strncpy((char *) m->event.disconnect_notify.nick,
-        (char *) buf, NICK_MAX_LEN);
+        (char *) buf, NICK_MAX_LEN - 1);
+    m->event.disconnect_notify.nick[NICK_MAX_LEN - 1] = '\0';
 }
 
 static void msgtype_on_bonus_unpack(uint8_t *buf, struct msg *m)
@@ -260,6 +274,8 @@ static void msgtype_map_explode_unpack(uint8_t *buf, struct msg *m)
     buf += 2;
     m->event.map_explode.h = ntohs(unpack16_int(buf));
     buf += 2;
+    m->event.map_explode.radius = *buf++;
+    memcpy(m->event.map_explode.mask, buf, MAP_EXPLODE_MASK_LEN);
 }
 
 /* Because I hate switches and all these condition statements I prefer to use
@@ -343,6 +359,10 @@ enum msg_batch_enum_t msg_batch_push(struct msg_batch *b, struct msg *m)
         return MSGBATCH_OK;
     }
 
+#ifdef _SERVER_
+    PROBE2(batch_overflow, MSGBATCH_SIZE(b), m->type);
+#endif
+
     return MSGBATCH_ERROR;
 }
 
@@ -358,46 +378,102 @@ uint8_t *msg_batch_pop(struct msg_batch *b)
     return NULL;
 }
 
-/* TODO: understand and rewrite this comment. */
-/* These functions work in fact with ms. */
+/* Monotonic time in nanoseconds. */
 uint64_t ticks_get(void)
 {
-    struct timeval t;
+    struct timespec t;
 
-    if(gettimeofday(&t, NULL) < 0) {
-        perror("cdata: gettimeofday");
-        exit(EXIT_FAILURE);
-    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
 
-    return (((uint64_t) t.tv_sec) * 1000) + (((uint64_t) t.tv_usec) / 1000);
+    return ((uint64_t) t.tv_sec) * 1000000000 + (uint64_t) t.tv_nsec;
 }
 
-struct ticks *ticks_start(void)
+void ticks_start(struct ticks *tc)
 {
-    struct ticks *tc;
-
-    tc = malloc(sizeof(struct ticks));
-
     tc->offset = ticks_get();
-    tc->count = 0;
+    tc->last = tc->offset;
+}
 
-    return tc;
+void ticks_update(struct ticks *tc)
+{
+    tc->last = ticks_get();
 }
 
-void ticks_finish(struct ticks *tc)
+/* Nanoseconds since the last update. */
+uint64_t ticks_get_diff(struct ticks *tc)
 {
-    free(tc);
+    return ticks_get() - tc->last;
 }
 
-void ticks_update(struct ticks *tc)
+/* Sleeps until `period' ns after the previous tick and starts the next
+ * one. Deadlines are absolute, so time spent in the tick and oversleeping
+ * don't shift the following ticks; if the caller is late by more than a
+ * period, it is resynced to now instead of catching up with a burst.
+ */
+void ticks_wait(struct ticks *tc, uint64_t period)
+{
+    uint64_t deadline = tc->last + period;
+    uint64_t now = ticks_get();
+
+    if(now < deadline) {
+        struct timespec req;
+
+        req.tv_sec = deadline / 1000000000;
+        req.tv_nsec = deadline % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL) != 0);
+
+        tc->last = deadline;
+    } else if(now - deadline < period) {
+        tc->last = deadline;
+    } else {
+        tc->last = now;
+    }
+}
+
+/* Cheap timestamp for instrumentation of hot paths: CPU's cycle counter
+ * where it's available, nanoseconds otherwise. Only differences between
+ * timestamps of the same machine make sense, ticks_cycles_to_ns() turns
+ * them to nanoseconds.
+ */
+static double ticks_ns_per_cycle = 1.0;
+
+uint64_t ticks_cycles(void)
 {
-    tc->count = ticks_get() - tc->offset;
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+
+    return v;
+#else
+    return ticks_get();
+#endif
 }
 
-uint64_t ticks_get_diff(struct ticks *tc)
+/* Measures the rate of the cycle counter, should be called once at
+ * startup before ticks_cycles_to_ns() is used.
+ */
+void ticks_calibrate(void)
 {
+    struct timespec req = { 0, 20000000 };
+    uint64_t ns0, ns1, c0, c1;
+
+    ns0 = ticks_get();
+    c0 = ticks_cycles();
+    nanosleep(&req, NULL);
+    ns1 = ticks_get();
+    c1 = ticks_cycles();
 
-    return ticks_get() - (tc->offset + tc->count);
+    if(c1 > c0) {
+        ticks_ns_per_cycle = (double) (ns1 - ns0) / (double) (c1 - c0);
+    }
+}
+
+uint64_t ticks_cycles_to_ns(uint64_t cycles)
+{
+    return (uint64_t) (cycles * ticks_ns_per_cycle);
 }
 
 struct player *player_init(void)
@@ -408,9 +484,9 @@ struct player *player_init(void)
     memset(p, 0, sizeof(struct player));
     p->nick = malloc(sizeof(uint8_t) * NICK_MAX_LEN);
 #ifdef _SERVER_
-    p->addr = malloc(sizeof(struct sockaddr_storage));
+    p->route = malloc(sizeof(struct net_route));
 #endif
-    p->hp = 100;
+    p->hp = PLAYER_HP_MAX;
     p->armor = 50;
 
     return p;
@@ -420,18 +496,197 @@ void player_free(struct player *p)
 {
     free(p->nick);
 #ifdef _SERVER_
-    free(p->addr);
+    free(p->route);
+    free(p->msgbatch_full);
 #endif
     free(p);
 }
 
-/* TODO: load map from file. */
+/* Bonuses which are placed on the map by its symbols. */
+static struct map_bonus_symbol {
+    char symbol;
+    uint8_t type;
+    uint8_t index;
+} map_bonus_symbols[] = {
+    { MAP_BONUS_ROCKET, BONUSTYPE_WEAPON, WEAPON_ROCKET },
+    { MAP_BONUS_HBIG,   BONUSTYPE_HEALTH, HEALTH_BIG    },
+    { MAP_BONUS_HSMALL, BONUSTYPE_HEALTH, HEALTH_SMALL  },
+    { MAP_BONUS_AHEAVY, BONUSTYPE_ARMOR,  ARMOR_HEAVY   },
+    { MAP_BONUS_ALIGHT, BONUSTYPE_ARMOR,  ARMOR_LIGHT   }
+};
+
+static struct map_bonus_symbol *map_bonus_symbol(char c)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(map_bonus_symbols) / sizeof(map_bonus_symbols[0]); i++) {
+        if(map_bonus_symbols[i].symbol == c) {
+            return &(map_bonus_symbols[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/* Shared chunks, see the comment near `struct map_chunk'. */
+#define MAP_CHUNK_FILL(v) { [0 ... MAP_CHUNK_SIZE - 1] = v }
+
+struct map_chunk map_chunk_empty = {
+    MAP_CHUNK_FILL(MAP_CHUNK_FILL(MAP_EMPTY))
+};
+struct map_chunk map_chunk_wall = {
+    MAP_CHUNK_FILL(MAP_CHUNK_FILL(MAP_WALL))
+};
+struct map_bits map_bits_empty;
+struct map_bits map_bits_wall = {
+    MAP_CHUNK_FILL(~(uint64_t) 0),
+    MAP_CHUNK_FILL(~(uint64_t) 0)
+};
+
+void map_bits_mark(struct map_bits *bits, uint16_t w, uint16_t h, int on)
+{
+    if(on) {
+        bits->rows[h] |= (uint64_t) 1 << w;
+        bits->cols[w] |= (uint64_t) 1 << h;
+    } else {
+        bits->rows[h] &= ~((uint64_t) 1 << w);
+        bits->cols[w] &= ~((uint64_t) 1 << h);
+    }
+}
+
+/* Builds bitmap of walls for a materialised chunk. */
+static struct map_bits *map_bits_walls(struct map_chunk *chunk)
+{
+    struct map_bits *bits = malloc(sizeof(struct map_bits));
+    int w, h;
+
+    memset(bits, 0, sizeof(struct map_bits));
+
+    for(h = 0; h < MAP_CHUNK_SIZE; h++) {
+        for(w = 0; w < MAP_CHUNK_SIZE; w++) {
+            if(chunk->objs[h][w] == MAP_WALL) {
+                map_bits_mark(bits, w, h, 1);
+            }
+        }
+    }
+
+    return bits;
+}
+
+/* Looks for the nearest marked cell from (w, h) in `direction', cell
+ * (w, h) itself is not checked. Missing (NULL) chunks of `bits' have no
+ * marks. Returns the distance to the cell if it's not farther than `n'
+ * and lies within the map, otherwise 0.
+ */
+int map_bits_scan(struct map_bits **bits, struct map *m, uint16_t w,
+                  uint16_t h, uint8_t direction, int n)
+{
+    int horizontal = direction == DIRECTION_LEFT ||
+        direction == DIRECTION_RIGHT;
+    int forward = direction == DIRECTION_RIGHT ||
+        direction == DIRECTION_DOWN;
+    /* Position along the line and the line itself. */
+    int pos = horizontal ? w : h;
+    int line = horizontal ? h : w;
+    int size = horizontal ? m->width : m->height;
+    int i = 1;
+
+    if(line >= (horizontal ? m->height : m->width)) {
+        return 0;
+    }
+
+    while(i <= n) {
+        int cur = forward ? pos + i : pos - i;
+        struct map_bits *chunk;
+        uint64_t word = 0;
+        int bit, found;
+
+        if(cur < 0 || cur >= size) {
+            break;
+        }
+
+        chunk = horizontal ?
+            bits[(line >> MAP_CHUNK_BITS) * m->chunks_w + (cur >> MAP_CHUNK_BITS)] :
+            bits[(cur >> MAP_CHUNK_BITS) * m->chunks_w + (line >> MAP_CHUNK_BITS)];
+        if(chunk != NULL) {
+            word = horizontal ? chunk->rows[line & MAP_CHUNK_MASK] :
+                chunk->cols[line & MAP_CHUNK_MASK];
+        }
+
+        bit = cur & MAP_CHUNK_MASK;
+
+        if(forward) {
+            word &= ~(uint64_t) 0 << bit;
+            if(word == 0) {
+                i += MAP_CHUNK_SIZE - bit;
+                continue;
+            }
+
+            found = (cur & ~MAP_CHUNK_MASK) + __builtin_ctzll(word);
+            i = found - pos;
+
+            return i <= n && found < size ? i : 0;
+        } else {
+            word &= bit == MAP_CHUNK_MASK ? ~(uint64_t) 0 :
+                ((uint64_t) 1 << (bit + 1)) - 1;
+            if(word == 0) {
+                i += bit + 1;
+                continue;
+            }
+
+            found = (cur & ~MAP_CHUNK_MASK) + MAP_CHUNK_MASK - __builtin_clzll(word);
+            i = pos - found;
+
+            return i <= n ? i : 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Picks a chunk for rows `rows' (MAP_CHUNK_SIZE lines of the map file,
+ * starting at `h0') and chunk column `cw'. Uniform chunks are shared.
+ */
+static struct map_chunk *map_chunk_make(struct map *m, char **rows,
+                                        int h0, int cw)
+{
+    struct map_chunk *chunk;
+    int w, h, w0 = cw << MAP_CHUNK_BITS, empty = 1, wall = 1;
+
+    for(h = 0; h < MAP_CHUNK_SIZE && h0 + h < m->height; h++) {
+        for(w = 0; w < MAP_CHUNK_SIZE && w0 + w < m->width; w++) {
+            if(rows[h][w0 + w] == MAP_WALL) {
+                empty = 0;
+            } else {
+                wall = 0;
+            }
+        }
+    }
+
+    if(empty) {
+        return &map_chunk_empty;
+    } else if(wall) {
+        return &map_chunk_wall;
+    }
+
+    chunk = malloc(sizeof(struct map_chunk));
+    memset(chunk, MAP_EMPTY, sizeof(struct map_chunk));
+
+    for(h = 0; h < MAP_CHUNK_SIZE && h0 + h < m->height; h++) {
+        for(w = 0; w < MAP_CHUNK_SIZE && w0 + w < m->width; w++) {
+            chunk->objs[h][w] = rows[h][w0 + w];
+        }
+    }
+
+    return chunk;
+}
+
 struct map *map_load(uint8_t *name)
 {
     struct map *m = malloc(sizeof(struct map));
-    char path[4096], c;
+    char path[4096], c, *rows[MAP_CHUNK_SIZE];
     FILE *fmap;
-    int w, h;
+    int w, h, ch, cw, allocated = 0;
 
     memset(m, 0, sizeof(struct map));
 
@@ -482,47 +737,93 @@ struct map *map_load(uint8_t *name)
 
     fseek(fmap, 0L, SEEK_SET);
 
-    m->objs = malloc(sizeof(uint8_t *) * m->height);
-    for(h = 0; h < m->height; h++) {
-        m->objs[h] = malloc(sizeof(uint8_t) * m->width);
+    m->chunks_w = (m->width + MAP_CHUNK_MASK) >> MAP_CHUNK_BITS;
+    m->chunks_h = (m->height + MAP_CHUNK_MASK) >> MAP_CHUNK_BITS;
+    m->chunks = calloc((size_t) m->chunks_w * m->chunks_h,
+                       sizeof(struct map_chunk *));
+    m->walls = calloc((size_t) m->chunks_w * m->chunks_h,
+                      sizeof(struct map_bits *));
+
+    /* The file is read by bands of MAP_CHUNK_SIZE lines, every band is
+     * split into chunks as soon as it is read.
+     */
+    for(h = 0; h < MAP_CHUNK_SIZE; h++) {
+        rows[h] = malloc(m->width + 1);
     }
 
-    h = 0;
-    while((c = getc(fmap)) != EOF) {
-        w = 0;
+    for(ch = 0; ch < m->chunks_h; ch++) {
+        for(h = 0; h < MAP_CHUNK_SIZE && (ch << MAP_CHUNK_BITS) + h < m->height; h++) {
+            for(w = 0; (c = getc(fmap)) != '\n' && c != EOF; w++) {
+                int y = (ch << MAP_CHUNK_BITS) + h;
 
-        while(c != '\n') {
-            if(c == MAP_EMPTY || c == MAP_WALL) {
-                m->objs[h][w] = c;
-            } else if(c == MAP_RESPAWN) {
+                if(c == MAP_RESPAWN) {
 #ifdef _SERVER_
-                /* FIXME: WHY -1? */
-                if(m->respawns_count < MAP_RESPAWNS_MAX - 1) {
-                    m->respawns[m->respawns_count].w = w;
-                    m->respawns[m->respawns_count].h = h;
-                    m->respawns_count++;
-                } else {
-                    printf("%c, %d\n", c, w);
-                    printf("Max count of respawns was reached: %d.\n", MAP_RESPAWNS_MAX);
-                }
+                    /* FIXME: WHY -1? */
+                    if(m->respawns_count < MAP_RESPAWNS_MAX - 1) {
+                        m->respawns[m->respawns_count].w = w;
+                        m->respawns[m->respawns_count].h = y;
+                        m->respawns_count++;
+                    } else {
+                        printf("%c, %d\n", c, w);
+                        printf("Max count of respawns was reached: %d.\n", MAP_RESPAWNS_MAX);
+                    }
 #endif
-                m->objs[h][w] = MAP_EMPTY;
-            } else {
-                printf("Incorrect symbol '%c' has been found at %dx%d.\n", c, w, h);
-                fclose(fmap);
-                map_unload(m);
+                    c = MAP_EMPTY;
+                } else if(map_bonus_symbol(c) != NULL) {
+#ifdef _SERVER_
+                    if(m->bonuses_count < MAP_BONUSES_MAX) {
+                        struct map_bonus *mb = &(m->bonuses[m->bonuses_count++]);
+
+                        mb->w = w;
+                        mb->h = y;
+                        mb->type = map_bonus_symbol(c)->type;
+                        mb->index = map_bonus_symbol(c)->index;
+                    } else {
+                        printf("Max count of bonuses was reached: %d.\n", MAP_BONUSES_MAX);
+                    }
+#endif
+                    c = MAP_EMPTY;
+                } else if(c != MAP_EMPTY && c != MAP_WALL) {
+                    printf("Incorrect symbol '%c' has been found at %dx%d.\n", c, w, y);
+                    fclose(fmap);
+                    for(h = 0; h < MAP_CHUNK_SIZE; h++) {
+                        free(rows[h]);
+                    }
+                    map_unload(m);
+
+                    return NULL;
+                }
 
-                return NULL;
+                rows[h][w] = c;
             }
+        }
 
-            c = fgetc(fmap);
-            w++;
+        for(cw = 0; cw < m->chunks_w; cw++) {
+            struct map_chunk *chunk = map_chunk_make(m, rows,
+                                                     ch << MAP_CHUNK_BITS, cw);
+
+            if(chunk == &map_chunk_empty) {
+                m->walls[ch * m->chunks_w + cw] = &map_bits_empty;
+            } else if(chunk == &map_chunk_wall) {
+                m->walls[ch * m->chunks_w + cw] = &map_bits_wall;
+            } else {
+                m->walls[ch * m->chunks_w + cw] = map_bits_walls(chunk);
+                allocated++;
+            }
+
+            m->chunks[ch * m->chunks_w + cw] = chunk;
         }
+    }
 
-        h++;
+    for(h = 0; h < MAP_CHUNK_SIZE; h++) {
+        free(rows[h]);
     }
 
-    strncpy((char *) m->name, (char *) name, MAP_NAME_MAX_LEN);
+    DEBUG("Map %s: %dx%d, %d of %d chunks allocated.\n", name,
+          m->width, m->height, allocated, m->chunks_w * m->chunks_h);
+
+    strncpy((char *) m->name, (char *) name, MAP_NAME_MAX_LEN - 1);
+    m->name[MAP_NAME_MAX_LEN - 1] = '\0';
 
     fclose(fmap);
 
@@ -531,25 +832,61 @@ struct map *map_load(uint8_t *name)
 
 void map_unload(struct map *m)
 {
-    int h;
+    int i;
 
-    for(h = 0; h < m->height; h++) {
-        free(m->objs[h]);
+    for(i = 0; i < m->chunks_w * m->chunks_h; i++) {
+        if(m->chunks[i] != NULL && !MAP_CHUNK_SHARED(m->chunks[i])) {
+            free(m->chunks[i]);
+            free(m->walls[i]);
+        }
     }
 
-    free(m->objs);
+    free(m->chunks);
+    free(m->walls);
     free(m);
 }
 
+/* Writes object `o' to cell (w, h). Shared chunk is copied before the
+ * first write to it, writing the value it already holds is a no-op.
+ */
+void map_set(struct map *m, uint16_t w, uint16_t h, uint8_t o)
+{
+    size_t i = (h >> MAP_CHUNK_BITS) * m->chunks_w + (w >> MAP_CHUNK_BITS);
+    struct map_chunk **chunk = &(m->chunks[i]);
+    uint8_t *obj = &((*chunk)->objs[h & MAP_CHUNK_MASK][w & MAP_CHUNK_MASK]);
+
+    if(*obj == o) {
+        return;
+    }
+
+    if(MAP_CHUNK_SHARED(*chunk)) {
+        struct map_chunk *copy = malloc(sizeof(struct map_chunk));
+        struct map_bits *bits = malloc(sizeof(struct map_bits));
+
+        memcpy(copy, *chunk, sizeof(struct map_chunk));
+        memcpy(bits, m->walls[i], sizeof(struct map_bits));
+        *chunk = copy;
+        m->walls[i] = bits;
+        obj = &(copy->objs[h & MAP_CHUNK_MASK][w & MAP_CHUNK_MASK]);
+    }
+
+    if(*obj == MAP_WALL || o == MAP_WALL) {
+        map_bits_mark(m->walls[i], w & MAP_CHUNK_MASK, h & MAP_CHUNK_MASK,
+                      o == MAP_WALL);
+    }
+
+    *obj = o;
+}
+
 #ifdef _SERVER_
 /* TODO: add `struct bonuses_list`, bullets, etc. */
 enum collision_enum_t collision_check_player(struct player *p,
                                              struct map *m,
                                              struct players_slots *s)
 #elif _CLIENT_
-/* On client we need to check only for MAP_WALL and MAP_PLAYER cases, because
- * in other cases we can put player on bullet or bonus and nothing terrible
- * will happen.
+/* On client we need to check only for MAP_WALL case, because player can be
+ * put on bullet or bonus and nothing terrible will happen. Other players
+ * aren't in the map, the client checks them in its entity layer.
  */
 enum collision_enum_t collision_check_player(struct player *p, struct map *m)
 #endif
@@ -558,7 +895,7 @@ enum collision_enum_t collision_check_player(struct player *p, struct map *m)
     struct players_slot *slot = s->root;
 #endif
     if(p->pos_x <= 0 || p->pos_y <= 0 || p->pos_x >= m->width + 1 ||
-       p->pos_y >= m->height + 1 || m->objs[p->pos_y - 1][p->pos_x - 1] == MAP_WALL) {
+       p->pos_y >= m->height + 1 || MAP_OBJ(m, p->pos_x - 1, p->pos_y - 1) == MAP_WALL) {
         return COLLISION_WALL;
     }
 #ifdef _SERVER_
@@ -571,10 +908,6 @@ enum collision_enum_t collision_check_player(struct player *p, struct map *m)
 
         slot = slot->next;
     }
-#elif _CLIENT_
-    if(m->objs[p->pos_y - 1][p->pos_x - 1] == MAP_PLAYER) {
-        return COLLISION_PLAYER;
-    }
 #endif
 
     return COLLISION_NONE;
@@ -25,7 +25,40 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef _SERVER_
+#include <sys/socket.h> /* struct sockaddr_storage of struct net_route */
+#endif
+
+enum log_level_enum_t {
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARN
+};
+
+#ifdef _SERVER_
+/* Server's threads don't write logs themselves, messages are passed to the
+ * logging thread (see server/log.c), so a slow terminal can't stall ticks.
+ * Messages below `log_level' are dropped before they are formatted.
+ */
+extern int log_level;
+void log_write(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG(level, format, ...)                                         \
+    do {                                                                \
+        if((level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {  \
+            log_write(level, format, ##__VA_ARGS__);                    \
+        }                                                               \
+    } while(0)
+
+#ifdef _DEBUG_
+#define DEBUG(format, ...) LOG(LOG_DEBUG, "[ DEBUG ]: " format, ##__VA_ARGS__)
+#else
+#define DEBUG(format, ...) do { } while(0)
+#endif
 
+#define INFO(format, ...) LOG(LOG_INFO, "[ INFO ]: " format, ##__VA_ARGS__)
+#define WARN(format, ...) LOG(LOG_WARN, "[ WARN ]: " format, ##__VA_ARGS__)
+#else
 #ifdef _DEBUG_
 #define DEBUG(format, ...)                              \
     do {                                                \
@@ -44,6 +77,7 @@
     do {                                                         \
         fprintf(stderr, "[ WARN ]: " format, ##__VA_ARGS__);     \
     } while(0)
+#endif
 
 /* Must be less than 25 because terminal's geometry is 80x25
  * minus status lines on top and bottom of screen.
@@ -66,10 +100,16 @@
 #define MAP_PLAYER '@'
 #define MAP_BULLET '*'
 #define MAP_RESPAWN '!'
+/* Bonus spawn points, see map_bonus_symbols[] in cdata.c. */
+#define MAP_BONUS_ROCKET 'r'
+#define MAP_BONUS_HBIG 'H'
+#define MAP_BONUS_HSMALL 'h'
+#define MAP_BONUS_AHEAVY 'A'
+#define MAP_BONUS_ALIGHT 'a'
 #define MAP_NAME_MAX_LEN 32
 
 /* TODO: rewrite this comment */
-/* On server side `**objs` can contain only MAP_WALL and MAP_EMPTY symbols,
+/* On server side map's cells can contain only MAP_WALL and MAP_EMPTY symbols,
  * because information about bullets, players, etc is in actual state and
  * full detailed on arrays, structes and lists.
  * Client must draw objects on a screen only and nothing more, that's why
@@ -85,17 +125,74 @@ struct map_respawn {
     uint16_t w;
     uint16_t h;
 };
+
+#define MAP_BONUSES_MAX 64
+
+struct map_bonus {
+    uint16_t w;
+    uint16_t h;
+    uint8_t type;
+    uint8_t index;
+};
 #endif
 
+/* Map is stored as square chunks allocated on demand. Chunks which are
+ * entirely empty or entirely walls are not allocated at all, they point to
+ * shared read-only sentinels, so memory is proportional to the interesting
+ * part of the map only. The sentinel is replaced by a private copy on the
+ * first map_set() to it.
+ */
+#define MAP_CHUNK_BITS 6
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_BITS)
+#define MAP_CHUNK_MASK (MAP_CHUNK_SIZE - 1)
+
+struct map_chunk {
+    uint8_t objs[MAP_CHUNK_SIZE][MAP_CHUNK_SIZE];
+};
+
+/* Bitmaps of a chunk: bit `w' of rows[h] and bit `h' of cols[w] are set
+ * for marked cell (w, h) of the chunk. A row or a column of a chunk is one
+ * word, so the nearest marked cell along a line is found a word at a time.
+ */
+#if MAP_CHUNK_SIZE != 64
+#error "map_bits expect 64 cells per chunk's line"
+#endif
+
+struct map_bits {
+    uint64_t rows[MAP_CHUNK_SIZE];
+    uint64_t cols[MAP_CHUNK_SIZE];
+};
+
+extern struct map_chunk map_chunk_empty;
+extern struct map_chunk map_chunk_wall;
+extern struct map_bits map_bits_empty;
+extern struct map_bits map_bits_wall;
+
+#define MAP_CHUNK_SHARED(c) ((c) == &map_chunk_empty || (c) == &map_chunk_wall)
+
+#define MAP_CHUNK(m, w, h)                                              \
+    ((m)->chunks[((h) >> MAP_CHUNK_BITS) * (m)->chunks_w +              \
+                 ((w) >> MAP_CHUNK_BITS)])
+
+/* Object at cell (w, h), 0-based. Read only, use map_set() for writing. */
+#define MAP_OBJ(m, w, h)                                                \
+    (MAP_CHUNK(m, w, h)->objs[(h) & MAP_CHUNK_MASK][(w) & MAP_CHUNK_MASK])
+
 struct map {
     /* On client's side: if name isn't set, then map isn't loaded yet */
     uint8_t name[MAP_NAME_MAX_LEN];
-    uint8_t **objs;
+    struct map_chunk **chunks;
+    /* Walls of each chunk, shared the same way as chunks are. */
+    struct map_bits **walls;
+    uint16_t chunks_w;
+    uint16_t chunks_h;
     uint16_t width;
     uint16_t height;
 #ifdef _SERVER_
     struct map_respawn respawns[MAP_RESPAWNS_MAX];
     uint8_t respawns_count;
+    struct map_bonus bonuses[MAP_BONUSES_MAX];
+    uint8_t bonuses_count;
 #endif
 };
 
@@ -177,9 +274,20 @@ struct msgtype_on_bonus {
     uint8_t index;
 };
 
+/* All cells destroyed by one explosion. Bit `(dy + radius) * side +
+ * (dx + radius)' of `mask', where side is `radius' * 2 + 1, is set when
+ * cell (w + dx, h + dy) has been destroyed.
+ */
+#define MAP_EXPLODE_RADIUS_MAX 7
+#define MAP_EXPLODE_SIDE_MAX (MAP_EXPLODE_RADIUS_MAX * 2 + 1)
+#define MAP_EXPLODE_MASK_LEN                                    \
+    ((MAP_EXPLODE_SIDE_MAX * MAP_EXPLODE_SIDE_MAX + 7) / 8)
+
 struct msgtype_map_explode {
     uint16_t w;
     uint16_t h;
+    uint8_t radius;
+    uint8_t mask[MAP_EXPLODE_MASK_LEN];
 };
 
 /*
@@ -305,7 +413,7 @@ struct weapon_slots {
     uint8_t current;
 };
 
-extern struct weapon weapons[];
+extern const struct weapon weapons[];
 
 enum {
     DIRECTION_LEFT,
@@ -314,10 +422,37 @@ enum {
     DIRECTION_DOWN
 };
 
+#ifdef _SERVER_
+/* The exact path between the server and a player: the socket player's
+ * datagrams arrive on, the local address they were sent to (taken from
+ * IP_PKTINFO / IPV6_PKTINFO) and the player's address. Replies go out
+ * through this socket from this local address only.
+ */
+struct net_route {
+    int fd;
+    struct sockaddr_storage addr;
+    struct sockaddr_storage local;
+    unsigned int ifindex;
+};
+#endif
+
+#define PLAYER_HP_MAX 100
+#define PLAYER_ARMOR_MAX 100
+
 struct player {
 #ifdef _SERVER_
-    struct sockaddr_storage *addr;
+    struct net_route *route;
     struct msg_batch msgbatch;
+    /* Batches filled up during the tick, each goes out as a datagram of
+     * its own before `msgbatch'. Allocated only for crowded ticks.
+     */
+    struct msg_batch *msgbatch_full;
+    uint16_t msgbatch_full_count;
+    uint16_t msgbatch_full_size;
+    /* Seq of the newest input processed, PLAYER_POSITION echoes it, so
+     * the client knows which of its predicted steps are applied.
+     */
+    uint32_t ack;
 #endif
     uint8_t id; /* slot's number. */
     uint8_t *nick;
@@ -331,7 +466,7 @@ struct player {
 };
 
 #ifdef _SERVER_
-#define MAX_PLAYERS 16
+#define MAX_PLAYERS 255
 
 enum player_enum_t {
     PLAYERS_ERROR = 0,
@@ -365,10 +500,16 @@ enum collision_enum_t {
 };
 
 #define FPS 10
+/* Duration of a tick in nanoseconds. */
+#define TICK_NS (1000000000ULL / FPS)
 
+/* Ticks are counted in nanoseconds of CLOCK_MONOTONIC, which doesn't jump
+ * on clock adjustments. The state lives wherever the caller keeps it,
+ * usually on the stack of the ticking thread.
+ */
 struct ticks {
     uint64_t offset;
-    uint64_t count;
+    uint64_t last;
 };
 
 /* TODO: *understand* and rewrite this comment. */
@@ -385,14 +526,21 @@ bool msg_unpack(uint8_t*, struct msg*);
 enum msg_batch_enum_t msg_batch_push(struct msg_batch*, struct msg*);
 uint8_t *msg_batch_pop(struct msg_batch*);
 uint64_t ticks_get(void);
-struct ticks *ticks_start(void);
+void ticks_start(struct ticks*);
 void ticks_update(struct ticks*);
-void ticks_finish(struct ticks*);
 uint64_t ticks_get_diff(struct ticks*);
+void ticks_wait(struct ticks*, uint64_t);
+uint64_t ticks_cycles(void);
+void ticks_calibrate(void);
+uint64_t ticks_cycles_to_ns(uint64_t);
 struct player *player_init(void);
 void player_free(struct player*);
 struct map *map_load(uint8_t*);
 void map_unload(struct map*);
+void map_set(struct map*, uint16_t, uint16_t, uint8_t);
+int map_bits_scan(struct map_bits**, struct map*, uint16_t, uint16_t,
+                  uint8_t, int);
+void map_bits_mark(struct map_bits*, uint16_t, uint16_t, int);
 #ifdef _SERVER_
 enum collision_enum_t collision_check_player(struct player*,
                                              struct map*,
@@ -38,78 +38,180 @@
 #endif
 
 #include "../cdata.h"
+#include "entities.h"
 #include "ui/backend.h"
 #include "client.h"
 
 pthread_t ui_mngr_thread, ui_event_mngr_thread, recv_mngr_thread, queue_mngr_thread;
 pthread_attr_t common_attr;
-pthread_mutex_t msgqueue_mutex, map_mutex, player_mutex;
-pthread_cond_t queue_mngr_cond;
+pthread_mutex_t map_mutex, player_mutex;
 sem_t queue_mngr_sem;
-struct msg_queue *msgqueue = NULL;
+struct msg_ring *msgring = NULL;
+struct client_view_seqlock published;
 struct player *player = NULL;
 struct map *map = NULL;
+struct prediction prediction;
+struct entities entities;
 int sd;
 
-struct msg_queue *msgqueue_init(void)
+struct msg_ring *msgring_init(void)
 {
-    struct msg_queue *q;
-    int i;
+    return calloc(1, sizeof(struct msg_ring));
+}
+
+void msgring_free(struct msg_ring *r)
+{
+    free(r);
+}
 
-    q = malloc(sizeof(struct msg_queue));
-    for(i = 0; i < MSGQUEUE_INIT_SIZE; i++) {
-        q->data[i] = malloc(sizeof(struct msg));
+/* Called by the receive thread only. */
+enum msg_queue_enum_t msgring_push(struct msg_ring *r, struct msg *m)
+{
+    uint32_t head = r->head;
+
+    if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= MSGRING_SIZE) {
+        return MSGQUEUE_ERROR;
     }
 
-    q->top = -1;
+    memcpy(&(r->data[head % MSGRING_SIZE]), m, sizeof(struct msg));
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
 
-    return q;
+    return MSGQUEUE_OK;
 }
 
-void msgqueue_free(struct msg_queue *q)
+/* Called by the queue thread only, messages come out in order. */
+bool msgring_pop(struct msg_ring *r, struct msg *m)
 {
-    int i;
+    uint32_t tail = r->tail;
 
-    for(i = 0; i < MSGQUEUE_INIT_SIZE; i++) {
-        free(q->data[i]);
+    if(tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        return false;
     }
 
-    free(q);
+    memcpy(m, &(r->data[tail % MSGRING_SIZE]), sizeof(struct msg));
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* Copies the game state for the renderer. Writers are the queue and the
+ * input threads, player_mutex keeps them from publishing at once.
+ */
+void view_publish(void)
+{
+    uint32_t seq;
+
+    pthread_mutex_lock(&player_mutex);
+    seq = published.seq;
+    __atomic_store_n(&published.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&published.view.player, player, sizeof(struct player));
+    memcpy(&published.view.entities, &entities, sizeof(struct entities));
+
+    __atomic_store_n(&published.seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&player_mutex);
+}
+
+/* Takes the last published state, retries if a writer was in the middle
+ * of publishing.
+ */
+void view_read(struct client_view *v)
+{
+    uint32_t seq;
+
+    do {
+        while((seq = __atomic_load_n(&published.seq, __ATOMIC_ACQUIRE)) & 1);
+
+        memcpy(v, &published.view, sizeof(struct client_view));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&published.seq, __ATOMIC_RELAXED) != seq);
 }
 
-enum msg_queue_enum_t msgqueue_push(struct msg_queue *q, struct msg *m)
+/* When the ring is full, the oldest walk is forgotten: the server will
+ * report its result anyway.
+ */
+void prediction_push(struct prediction *pr, uint32_t seq, uint8_t direction)
 {
-    if(q->top < MSGQUEUE_INIT_SIZE - 1) {
-        q->top++;
-        memcpy(q->data[q->top], m, sizeof(struct msg));
+    struct prediction_input *in;
 
-        return MSGQUEUE_OK;
+    if(pr->count == PREDICTION_INPUTS_MAX) {
+        pr->head = (pr->head + 1) % PREDICTION_INPUTS_MAX;
+        pr->count--;
     }
 
-    return MSGQUEUE_ERROR;
+    in = &(pr->inputs[(pr->head + pr->count) % PREDICTION_INPUTS_MAX]);
+    in->seq = seq;
+    in->direction = direction;
+    pr->count++;
+}
+
+/* Forgets walks which the server has processed by input `ack'. */
+void prediction_ack(struct prediction *pr, uint32_t ack)
+{
+    while(pr->count > 0 &&
+          (int32_t) (pr->inputs[pr->head].seq - ack) <= 0) {
+        pr->head = (pr->head + 1) % PREDICTION_INPUTS_MAX;
+        pr->count--;
+    }
 }
 
-struct msg *msgqueue_pop(struct msg_queue *q)
+/* Makes a step the way the server would, the player stays in place if
+ * something is in the way. Called with player_mutex, which guards
+ * entities too, and map_mutex held.
+ */
+enum collision_enum_t player_predict(struct player *p, struct map *m,
+                                     uint8_t direction)
 {
-    if(q->top >= 0) {
-        return q->data[q->top--];
+    uint16_t px = p->pos_x, py = p->pos_y;
+    enum collision_enum_t c;
+
+    switch(direction) {
+    case DIRECTION_LEFT:
+        p->pos_x--;
+        break;
+    case DIRECTION_RIGHT:
+        p->pos_x++;
+        break;
+    case DIRECTION_UP:
+        p->pos_y--;
+        break;
+    case DIRECTION_DOWN:
+        p->pos_y++;
+        break;
+    default:
+        break;
+    }
+
+    c = collision_check_player(p, m);
+    if(c == COLLISION_NONE && entities_occupied(&entities, p->pos_x, p->pos_y)) {
+        c = COLLISION_PLAYER;
+    }
+    if(c != COLLISION_NONE) {
+        p->pos_x = px;
+        p->pos_y = py;
     }
 
-    return NULL;
+    return c;
 }
 
-void send_event(struct msg *m)
+static void send_msg(struct msg *m)
 {
     uint8_t buf[sizeof(struct msg)];
 
+    msg_pack(m, buf);
+
+    write(sd, buf, sizeof(struct msg));
+}
+
+void send_event(struct msg *m)
+{
     pthread_mutex_lock(&player_mutex);
     m->header.id = player->id;
-    m->header.seq = player->seq;
+    m->header.seq = ++prediction.seq;
     pthread_mutex_unlock(&player_mutex);
 
-    msg_pack(m, buf);
-
-    write(sd, buf, sizeof(struct msg));
+    send_msg(m);
 }
 
 void event_disconnect_client(void)
@@ -198,8 +300,24 @@ void event_player_hit(struct msg *m)
 
 void event_map_explode(struct msg *m)
 {
+    struct msgtype_map_explode *e = &(m->event.map_explode);
+    int dx, dy, r, side;
+
+    r = e->radius > MAP_EXPLODE_RADIUS_MAX ? MAP_EXPLODE_RADIUS_MAX : e->radius;
+    side = r * 2 + 1;
+
     pthread_mutex_lock(&map_mutex);
-    map->objs[m->event.map_explode.h][m->event.map_explode.w] = MAP_EMPTY;
+    for(dy = -r; dy <= r; dy++) {
+        for(dx = -r; dx <= r; dx++) {
+            int bit = (dy + r) * side + dx + r;
+            int w = e->w + dx, h = e->h + dy;
+
+            if((e->mask[bit / 8] & (1 << (bit % 8))) &&
+               w >= 0 && h >= 0 && w < map->width && h < map->height) {
+                map_set(map, w, h, MAP_EMPTY);
+            }
+        }
+    }
     pthread_mutex_unlock(&map_mutex);
 }
 
@@ -215,25 +333,67 @@ void event_on_bonus(struct msg *m)
         player->weapons.bullets[index] = weapons[index].bullets_count;
         pthread_mutex_unlock(&player_mutex);
 
+        break;
+    case BONUSTYPE_HEALTH:
+        pthread_mutex_lock(&player_mutex);
+        player->hp += healths[index].hp;
+        if(player->hp > PLAYER_HP_MAX) {
+            player->hp = PLAYER_HP_MAX;
+        }
+        pthread_mutex_unlock(&player_mutex);
+
+        break;
+    case BONUSTYPE_ARMOR:
+        pthread_mutex_lock(&player_mutex);
+        player->armor += armors[index].armor;
+        if(player->armor > PLAYER_ARMOR_MAX) {
+            player->armor = PLAYER_ARMOR_MAX;
+        }
+        pthread_mutex_unlock(&player_mutex);
+
         break;
     default:
         break;
     }
 }
 
+/* Server's position is authoritative, but it's late by a round trip:
+ * walks it hasn't processed yet are replayed on top of it, so the player
+ * doesn't jump back to where it was a round trip ago.
+ */
 void event_player_position(struct msg *m)
 {
+    uint16_t i;
+
     pthread_mutex_lock(&player_mutex);
     player->pos_x = m->event.player_position.pos_x;
     player->pos_y = m->event.player_position.pos_y;
+    prediction_ack(&prediction, m->header.seq);
+
+    pthread_mutex_lock(&map_mutex);
+    for(i = 0; i < prediction.count; i++) {
+        player_predict(player, map, prediction.inputs[
+                           (prediction.head + i) % PREDICTION_INPUTS_MAX].direction);
+    }
+    pthread_mutex_unlock(&map_mutex);
     pthread_mutex_unlock(&player_mutex);
 }
 
+/* The server sends the player's own position too, it's drawn where
+ * prediction puts it instead. Others go to the entity layer, the map
+ * keeps static tiles only.
+ */
 void event_enemy_position(struct msg *m)
 {
-    pthread_mutex_lock(&map_mutex);
-    map->objs[m->event.enemy_position.pos_y - 1][m->event.enemy_position.pos_x - 1] = MAP_PLAYER;
-    pthread_mutex_unlock(&map_mutex);
+    uint16_t x = m->event.enemy_position.pos_x;
+    uint16_t y = m->event.enemy_position.pos_y;
+
+    pthread_mutex_lock(&player_mutex);
+    if(m->header.id != player->id) {
+        entities_update(&entities, m->header.id, m->header.seq, x, y,
+                        ticks_get());
+    }
+    pthread_mutex_unlock(&player_mutex);
 }
 
 void event_shoot(void)
@@ -248,16 +408,27 @@ void event_shoot(void)
     send_event(&msg);
 }
 
-void event_walk(void)
+/* The step is predicted and becomes pending under the same lock as its
+ * seq is taken, so a position which arrives in between can't lose it.
+ */
+void event_walk(uint8_t direction)
 {
     struct msg msg;
 
-    pthread_mutex_lock(&player_mutex);
     msg.type = MSGTYPE_WALK;
-    msg.event.walk.direction = player->direction;
+    msg.event.walk.direction = direction;
+
+    pthread_mutex_lock(&player_mutex);
+    player->direction = direction;
+    pthread_mutex_lock(&map_mutex);
+    player_predict(player, map, direction);
+    pthread_mutex_unlock(&map_mutex);
+    msg.header.id = player->id;
+    msg.header.seq = ++prediction.seq;
+    prediction_push(&prediction, msg.header.seq, direction);
     pthread_mutex_unlock(&player_mutex);
 
-    send_event(&msg);
+    send_msg(&msg);
 }
 
 void *ui_event_mngr_func(void *arg)
@@ -265,7 +436,6 @@ void *ui_event_mngr_func(void *arg)
     while(1) {
         int ui_event;
         struct timespec req;
-        uint16_t px, py;
 
         req.tv_sec = 1000 / FPS / 1000;
         req.tv_nsec = 1000 / FPS * 1000000;
@@ -276,27 +446,7 @@ void *ui_event_mngr_func(void *arg)
 
         pthread_mutex_lock(&player_mutex);
 
-        /* Just remember previous parameters. */
-        px = player->pos_x;
-        py = player->pos_y;
-
         switch(ui_event) {
-        case UI_EVENT_WALK_LEFT:
-            player->direction = DIRECTION_LEFT;
-            player->pos_x--;
-            break;
-        case UI_EVENT_WALK_RIGHT:
-            player->direction = DIRECTION_RIGHT;
-            player->pos_x++;
-            break;
-        case UI_EVENT_WALK_UP:
-            player->direction = DIRECTION_UP;
-            player->pos_y--;
-            break;
-        case UI_EVENT_WALK_DOWN:
-            player->direction = DIRECTION_DOWN;
-            player->pos_y++;
-            break;
         case UI_EVENT_SHOOT_UP:
         case UI_EVENT_SHOOT_DOWN:
         case UI_EVENT_SHOOT_LEFT:
@@ -314,17 +464,16 @@ void *ui_event_mngr_func(void *arg)
 
         switch(ui_event) {
         case UI_EVENT_WALK_LEFT:
+            event_walk(DIRECTION_LEFT);
+            break;
         case UI_EVENT_WALK_RIGHT:
+            event_walk(DIRECTION_RIGHT);
+            break;
         case UI_EVENT_WALK_UP:
+            event_walk(DIRECTION_UP);
+            break;
         case UI_EVENT_WALK_DOWN:
-            pthread_mutex_lock(&player_mutex);
-            if(collision_check_player(player, map) != COLLISION_NONE) {
-                player->pos_x = px;
-                player->pos_y = py;
-            }
-            pthread_mutex_unlock(&player_mutex);
-
-            event_walk();
+            event_walk(DIRECTION_DOWN);
             break;
         case UI_EVENT_SHOOT_UP:
             player->direction = DIRECTION_UP;
@@ -346,6 +495,7 @@ void *ui_event_mngr_func(void *arg)
             break;
         }
 
+        view_publish();
         ui_refresh();
     }
 }
@@ -362,54 +512,39 @@ void *ui_mngr_func(void *arg)
     quit(1);
 }
 
+/* Takes no locks: messages of a batch go to the ring in the order the
+ * server has packed them, and the queue thread is woken once per batch.
+ */
 void *recv_mngr_func(void *arg)
 {
-    /* TODO: ticks_finish(). */
-    struct ticks *ticks;
-
-    sem_wait(&queue_mngr_sem);
-    sem_destroy(&queue_mngr_sem);
-
-    ticks = ticks_start();
-
     while("zombies walk") {
-        uint8_t buf[sizeof(struct msg_batch)];
-        struct msg_batch msgbatch;
-        uint8_t *chunk, id;
+        uint8_t buf[MSGBATCH_BYTES];
+        ssize_t len;
+        int i, n;
 
-        if(recvfrom(sd, buf, sizeof(struct msg_batch), 0, NULL, NULL) < 0) {
+        if((len = recvfrom(sd, buf, sizeof(buf), 0, NULL, NULL)) < 0) {
             perror("recvfrom");
             continue;
         }
 
-        msgbatch.size = (buf[0] * sizeof(struct msg));
-        memcpy(msgbatch.chunks, buf, msgbatch.size + 1);
+        n = buf[0];
+        if(len < 1 + n * (ssize_t) sizeof(struct msg)) {
+            WARN("recvfrom: batch is truncated.\n");
+            continue;
+        }
 
-        pthread_mutex_lock(&msgqueue_mutex);
-        while((chunk = msg_batch_pop(&msgbatch)) != NULL) {
+        for(i = 0; i < n; i++) {
             struct msg m;
 
-            msg_unpack(chunk, &m);
-            if(msgqueue_push(msgqueue, &m) == MSGQUEUE_ERROR) {
-                WARN("msgqueue_push: couldn't push data into queue.\n");
-            } else {
-                pthread_mutex_lock(&player_mutex);
-                player->seq++;
-                pthread_mutex_unlock(&player_mutex);
+            if(!msg_unpack(&buf[1 + i * sizeof(struct msg)], &m)) {
+                continue;
+            }
+            if(msgring_push(msgring, &m) == MSGQUEUE_ERROR) {
+                WARN("msgring_push: couldn't push data into queue.\n");
             }
         }
 
-        pthread_mutex_lock(&player_mutex);
-        id = player->id;
-        pthread_mutex_unlock(&player_mutex);
-
-        if(ticks_get_diff(ticks) > 1000 / FPS || !id) {
-            ticks_update(ticks);
-            pthread_cond_signal(&queue_mngr_cond);
-        }
-
-        pthread_mutex_unlock(&msgqueue_mutex);
-
+        sem_post(&queue_mngr_sem);
     }
 
     return arg;
@@ -417,32 +552,12 @@ void *recv_mngr_func(void *arg)
 
 void *queue_mngr_func(void *arg)
 {
-    struct msg *m;
+    struct msg msg, *m = &msg;
 
     while(1) {
-        uint16_t w, h;
-
-        sem_post(&queue_mngr_sem);
+        while(sem_wait(&queue_mngr_sem) != 0);
 
-        pthread_mutex_lock(&msgqueue_mutex);
-        pthread_cond_wait(&queue_mngr_cond, &msgqueue_mutex);
-
-        /* Clean map from players, bullets, bonuses and other objects. */
-        if(map != NULL) {
-            pthread_mutex_lock(&map_mutex);
-            for(h = 0; h < map->height; h++) {
-                for(w = 0; w < map->width; w++) {
-                    uint8_t o = map->objs[h][w];
-
-                    if(o == MAP_PLAYER || o == MAP_BULLET) {
-                        map->objs[h][w] = MAP_EMPTY;
-                    }
-                }
-            }
-            pthread_mutex_unlock(&map_mutex);
-        }
-
-        while((m = msgqueue_pop(msgqueue)) != NULL) {
+        while(msgring_pop(msgring, m)) {
             /* TODO: just fucking do it!. */
             /* TODO: check player->id, if it's 0 than warn. */
 
@@ -484,8 +599,7 @@ void *queue_mngr_func(void *arg)
             }
         }
 
-        pthread_mutex_unlock(&msgqueue_mutex);
-
+        view_publish();
         ui_refresh();
     }
 }
@@ -511,12 +625,11 @@ void quit(int signum)
     if(map != NULL) {
         map_unload(map);
     }
-    msgqueue_free(msgqueue);
+    msgring_free(msgring);
     player_free(player);
-    pthread_mutex_destroy(&msgqueue_mutex);
     pthread_mutex_destroy(&map_mutex);
     pthread_mutex_destroy(&player_mutex);
-    pthread_cond_destroy(&queue_mngr_cond);
+    sem_destroy(&queue_mngr_sem);
     pthread_attr_destroy(&common_attr);
     pthread_exit(NULL);
 }
@@ -555,14 +668,14 @@ int main(int argc, char **argv)
     signal(SIGHUP, quit);
     signal(SIGQUIT, quit);
 
-    msgqueue = msgqueue_init();
+    msgring = msgring_init();
     player = player_init();
+    entities_init(&entities);
 
-    pthread_mutex_init(&msgqueue_mutex, NULL);
     pthread_mutex_init(&map_mutex, NULL);
     pthread_mutex_init(&player_mutex, NULL);
-    pthread_cond_init(&queue_mngr_cond, NULL);
     sem_init(&queue_mngr_sem, 0, 0);
+    view_publish();
 
     pthread_attr_init(&common_attr);
     pthread_attr_setdetachstate(&common_attr, PTHREAD_CREATE_JOINABLE);
@@ -23,17 +23,65 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
-#define MSGQUEUE_INIT_SIZE (MSGBATCH_INIT_SIZE * 3)
+/* Messages go from the receive thread to the queue thread through a
+ * single producer, single consumer ring: neither of them ever waits for
+ * the other one, a full ring drops new messages. The size must be a
+ * power of two.
+ */
+#define MSGRING_SIZE 1024
+
+struct msg_ring {
+    /* Written by the receive thread. */
+    uint32_t head;
+    uint8_t pad0[64 - sizeof(uint32_t)];
+    /* Written by the queue thread. */
+    uint32_t tail;
+    uint8_t pad1[64 - sizeof(uint32_t)];
+    struct msg data[MSGRING_SIZE];
+};
+
+/* Everything the renderer needs from the game state. Threads which change
+ * the state publish a copy of it under a seqlock, so drawing never blocks
+ * input or network and is never blocked by them.
+ */
+struct client_view {
+    struct player player;
+    struct entities entities;
+};
+
+struct client_view_seqlock {
+    uint32_t seq;
+    struct client_view view;
+};
+
+/* Walks which are sent, moved locally, but not acknowledged by the server
+ * yet. PLAYER_POSITION carries seq of the newest input the server has
+ * processed, the rest are replayed on top of the position it reports.
+ */
+#define PREDICTION_INPUTS_MAX 64
+
+struct prediction_input {
+    uint32_t seq;
+    uint8_t direction;
+};
 
-struct msg_queue {
-    struct msg *data[MSGQUEUE_INIT_SIZE];
-    ssize_t top;
+struct prediction {
+    struct prediction_input inputs[PREDICTION_INPUTS_MAX];
+    /* Seq of the last sent message. */
+    uint32_t seq;
+    uint16_t head;
+    uint16_t count;
 };
 
-struct msg_queue *msgqueue_init(void);
-void msgqueue_free(struct msg_queue*);
-enum msg_queue_enum_t msgqueue_push(struct msg_queue*, struct msg*);
-struct msg *msgqueue_pop(struct msg_queue*);
+struct msg_ring *msgring_init(void);
+void msgring_free(struct msg_ring*);
+enum msg_queue_enum_t msgring_push(struct msg_ring*, struct msg*);
+bool msgring_pop(struct msg_ring*, struct msg*);
+void view_publish(void);
+void view_read(struct client_view*);
+void prediction_push(struct prediction*, uint32_t, uint8_t);
+void prediction_ack(struct prediction*, uint32_t);
+enum collision_enum_t player_predict(struct player*, struct map*, uint8_t);
 void quit(int);
 void send_event(struct msg*);
 void event_disconnect_client(void);
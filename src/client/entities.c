@@ -0,0 +1,184 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../cdata.h"
+#include "entities.h"
+
+void entities_init(struct entities *e)
+{
+    memset(e, 0, sizeof(struct entities));
+}
+
+static struct entity_sample *entity_sample(struct entity *en, uint8_t i)
+{
+    return &(en->history[(en->head + i) % ENTITY_HISTORY]);
+}
+
+/* Forgets entities which weren't in the last snapshots. */
+static void entities_expire(struct entities *e)
+{
+    uint16_t i = 0;
+
+    while(i < e->count) {
+        struct entity *en = &(e->list[e->active[i]]);
+
+        if(e->newest - entity_sample(en, en->count - 1)->tick >
+           ENTITY_EXPIRE_TICKS) {
+            en->count = 0;
+            e->active[i] = e->active[--e->count];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Adds position of player `id' from the snapshot of tick `tick' received
+ * at `now'. Duplicated and reordered snapshots are dropped.
+ */
+void entities_update(struct entities *e, uint8_t id, uint32_t tick,
+                     uint16_t x, uint16_t y, uint64_t now)
+{
+    struct entity *en = &(e->list[id]);
+    struct entity_sample *s;
+
+    if(e->started && (int32_t) (e->newest - tick) > ENTITY_RESET_TICKS) {
+        entities_init(e);
+    }
+
+    if(!e->started || (int32_t) (tick - e->newest) > 0) {
+        e->started = true;
+        e->newest = tick;
+        e->newest_at = now;
+        entities_expire(e);
+    }
+
+    if(en->count > 0 &&
+       (int32_t) (tick - entity_sample(en, en->count - 1)->tick) <= 0) {
+        return;
+    }
+
+    if(en->count == 0) {
+        en->head = 0;
+        e->active[e->count++] = id;
+    } else if(en->count == ENTITY_HISTORY) {
+        en->head = (en->head + 1) % ENTITY_HISTORY;
+        en->count--;
+    }
+
+    s = entity_sample(en, en->count++);
+    s->tick = tick;
+    s->pos_x = x;
+    s->pos_y = y;
+}
+
+/* Moves the renderer's `clock' to `now' minus the delay, but not past the
+ * newest snapshot: there is nothing to interpolate to beyond it. The clock
+ * is in ns of server's ticks and never goes back, so jitter doesn't make
+ * entities step back and forth.
+ */
+uint64_t entities_clock(struct entities *e, uint64_t now, uint64_t *clock)
+{
+    uint64_t newest = (uint64_t) e->newest * TICK_NS;
+    uint64_t t = newest + (now > e->newest_at ? now - e->newest_at : 0);
+
+    t = t > ENTITY_DELAY_NS ? t - ENTITY_DELAY_NS : 0;
+    if(t > newest) {
+        t = newest;
+    }
+    if(t > *clock || *clock > newest) {
+        *clock = t;
+    }
+
+    return *clock;
+}
+
+/* Position of player `id' at `clock'. False if it wasn't in sight then:
+ * not seen yet, gone from the later snapshots, or between two sightings.
+ */
+bool entity_position(struct entities *e, uint8_t id, uint64_t clock,
+                     uint16_t *x, uint16_t *y)
+{
+    struct entity *en = &(e->list[id]);
+    struct entity_sample *a, *b;
+    uint64_t ta, tb;
+    uint8_t i;
+
+    if(en->count == 0 ||
+       (uint64_t) entity_sample(en, 0)->tick * TICK_NS > clock) {
+        return false;
+    }
+
+    b = entity_sample(en, en->count - 1);
+    if((uint64_t) b->tick * TICK_NS <= clock) {
+        if(b->tick != e->newest && (uint64_t) b->tick * TICK_NS < clock) {
+            return false;
+        }
+        *x = b->pos_x;
+        *y = b->pos_y;
+
+        return true;
+    }
+
+    i = en->count - 1;
+    while((uint64_t) entity_sample(en, i - 1)->tick * TICK_NS > clock) {
+        i--;
+    }
+    a = entity_sample(en, i - 1);
+    b = entity_sample(en, i);
+    if(b->tick - a->tick > ENTITY_GAP_TICKS) {
+        return false;
+    }
+
+    /* Cells are discrete, the entity moves when it's half way there. */
+    ta = (uint64_t) a->tick * TICK_NS;
+    tb = (uint64_t) b->tick * TICK_NS;
+    *x = (a->pos_x * (tb - clock) + b->pos_x * (clock - ta) + (tb - ta) / 2) /
+        (tb - ta);
+    *y = (a->pos_y * (tb - clock) + b->pos_y * (clock - ta) + (tb - ta) / 2) /
+        (tb - ta);
+
+    return true;
+}
+
+/* Whether some entity is at `x', `y' in the newest snapshot, the client
+ * doesn't walk into players the way the server wouldn't let it.
+ */
+bool entities_occupied(struct entities *e, uint16_t x, uint16_t y)
+{
+    uint16_t i;
+
+    for(i = 0; i < e->count; i++) {
+        struct entity *en = &(e->list[e->active[i]]);
+        struct entity_sample *s = entity_sample(en, en->count - 1);
+
+        if(s->tick == e->newest && s->pos_x == x && s->pos_y == y) {
+            return true;
+        }
+    }
+
+    return false;
+}
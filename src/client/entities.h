@@ -0,0 +1,81 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __ENTITIES_H__
+#define __ENTITIES_H__
+
+/* Remote players are drawn a bit in the past, between two snapshots of the
+ * server, instead of jumping whenever a datagram arrives. ENEMY_POSITION
+ * carries id of the player and number of the server's tick in its header,
+ * every entity keeps its last few positions.
+ */
+#define ENTITIES_MAX 256
+#define ENTITY_HISTORY 8
+/* How far behind the newest snapshot entities are drawn. Two ticks let a
+ * datagram be late or lost without a stall.
+ */
+#define ENTITY_DELAY_NS (TICK_NS * 2)
+/* Entities aren't interpolated over longer gaps, they were out of sight. */
+#define ENTITY_GAP_TICKS 2
+/* Entities missing from this many snapshots can't be drawn any more and
+ * leave the list.
+ */
+#define ENTITY_EXPIRE_TICKS ENTITY_HISTORY
+/* A much older snapshot than the newest one means a new server. */
+#define ENTITY_RESET_TICKS (FPS * 10)
+
+struct entity_sample {
+    uint32_t tick;
+    uint16_t pos_x;
+    uint16_t pos_y;
+};
+
+struct entity {
+    struct entity_sample history[ENTITY_HISTORY];
+    /* Index of the oldest sample. */
+    uint8_t head;
+    uint8_t count;
+};
+
+/* Entities are indexed by id of the player, `active' lists the ids which
+ * have samples, so per tick work depends on players in sight only.
+ */
+struct entities {
+    struct entity list[ENTITIES_MAX];
+    uint8_t active[ENTITIES_MAX];
+    uint16_t count;
+    bool started;
+    uint32_t newest;
+    /* Local time the newest snapshot arrived at. */
+    uint64_t newest_at;
+};
+
+void entities_init(struct entities*);
+void entities_update(struct entities*, uint8_t, uint32_t, uint16_t, uint16_t,
+                     uint64_t);
+uint64_t entities_clock(struct entities*, uint64_t, uint64_t*);
+bool entity_position(struct entities*, uint8_t, uint64_t, uint16_t*,
+                     uint16_t*);
+bool entities_occupied(struct entities*, uint16_t, uint16_t);
+
+#endif
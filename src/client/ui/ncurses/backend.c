@@ -32,7 +32,9 @@
 #include <pthread.h>
 
 #include "../../../cdata.h"
+#include "../../entities.h"
 #include "../backend.h"
+#include "../../client.h"
 
 /* Graphics. */
 #define UI_MAP_EMPTY ' '
@@ -45,6 +47,16 @@ WINDOW *window = NULL;
 struct screen screen;
 uint8_t notify_line_history[NOTIFY_LINE_HISTORY_MAX][NOTIFY_LINE_MAX_LEN];
 pthread_mutex_t ui_event_mutex, ui_refresh_mutex;
+/* Game state being drawn and time entities are drawn at, both belong to
+ * whoever holds ui_refresh_mutex.
+ */
+struct client_view ui_view;
+uint64_t ui_clock = 0;
+/* Visible tiles of the map, copied under map_mutex so the frame is drawn
+ * without holding it. Also belong to the holder of ui_refresh_mutex.
+ */
+uint8_t *ui_tiles = NULL;
+size_t ui_tiles_size = 0;
 
 /* The abstraction for getting and setting pressed keys. */
 
@@ -154,72 +166,99 @@ static void ui_notify_line_update(void)
     mvwaddstr(window, screen.height, 2, (char *) notify_line_history[0]);
 }
 
-static void ui_status_line_update(void)
+static void ui_status_line_update(struct player *p)
 {
     int x;
     char line[screen.width];
 
-    pthread_mutex_lock(&player_mutex);
-    
     snprintf(line, screen.width,
              "hp: %u ar: %u cw: %s   g: %u r: %u",
-             player->hp,
-             player->armor,
-             weapons[player->weapons.current].name,
-             player->weapons.bullets[WEAPON_GUN],
-             player->weapons.bullets[WEAPON_ROCKET]
+             p->hp,
+             p->armor,
+             weapons[p->weapons.current].name,
+             p->weapons.bullets[WEAPON_GUN],
+             p->weapons.bullets[WEAPON_ROCKET]
              );
 
     for(x = 2; x < screen.width; x++) {
         mvwaddch(window, 1, x, ' ');
     }
 
-    pthread_mutex_unlock(&player_mutex);
-    
     mvwaddstr(window, 1, 2, line);
 }
 
-static void ui_screen_update(void)
+/* Draws an object at position `x', `y' of the map (1-based), if it's on
+ * the screen.
+ */
+static void ui_screen_put(int h0, int w0, uint16_t x, uint16_t y,
+                          chtype type)
+{
+    int h = h0 + y - 1 - screen.offset_y;
+    int w = w0 + x - 1 - screen.offset_x;
+
+    if(x >= 1 + screen.offset_x && y >= 1 + screen.offset_y &&
+       h < screen.height && w < screen.width + 1) {
+        mvwaddch(window, h, w, type);
+    }
+}
+
+static void ui_screen_update(struct client_view *v)
 {
 #define CHECK_BOUNDS(x, y) (x >= 0 && y >= 0 && x < map->width && y < map->height)
 #define MAX(a, b) (a > b ? a : b)
      
-    int h, w, x, y;
-
-    /* Update screen's offsets. */
-    pthread_mutex_lock(&player_mutex);
+    struct player *p = &(v->player);
+    struct entities *e = &(v->entities);
+    int h, w, x, y, h0, w0, rows, cols, i;
+    uint64_t clock;
+    uint8_t *o;
+
+    /* Update screen's offsets and copy the visible tiles. Only they are
+     * read under the lock, the rest comes from the published state.
+     */
     pthread_mutex_lock(&map_mutex);
 
-    if(screen.width > map->width || player->pos_x <= screen.width / 2) {
+    if(screen.width > map->width || p->pos_x <= screen.width / 2) {
         screen.offset_x = 0;
     } else {
-        screen.offset_x = player->pos_x - screen.width / 2;
+        screen.offset_x = p->pos_x - screen.width / 2;
     }
 
-    if(screen.height > map->height || player->pos_y <= screen.height / 2) {
+    if(screen.height > map->height || p->pos_y <= screen.height / 2) {
         screen.offset_y = 0;
     } else {
-        screen.offset_y = player->pos_y - screen.height / 2;
+        screen.offset_y = p->pos_y - screen.height / 2;
+    }
+
+    h0 = MAX((screen.height - map->height) / 2, 2);
+    w0 = MAX((screen.width - map->width) / 2, 1);
+    rows = MAX(screen.height - h0, 0);
+    cols = MAX(screen.width + 1 - w0, 0);
+
+    if((size_t) rows * cols > ui_tiles_size) {
+        ui_tiles_size = (size_t) rows * cols;
+        ui_tiles = realloc(ui_tiles, ui_tiles_size);
     }
 
+    o = ui_tiles;
+    for(y = screen.offset_y; y < screen.offset_y + rows; y++) {
+        for(x = screen.offset_x; x < screen.offset_x + cols; x++) {
+            *o++ = CHECK_BOUNDS(x, y) ? MAP_OBJ(map, x, y) : MAP_EMPTY;
+        }
+    }
+
+    pthread_mutex_unlock(&map_mutex);
+
     /* TODO: dispatch and colorize. */
-    h = MAX((screen.height - map->height) / 2, 2);
-    for(y = screen.offset_y; h < screen.height; h++, y++) {
-        w = MAX((screen.width - map->width) / 2, 1);
-        for(x = screen.offset_x; w < screen.width + 1; w++, x++) {
-            uint8_t o = CHECK_BOUNDS(x, y) ? map->objs[y][x] : MAP_EMPTY;
+    o = ui_tiles;
+    for(h = h0, y = screen.offset_y; h < screen.height; h++, y++) {
+        for(w = w0, x = screen.offset_x; w < screen.width + 1; w++, x++) {
             chtype type;
             
-            switch(o) {
-            case MAP_PLAYER:
-                // TODO: fix the bug. Player's type often changes from UI_MAP_PLAYER to UI_MAP_ENEMY and vice versa.
-                if(player->pos_y == 1 + y && player->pos_x == 1 + x)
-                    type = UI_MAP_PLAYER;
-                else
-                    type = UI_MAP_ENEMY;
-                break;
+            /* The map holds static tiles, players are drawn over them. */
+            switch(*o++) {
             case MAP_WALL:
-                if(IN_PLAYER_VIEWPORT(x, y, player->pos_x, player->pos_y))
+                if(IN_PLAYER_VIEWPORT(x, y, p->pos_x, p->pos_y))
                     type = UI_MAP_WALL;
                 else
                     type = UI_MAP_WALL_FOG;
@@ -233,11 +272,22 @@ static void ui_screen_update(void)
         }
     }
 
+    /* Enemies are drawn where they were a moment ago, between snapshots,
+     * and the player where prediction puts it.
+     */
+    clock = entities_clock(e, ticks_get(), &ui_clock);
+    for(i = 0; i < e->count; i++) {
+        uint8_t id = e->active[i];
+        uint16_t ex, ey;
+
+        if(id != p->id && entity_position(e, id, clock, &ex, &ey)) {
+            ui_screen_put(h0, w0, ex, ey, UI_MAP_ENEMY);
+        }
+    }
+    ui_screen_put(h0, w0, p->pos_x, p->pos_y, UI_MAP_PLAYER);
+
 #undef CHECK_BOUNDS
 #undef MAX
-    
-    pthread_mutex_unlock(&map_mutex);
-    pthread_mutex_unlock(&player_mutex);
 }
 
 /* Applies all the changes made to screen by other functions */
@@ -245,9 +295,10 @@ void ui_refresh(void)
 {
     pthread_mutex_lock(&ui_refresh_mutex);
     
+    view_read(&ui_view);
     ui_notify_line_update();
-    ui_status_line_update();
-    ui_screen_update();
+    ui_status_line_update(&(ui_view.player));
+    ui_screen_update(&ui_view);
     wrefresh(window);
     
     pthread_mutex_unlock(&ui_refresh_mutex);
@@ -318,5 +369,6 @@ void ui_free(void)
 {
     pthread_mutex_destroy(&ui_event_mutex);
     pthread_mutex_destroy(&ui_refresh_mutex);
+    free(ui_tiles);
     endwin();
 }
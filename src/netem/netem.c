@@ -0,0 +1,596 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* Network emulator: a UDP proxy which puts a bad link between clients and
+ * the server. Every client address gets an upstream socket of its own, so
+ * the server sees as many players as there are clients. Both directions
+ * have their own impairments and random generator seeded from the same
+ * seed, the same seed and traffic give the same decisions:
+ * - loss drops a datagram, duplication sends it twice;
+ * - delay plus uniform jitter is its due time, jitter alone reorders;
+ * - reorder sends a datagram at once, ahead of the delayed ones;
+ * - rate limits bandwidth, datagrams queue behind each other.
+ * Datagrams wait in a min-heap by due time, a timerfd fires for the
+ * earliest one.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netdb.h>
+
+#include <netinet/in.h>
+
+#include "../cdata.h"
+#include "../server/rng.h"
+
+#define NETEM_FLOWS_MAX 16384
+#define NETEM_LISTEN_MAX 8
+#define NETEM_EVENTS 256
+#define NETEM_HASH_SIZE 4096
+/* Datagrams held back at once, newer ones are dropped as overflow. */
+#define NETEM_QUEUE_MAX 65536
+
+#define NETEM_TIMER (NETEM_FLOWS_MAX + NETEM_LISTEN_MAX)
+
+enum netem_dir_enum_t {
+    NETEM_UP = 0,
+    NETEM_DOWN,
+    NETEM_DIRS
+};
+
+static const char *netem_dirs[NETEM_DIRS] = {
+    "up", "down"
+};
+
+struct netem_link {
+    uint64_t delay;
+    uint64_t jitter;
+    /* Probabilities scaled to 2^32. */
+    uint32_t loss;
+    uint32_t dup;
+    uint32_t reorder;
+    /* Bytes per second, 0 is unlimited. */
+    uint64_t rate;
+    /* When the link is done with the last datagram queued by the rate. */
+    uint64_t busy;
+    struct rng rng;
+    uint64_t dgrams;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t overflows;
+};
+
+struct netem_flow {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    /* Listening socket the client talks to, and ours to the server. */
+    int lfd;
+    int fd;
+    /* Next flow in the same hash bucket, -1 ends it. */
+    int next;
+};
+
+struct netem_dgram {
+    uint64_t due;
+    /* Datagrams due at the same time leave in order of arrival. */
+    uint64_t order;
+    int flow;
+    uint8_t dir;
+    size_t len;
+    uint8_t buf[];
+};
+
+static struct netem_link links[NETEM_DIRS];
+static struct netem_flow *flows;
+static int nflows = 0;
+static int buckets[NETEM_HASH_SIZE];
+static int lfds[NETEM_LISTEN_MAX];
+static int nlfds = 0;
+static struct netem_dgram **heap;
+static size_t nheap = 0;
+static uint64_t order = 0;
+static struct addrinfo *server;
+static int epfd;
+static volatile sig_atomic_t netem_quit = 0;
+
+static bool netem_before(struct netem_dgram *a, struct netem_dgram *b)
+{
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void heap_push(struct netem_dgram *d)
+{
+    size_t i = nheap++;
+
+    while(i > 0 && netem_before(d, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = d;
+}
+
+static struct netem_dgram *heap_pop(void)
+{
+    struct netem_dgram *top = heap[0], *last = heap[--nheap];
+    size_t i = 0, child;
+
+    while((child = i * 2 + 1) < nheap) {
+        if(child + 1 < nheap && netem_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if(!netem_before(heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
+
+static bool netem_chance(struct netem_link *l, uint32_t p)
+{
+    return p > 0 && rng_next(&l->rng) < p;
+}
+
+static void netem_queue(struct netem_link *l, int flow, uint8_t dir,
+                        const uint8_t *buf, size_t len, uint64_t now)
+{
+    struct netem_dgram *d;
+    uint64_t due = now;
+
+    if(nheap == NETEM_QUEUE_MAX) {
+        l->overflows++;
+        return;
+    }
+
+    if(netem_chance(l, l->reorder)) {
+        l->reordered++;
+    } else {
+        due += l->delay;
+        if(l->jitter > 0) {
+            uint64_t us = l->jitter / 1000;
+            uint64_t offset = rng_range(&l->rng, us * 2 + 1) * 1000ULL;
+
+            due = due + offset > l->jitter ? due + offset - l->jitter : 0;
+        }
+    }
+
+    if(l->rate > 0) {
+        if(due < l->busy) {
+            due = l->busy;
+        }
+        due += len * 1000000000ULL / l->rate;
+        l->busy = due;
+    }
+
+    d = malloc(sizeof(struct netem_dgram) + len);
+    d->due = due;
+    d->order = order++;
+    d->flow = flow;
+    d->dir = dir;
+    d->len = len;
+    memcpy(d->buf, buf, len);
+    heap_push(d);
+}
+
+/* Applies the link's impairments to a datagram which has just arrived. */
+static void netem_input(int flow, uint8_t dir, const uint8_t *buf, size_t len,
+                        uint64_t now)
+{
+    struct netem_link *l = &links[dir];
+
+    l->dgrams++;
+    l->bytes += len;
+
+    if(netem_chance(l, l->loss)) {
+        l->lost++;
+        return;
+    }
+
+    netem_queue(l, flow, dir, buf, len, now);
+    if(netem_chance(l, l->dup)) {
+        l->duplicated++;
+        netem_queue(l, flow, dir, buf, len, now);
+    }
+}
+
+static void netem_output(struct netem_dgram *d)
+{
+    struct netem_flow *f = &flows[d->flow];
+    ssize_t ret;
+
+    if(d->dir == NETEM_UP) {
+        ret = send(f->fd, d->buf, d->len, 0);
+    } else {
+        ret = sendto(f->lfd, d->buf, d->len, 0,
+                     (struct sockaddr *) &f->addr, f->addrlen);
+    }
+
+    /* The server may be down or restarting, that's just more loss. */
+    if(ret < 0 && errno != EAGAIN && errno != ECONNREFUSED) {
+        perror("netem send");
+    }
+}
+
+static uint32_t netem_hash(struct sockaddr_storage *addr, socklen_t len)
+{
+    uint8_t *p = (uint8_t *) addr;
+    uint32_t h = 2166136261U;
+    socklen_t i;
+
+    for(i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+
+    return h % NETEM_HASH_SIZE;
+}
+
+/* Finds the flow of a client or opens a new one to the server. */
+static int netem_flow(int lfd, struct sockaddr_storage *addr, socklen_t len)
+{
+    struct epoll_event ev;
+    uint32_t h = netem_hash(addr, len);
+    struct netem_flow *f;
+    int i;
+
+    for(i = buckets[h]; i >= 0; i = flows[i].next) {
+        if(flows[i].addrlen == len && flows[i].lfd == lfd &&
+           memcmp(&flows[i].addr, addr, len) == 0) {
+            return i;
+        }
+    }
+
+    if(nflows == NETEM_FLOWS_MAX) {
+        return -1;
+    }
+
+    f = &flows[nflows];
+    f->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK,
+                   server->ai_protocol);
+    if(f->fd < 0 || connect(f->fd, server->ai_addr, server->ai_addrlen) < 0) {
+        perror("netem flow");
+        if(f->fd >= 0) {
+            close(f->fd);
+        }
+        return -1;
+    }
+
+    memcpy(&f->addr, addr, len);
+    f->addrlen = len;
+    f->lfd = lfd;
+    f->next = buckets[h];
+    buckets[h] = nflows;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = nflows;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, f->fd, &ev);
+
+    return nflows++;
+}
+
+static void netem_recv_client(int lfd, uint64_t now)
+{
+    uint8_t buf[MSGBATCH_BYTES];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    ssize_t len;
+
+    while((len = recvfrom(lfd, buf, sizeof(buf), 0,
+                          (struct sockaddr *) &addr, &addrlen)) >= 0) {
+        int flow = netem_flow(lfd, &addr, addrlen);
+
+        if(flow >= 0) {
+            netem_input(flow, NETEM_UP, buf, len, now);
+        }
+        addrlen = sizeof(addr);
+    }
+}
+
+static void netem_recv_server(int flow, uint64_t now)
+{
+    uint8_t buf[MSGBATCH_BYTES];
+    ssize_t len;
+
+    while((len = recv(flows[flow].fd, buf, sizeof(buf), 0)) >= 0) {
+        netem_input(flow, NETEM_DOWN, buf, len, now);
+    }
+}
+
+/* Sends everything that is due and sets the timer to the next one. */
+static void netem_flush(int tfd, uint64_t now)
+{
+    struct itimerspec next;
+
+    while(nheap > 0 && heap[0]->due <= now) {
+        struct netem_dgram *d = heap_pop();
+
+        netem_output(d);
+        free(d);
+    }
+
+    memset(&next, 0, sizeof(next));
+    if(nheap > 0) {
+        next.it_value.tv_sec = heap[0]->due / 1000000000ULL;
+        next.it_value.tv_nsec = heap[0]->due % 1000000000ULL;
+    }
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &next, NULL);
+}
+
+/* Counters since start, rates are averaged over the whole run. */
+static void netem_report(uint64_t elapsed)
+{
+    int i;
+
+    for(i = 0; i < NETEM_DIRS; i++) {
+        struct netem_link *l = &links[i];
+        double s = elapsed / 1e9;
+
+        printf("%-4s: %llu dgrams (%.1f/s, %.1f kbit/s), %llu lost, "
+               "%llu duplicated, %llu reordered, %llu overflows\n",
+               netem_dirs[i],
+               (unsigned long long) l->dgrams, s > 0 ? l->dgrams / s : 0,
+               s > 0 ? l->bytes * 8 / 1000.0 / s : 0,
+               (unsigned long long) l->lost,
+               (unsigned long long) l->duplicated,
+               (unsigned long long) l->reordered,
+               (unsigned long long) l->overflows);
+    }
+    printf("flows: %d, queued: %zu\n", nflows, nheap);
+    fflush(stdout);
+}
+
+static uint32_t netem_percent(const char *arg)
+{
+    double p = atof(arg);
+
+    if(p <= 0) {
+        return 0;
+    }
+    if(p >= 100) {
+        return UINT32_MAX;
+    }
+
+    return (uint32_t) (p / 100 * 4294967296.0);
+}
+
+static void netem_stop(int signum)
+{
+    (void) signum;
+    netem_quit = 1;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-a direction] [-B kbit] [-d ms] [-D percent]\n"
+            "          [-H host] [-j ms] [-l port] [-L percent]\n"
+            "          [-o percent] [-p port] [-s seconds] [-S seed]\n"
+            "  -a direction  impair only up (to server) or down (to\n"
+            "                clients) direction, both by default\n"
+            "  -B kbit       bandwidth in kbit/s, 0 is unlimited\n"
+            "  -d ms         delay\n"
+            "  -D percent    duplicated datagrams\n"
+            "  -H host       server's address (localhost)\n"
+            "  -j ms         uniform jitter added to the delay, +/-\n"
+            "  -l port       port clients connect to (6007)\n"
+            "  -L percent    lost datagrams\n"
+            "  -o percent    datagrams sent at once, ahead of delayed\n"
+            "                ones\n"
+            "  -p port       server's port (6006)\n"
+            "  -s seconds    statistics at this interval (5), 0 disables\n"
+            "                them\n"
+            "  -S seed       seed of random decisions\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints, *addr_res = NULL, *addr;
+    struct epoll_event ev, events[NETEM_EVENTS];
+    struct netem_link impair;
+    struct rlimit rl;
+    char *host = "localhost", *port = "6006", *lport = "6007";
+    bool dirs[NETEM_DIRS] = {true, true};
+    int err, i, opt, tfd;
+    int interval = 5;
+    uint64_t seed = 0, now, start, reported;
+
+    memset(&impair, 0, sizeof(impair));
+
+    while((opt = getopt(argc, argv, "a:B:d:D:H:j:l:L:o:p:s:S:")) != -1) {
+        switch(opt) {
+        case 'a':
+            if(strcmp(optarg, "up") == 0) {
+                dirs[NETEM_DOWN] = false;
+            } else if(strcmp(optarg, "down") == 0) {
+                dirs[NETEM_UP] = false;
+            } else if(strcmp(optarg, "both") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'B':
+            impair.rate = strtoull(optarg, NULL, 0) * 1000 / 8;
+            break;
+        case 'd':
+            impair.delay = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'D':
+            impair.dup = netem_percent(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'j':
+            impair.jitter = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'l':
+            lport = optarg;
+            break;
+        case 'L':
+            impair.loss = netem_percent(optarg);
+            break;
+        case 'o':
+            impair.reorder = netem_percent(optarg);
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 's':
+            interval = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    for(i = 0; i < NETEM_DIRS; i++) {
+        if(dirs[i]) {
+            links[i] = impair;
+        }
+        rng_seed(&links[i].rng, seed, i);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_ADDRCONFIG;
+    hints.ai_socktype = SOCK_DGRAM;
+    err = getaddrinfo(host, port, &hints, &server);
+    if(err != 0)
+        error(EXIT_FAILURE, 0, "getaddrinfo: %s", gai_strerror(err));
+
+    /* A socket per client. */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Listen where the server would, clients don't know the difference. */
+    err = getaddrinfo(NULL, lport, &hints, &addr_res);
+    if(err != 0)
+        error(EXIT_FAILURE, 0, "getaddrinfo: %s", gai_strerror(err));
+
+    for(addr = addr_res; addr != NULL && nlfds < NETEM_LISTEN_MAX;
+        addr = addr->ai_next) {
+        int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK,
+                        addr->ai_protocol);
+
+        if(fd < 0 || bind(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+            perror("netem listen");
+            exit(EXIT_FAILURE);
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = NETEM_FLOWS_MAX + nlfds;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        lfds[nlfds++] = fd;
+    }
+    freeaddrinfo(addr_res);
+
+    flows = malloc(sizeof(struct netem_flow) * NETEM_FLOWS_MAX);
+    heap = malloc(sizeof(struct netem_dgram *) * NETEM_QUEUE_MAX);
+    for(i = 0; i < NETEM_HASH_SIZE; i++) {
+        buckets[i] = -1;
+    }
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = NETEM_TIMER;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    signal(SIGINT, netem_stop);
+    signal(SIGTERM, netem_stop);
+
+    start = reported = ticks_get();
+
+    while(!netem_quit) {
+        int n = epoll_wait(epfd, events, NETEM_EVENTS, -1);
+
+        now = ticks_get();
+
+        for(i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u32;
+
+            if(id == NETEM_TIMER) {
+                uint64_t expirations;
+
+                if(read(tfd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+            } else if(id >= NETEM_FLOWS_MAX) {
+                netem_recv_client(lfds[id - NETEM_FLOWS_MAX], now);
+            } else {
+                netem_recv_server(id, now);
+            }
+        }
+
+        netem_flush(tfd, ticks_get());
+
+        if(interval > 0 && now - reported >= interval * 1000000000ULL) {
+            netem_report(now - start);
+            reported = now;
+        }
+    }
+
+    netem_report(ticks_get() - start);
+
+    while(nheap > 0) {
+        free(heap_pop());
+    }
+    for(i = 0; i < nflows; i++) {
+        close(flows[i].fd);
+    }
+    for(i = 0; i < nlfds; i++) {
+        close(lfds[i]);
+    }
+    close(tfd);
+    close(epfd);
+    free(heap);
+    free(flows);
+    freeaddrinfo(server);
+
+    return 0;
+}
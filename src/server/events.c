@@ -22,28 +22,67 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 #ifdef __FreeBSD__
 #include <netinet/in.h>
 #endif
 
 #include "../cdata.h"
+#include "timers.h"
 #include "server.h"
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+#include "region.h"
+#include "trace.h"
+#include "probes.h"
+
+/* Header of the message carries whose position it is and the number of
+ * the tick, so the client can tell players apart and interpolate them.
+ */
+/* Queues message `m' for player `p'. When the batch is full, it is put
+ * aside to be sent as is and a new one is started, nothing is dropped.
+ */
+static void player_push(struct player *p, struct msg *m)
+{
+    if(msg_batch_push(&(p->msgbatch), m) == MSGBATCH_OK) {
+        return;
+    }
+
+    if(p->msgbatch_full_count == p->msgbatch_full_size) {
+        p->msgbatch_full_size = p->msgbatch_full_size > 0 ?
+            p->msgbatch_full_size * 2 : 1;
+        p->msgbatch_full = realloc(p->msgbatch_full,
+                                   sizeof(struct msg_batch) *
+                                   p->msgbatch_full_size);
+    }
 
-void event_enemy_position(struct player *p, uint16_t x, uint16_t y)
+    memcpy(&(p->msgbatch_full[p->msgbatch_full_count++]), &(p->msgbatch),
+           sizeof(struct msg_batch));
+    memset(&(p->msgbatch), 0, sizeof(struct msg_batch));
+    msg_batch_push(&(p->msgbatch), m);
+}
+
+void event_enemy_position(struct player *p, uint8_t id, uint16_t x, uint16_t y,
+                          uint32_t tick)
 {
     struct msg msg;
     
     p->seq++;
     
+    msg.header.seq = tick;
+    msg.header.id = id;
     msg.type = MSGTYPE_ENEMY_POSITION;
     msg.event.enemy_position.pos_x = x;
     msg.event.enemy_position.pos_y = y;
-    msg_batch_push(&(p->msgbatch), &msg);
+    player_push(p, &msg);
 }
 
 void event_player_position(struct player *p)
@@ -52,14 +91,28 @@ void event_player_position(struct player *p)
 
     p->seq++;
     
+    msg.header.seq = p->ack;
     msg.type = MSGTYPE_PLAYER_POSITION;
     msg.event.player_position.pos_x = p->pos_x;
     msg.event.player_position.pos_y = p->pos_y;
-    msg_batch_push(&(p->msgbatch), &msg);
+    player_push(p, &msg);
+}
+
+/* Datagrams may still arrive out of order, never ack backwards. */
+static void player_ack(struct player *p, uint32_t seq)
+{
+    if((int32_t) (seq - p->ack) > 0) {
+        p->ack = seq;
+    }
 }
 
 void event_player_killed(struct player *ptarget, struct player *pkiller)
 {
+    TRACE_SCOPE("event_player_killed");
+
+    PROBE2(event_player_killed, ptarget->id, pkiller->id);
+    PROBE_RETURN("event_player_killed");
+
     INFO("Player %s kills %s.\n", pkiller->nick, ptarget->nick);
     return;
 }
@@ -67,8 +120,11 @@ void event_player_killed(struct player *ptarget, struct player *pkiller)
 void event_player_hit(struct player *ptarget, struct player *pkiller, uint16_t damage)
 {
     struct msg msg;
+    TRACE_SCOPE("event_player_hit");
+
+    PROBE3(event_player_hit, ptarget->id, pkiller->id, damage);
+    PROBE_RETURN("event_player_hit");
 
-    
     INFO("Player %s hits %s, damage: %u\n", pkiller->nick, ptarget->nick, damage);
     
     ptarget->seq++;
@@ -93,26 +149,29 @@ void event_player_hit(struct player *ptarget, struct player *pkiller, uint16_t d
     msg.type = MSGTYPE_PLAYER_HIT;
     msg.event.player_hit.hp = ptarget->hp;
     msg.event.player_hit.armor = ptarget->armor;
-    msg_batch_push(&(ptarget->msgbatch), &msg);
+    player_push(ptarget, &msg);
 }
 
-void event_map_explode(uint16_t w, uint16_t h)
+void event_map_explode(struct room *r, struct msgtype_map_explode *explode)
 {
     struct msg msg;
-    struct players_slot *slot = players->root;
+    struct players_slot *slot = r->players->root;
+    TRACE_SCOPE("event_map_explode");
+
+    PROBE3(event_map_explode, r->id, explode->w, explode->h);
+    PROBE_RETURN("event_map_explode");
 
     msg.type = MSGTYPE_MAP_EXPLODE;
-    msg.event.map_explode.w = w;
-    msg.event.map_explode.h = h;
+    memcpy(&(msg.event.map_explode), explode, sizeof(*explode));
 
-    INFO("Map has been destroyed at %ux%u.\n", w, h);
+    INFO("Map has been destroyed at %ux%u.\n", explode->w, explode->h);
     
     while(slot != NULL) {
         struct player *p = slot->p;
 
         p->seq++;
 
-        msg_batch_push(&(p->msgbatch), &msg);
+        player_push(p, &msg);
         
         slot = slot->next;
     }
@@ -121,15 +180,36 @@ void event_map_explode(uint16_t w, uint16_t h)
 void event_on_bonus(struct player *p, struct bonus *bonus)
 {
     struct msg msg;
+    TRACE_SCOPE("event_on_bonus");
+
+    PROBE2(event_on_bonus, p->id, bonus->type);
+    PROBE_RETURN("event_on_bonus");
     
     p->seq++;
 
     switch(bonus->type) {
     case BONUSTYPE_WEAPON:
         p->weapons.bullets[bonus->index] = weapons[bonus->index].bullets_count;
+        p->weapons.slots[bonus->index] = 1;
         INFO("Player %s get bonus: weapon - %s.\n",
              p->nick, weapons[bonus->index].name);
         break;
+    case BONUSTYPE_HEALTH:
+        p->hp += healths[bonus->index].hp;
+        if(p->hp > PLAYER_HP_MAX) {
+            p->hp = PLAYER_HP_MAX;
+        }
+        INFO("Player %s get bonus: health - %s.\n",
+             p->nick, healths[bonus->index].name);
+        break;
+    case BONUSTYPE_ARMOR:
+        p->armor += armors[bonus->index].armor;
+        if(p->armor > PLAYER_ARMOR_MAX) {
+            p->armor = PLAYER_ARMOR_MAX;
+        }
+        INFO("Player %s get bonus: armor - %s.\n",
+             p->nick, armors[bonus->index].name);
+        break;
     default:
         break;
     }
@@ -137,12 +217,12 @@ void event_on_bonus(struct player *p, struct bonus *bonus)
     msg.type = MSGTYPE_ON_BONUS;
     msg.event.on_bonus.type = bonus->type;
     msg.event.on_bonus.index = bonus->index;
-    msg_batch_push(&(p->msgbatch), &msg);
+    player_push(p, &msg);
 }
 
-void event_disconnect_server(void)
+void event_disconnect_server(struct room *r)
 {
-    struct players_slot *slot = players->root;
+    struct players_slot *slot = r->players->root;
     struct msg msg;
 
     msg.type = MSGTYPE_DISCONNECT_SERVER;
@@ -152,54 +232,56 @@ void event_disconnect_server(void)
         struct player *p = slot->p;
 
         p->seq++;
-        msg_batch_push(&(p->msgbatch), &msg);
+        player_push(p, &msg);
         
         slot = slot->next;
     }
 }
 
-void event_disconnect_notify(uint8_t *nick)
+void event_disconnect_notify(struct room *r, uint8_t *nick)
 {
     struct msg msg;
-    struct players_slot *slot = players->root;
+    struct players_slot *slot = r->players->root;
     
     msg.type = MSGTYPE_DISCONNECT_NOTIFY;
     strncpy((char *) msg.event.disconnect_notify.nick,
-            (char *) nick, NICK_MAX_LEN);    
+            (char *) nick, NICK_MAX_LEN - 1);
+    msg.event.disconnect_notify.nick[NICK_MAX_LEN - 1] = '\0';    
     
-    slot = players->root;
+    slot = r->players->root;
     while(slot != NULL) {
         struct player *p = slot->p;
         
         p->seq++;
-        msg_batch_push(&(p->msgbatch), &msg);
+        player_push(p, &msg);
         
         slot = slot->next;
     }
 }
 
-void event_connect_notify(struct player *p)
+void event_connect_notify(struct room *r, struct player *p)
 {
     struct msg msg;
-    struct players_slot *slot = players->root;
+    struct players_slot *slot = r->players->root;
     
     msg.type = MSGTYPE_CONNECT_NOTIFY;
     strncpy((char *) msg.event.connect_notify.nick,
-            (char *) p->nick, NICK_MAX_LEN);
+            (char *) p->nick, NICK_MAX_LEN - 1);
+    msg.event.connect_notify.nick[NICK_MAX_LEN - 1] = '\0';
     
     while(slot != NULL) {
         struct player *lp = slot->p;
             
         if(lp != p) {
             lp->seq++;
-            msg_batch_push(&(lp->msgbatch), &msg);
+            player_push(lp, &msg);
         }
             
         slot = slot->next;
     }
 }
 
-void event_connect_ok(struct player *p, uint8_t ok)
+void event_connect_ok(struct room *r, struct player *p, uint8_t ok)
 {
     struct msg msg;
     
@@ -214,78 +296,131 @@ void event_connect_ok(struct player *p, uint8_t ok)
     msg.event.connect_ok.id = p->id;
     msg.event.connect_ok.ok = ok;
     strncpy((char *) msg.event.connect_ok.mapname,
-            (char *) map->name, MAP_NAME_MAX_LEN);
-    msg_batch_push(&(p->msgbatch), &msg);
+            (char *) r->map->name, MAP_NAME_MAX_LEN);
+    player_push(p, &msg);
 }
 
-void send_events(void)
+static void encode_player(void *arg, uint32_t i)
 {
-    struct players_slot *slot = players->root;
+    struct world_view *v = arg;
+    struct player *p = v->players[i].p;
+    uint16_t j;
+    TRACE_SCOPE("encode_player");
+
+    for(j = 0; j < v->count; j++) {
+        struct world_view_player *lp = &(v->players[j]);
+
+        /* The player's own position is sent as PLAYER_POSITION. */
+        if(lp->p == p) {
+            continue;
+        }
+
+        if(IN_PLAYER_VIEWPORT(lp->pos_x, lp->pos_y,
+                              v->players[i].pos_x, v->players[i].pos_y)) {
+            event_enemy_position(p, lp->p->id, lp->pos_x, lp->pos_y,
+                                 v->tick);
+        }
+    }
+}
+
+/* Packs visible diff for each player. Players are spread between workers,
+ * all of them read the same world view taken after the tick.
+ */
+void encode_events(struct room *r)
+{
+    struct world_view *view = &(r->view);
+    struct players_slot *slot = r->players->root;
+    TRACE_SCOPE("encode_events");
+
+    view->tick = r->nticks + 1;
+    view->count = 0;
+    while(slot != NULL) {
+        struct world_view_player *vp = &(view->players[view->count++]);
+
+        vp->p = slot->p;
+        vp->pos_x = slot->p->pos_x;
+        vp->pos_y = slot->p->pos_y;
+
+        slot = slot->next;
+    }
+
+    workers_run(r->workers, view->count, 1, encode_player, view);
+}
+
+void send_events(struct room *r)
+{
+    struct players_slot *slot = r->players->root;
+    TRACE_SCOPE("send_events");
 
-    bullets_proceed(bullets);
-    
     /* Send diff to each player. */
-    slot = players->root;
     while(slot != NULL) {
         struct player *p = slot->p;
-        struct players_slot *lslot = players->root;
-
-        while(lslot != NULL) {
-            struct player *lp = lslot->p;
+        uint16_t i;
 
-            if(IN_PLAYER_VIEWPORT(lp->pos_x, lp->pos_y, p->pos_x, p->pos_y)) {
-                event_enemy_position(p, lp->pos_x, lp->pos_y);
-            }
+        for(i = 0; i < p->msgbatch_full_count; i++) {
+            struct msg_batch *b = &(p->msgbatch_full[i]);
 
-            lslot = lslot->next;
+            metrics_batch(&r->metrics, MSGBATCH_SIZE(b));
+            send_to(r, b->chunks, b->size + 1, p->route);
         }
-        
+        p->msgbatch_full_count = 0;
+
         if(MSGBATCH_SIZE(&(p->msgbatch)) > 0) {
-            send_to(p->msgbatch.chunks, p->msgbatch.size + 1,
-                   (struct sockaddr *) p->addr,
-                   sizeof(struct sockaddr_storage));
+            metrics_batch(&r->metrics, MSGBATCH_SIZE(&(p->msgbatch)));
+            send_to(r, p->msgbatch.chunks, p->msgbatch.size + 1, p->route);
         }
-        
-        slot = slot->next;
-    }
 
-    slot = players->root;
-    /* Refresh msgbatch for each player. */
-    while(slot != NULL) {
-        memset(&(slot->p->msgbatch), 0, sizeof(struct msg_batch));
+        /* Refresh msgbatch. */
+        memset(&(p->msgbatch), 0, sizeof(struct msg_batch));
+
         slot = slot->next;
     }
-        
 }
 
-void event_disconnect_client(struct msg_queue_node *qnode)
+void event_disconnect_client(struct room *r, struct msg_queue_node *qnode)
 {
     uint8_t nick[NICK_MAX_LEN];
+    TRACE_SCOPE("event_disconnect_client");
+
+    PROBE2(event_disconnect_client, r->id, qnode->data->header.id);
+    PROBE_RETURN("event_disconnect_client");
 
     /* Copy nick of the disconnected player. */
-    if(players->slots[qnode->data->header.id] != NULL) {
-        strncpy((char *) nick, (char *) players->slots[qnode->data->header.id]->p->nick, NICK_MAX_LEN);
+    if(r->players->slots[qnode->data->header.id] != NULL) {
+        struct player *p = r->players->slots[qnode->data->header.id]->p;
+
+        strncpy((char *) nick, (char *) p->nick, NICK_MAX_LEN - 1);
+        nick[NICK_MAX_LEN - 1] = '\0';
+        region_player_remove(region_of(r, p->pos_x, p->pos_y), p);
+        occupancy_remove(r, region_of(r, p->pos_x, p->pos_y),
+                         p->pos_x, p->pos_y);
     }
 
-    if(players_release(players, qnode->data->header.id) == PLAYERS_ERROR) {
+    if(players_release(r->players, qnode->data->header.id) == PLAYERS_ERROR) {
         WARN("Couldn't remove the player from slots: %u\n", qnode->data->header.id);
         return;
     }
 
+    router_unroute(router, &(qnode->route->addr));
+
     INFO("Player %s disconnect.\n", nick);
 
-    event_disconnect_notify(nick);    
+    event_disconnect_notify(r, nick);    
 }
 
-void event_connect_ask(struct msg_queue_node *qnode)
+void event_connect_ask(struct room *r, struct msg_queue_node *qnode)
 {
     struct player player;
     struct player *newplayer;
+    TRACE_SCOPE("event_connect_ask");
+
+    PROBE1(event_connect_ask, r->id);
+    PROBE_RETURN("event_connect_ask");
     
-    player.addr = qnode->addr;
+    player.route = qnode->route;
     player.nick = qnode->data->event.connect_ask.nick;
 
-    newplayer = players_occupy(players, &player);
+    newplayer = players_occupy(r->players, &player);
     
     if(newplayer == NULL) {
         struct msg msg;
@@ -299,9 +434,8 @@ void event_connect_ask(struct msg_queue_node *qnode)
         memset(&msgbatch, 0, sizeof(struct msg_batch));
         msg_batch_push(&msgbatch, &msg);
         
-        send_to(msgbatch.chunks, msgbatch.size + 1,
-               (struct sockaddr *) qnode->addr,
-               sizeof(struct sockaddr_storage));
+        send_to(r, msgbatch.chunks, msgbatch.size + 1, qnode->route);
+        router_unroute(router, &(qnode->route->addr));
     } else {
         struct map_respawn *respawn;
         struct bonus bonus = {
@@ -311,32 +445,40 @@ void event_connect_ask(struct msg_queue_node *qnode)
             .y = 0
         };
         
-        INFO("New player connected with nick %s. Total players: %u.\n",
-             newplayer->nick, players->count);
+        INFO("New player connected with nick %s to room %u. "
+             "Total players: %u.\n",
+             newplayer->nick, r->id, r->players->count);
         
         /* Connect new player. */
-        event_connect_ok(newplayer, 1);
+        event_connect_ok(r, newplayer, 1);
         
         /* Get random respawn point. */
-        srand((unsigned int) time(NULL));
-        respawn = &(map->respawns[0 + rand() % map->respawns_count]);
+        respawn = &(r->map->respawns[rng_range(&r->rng,
+                                               r->map->respawns_count)]);
         newplayer->pos_x = respawn->w + 1;
         newplayer->pos_y = respawn->h + 1;
-        
+        region_player_add(region_of(r, newplayer->pos_x, newplayer->pos_y),
+                          newplayer);
+        occupancy_add(r, newplayer->pos_x, newplayer->pos_y);
+
         event_player_position(newplayer);
         
         /* Give to the player the weapon. */
         event_on_bonus(newplayer, &bonus);
         
         /* Notify rest players about new player. */
-        event_connect_notify(newplayer);
+        event_connect_notify(r, newplayer);
+
+        bonuses_pickup(region_of(r, newplayer->pos_x, newplayer->pos_y),
+                       newplayer);
     }
 }
 
 
-void event_shoot(struct msg_queue_node *qnode)
+void event_shoot(struct room *r, struct region *rg,
+                 struct msg_queue_node *qnode)
 {
-    struct player *p = players->slots[qnode->data->header.id]->p;
+    struct player *p = r->players->slots[qnode->data->header.id]->p;
     struct bullet b = {
         .player = p,
         .type = p->weapons.current,
@@ -346,24 +488,24 @@ void event_shoot(struct msg_queue_node *qnode)
         .sy = p->pos_y,
         .direction = qnode->data->event.shoot.direction
     };
+    TRACE_SCOPE("event_shoot");
+
+    PROBE3(event_shoot, r->id, p->id, b.direction);
+    PROBE_RETURN("event_shoot");
+
+    player_ack(p, qnode->data->header.seq);
 
     if(p->weapons.bullets[p->weapons.current] > 0) {
         p->weapons.bullets[p->weapons.current]--;
-        bullets_add(bullets, &b);
+        bullets_add(rg->bullets, &b);
     }
 }
 
 
-void event_walk(struct msg_queue_node *qnode)
+static void player_step(struct player *p, uint8_t direction)
 {
-    struct player *p = players->slots[qnode->data->header.id]->p;
-    uint16_t px, py;
+    p->direction = direction;
 
-    px = p->pos_x;
-    py = p->pos_y;
-    
-    p->direction = qnode->data->event.walk.direction;
-    
     switch(p->direction) {
     case DIRECTION_LEFT:
         p->pos_x--;
@@ -380,11 +522,82 @@ void event_walk(struct msg_queue_node *qnode)
     default:
         break;
     }
+}
+
+/* Runs in parallel with other regions, so it checks collisions with
+ * players of region `rg' only. Steps over the region's border are left to
+ * event_walk_handoff().
+ */
+void event_walk(struct room *r, struct region *rg,
+                struct msg_queue_node *qnode)
+{
+    struct player *p = r->players->slots[qnode->data->header.id]->p;
+    uint16_t px, py;
+    TRACE_SCOPE("event_walk");
+
+    PROBE3(event_walk, r->id, p->id, qnode->data->event.walk.direction);
+    PROBE_RETURN("event_walk");
 
-    if(collision_check_player(p, map, players) != COLLISION_NONE) {
+    player_ack(p, qnode->data->header.seq);
+
+    px = p->pos_x;
+    py = p->pos_y;
+
+    player_step(p, qnode->data->event.walk.direction);
+
+    if(!REGION_CONTAINS(rg, p->pos_x, p->pos_y)) {
         p->pos_x = px;
         p->pos_y = py;
+        region_defer(rg, qnode);
+
+        return;
+    }
+
+    if(region_collision_check_player(rg, p, r->map) != COLLISION_NONE) {
+        p->pos_x = px;
+        p->pos_y = py;
+    } else {
+        occupancy_remove(r, rg, px, py);
+        occupancy_add(r, p->pos_x, p->pos_y);
+        bonuses_pickup(rg, p);
     }
     
     event_player_position(p);
 }
+
+/* Step of a player of region `rg' applied by the merge: it may cross the
+ * border, so collisions are checked with all the players.
+ */
+void event_walk_handoff(struct room *r, struct region *rg,
+                        struct msg_queue_node *qnode)
+{
+    struct player *p = r->players->slots[qnode->data->header.id]->p;
+    uint16_t px, py;
+    TRACE_SCOPE("event_walk_handoff");
+
+    PROBE3(event_walk_handoff, r->id, p->id,
+           qnode->data->event.walk.direction);
+    PROBE_RETURN("event_walk_handoff");
+
+    player_ack(p, qnode->data->header.seq);
+
+    px = p->pos_x;
+    py = p->pos_y;
+
+    player_step(p, qnode->data->event.walk.direction);
+
+    if(collision_check_player(p, r->map, r->players) != COLLISION_NONE) {
+        p->pos_x = px;
+        p->pos_y = py;
+    } else {
+        if(region_of(r, p->pos_x, p->pos_y) != rg) {
+            region_player_remove(rg, p);
+            region_player_add(region_of(r, p->pos_x, p->pos_y), p);
+        }
+        occupancy_remove(r, rg, px, py);
+        occupancy_add(r, p->pos_x, p->pos_y);
+        bonuses_pickup(region_of(r, p->pos_x, p->pos_y), p);
+    }
+
+    event_player_position(p);
+}
@@ -23,20 +23,22 @@
 #ifndef __EVENTS_H__
 #define __EVENTS_H__
 
-void event_enemy_position(struct player*, uint16_t, uint16_t);
+void event_enemy_position(struct player*, uint8_t, uint16_t, uint16_t, uint32_t);
 void event_player_position(struct player*);
 void event_player_killed(struct player*, struct player*);
 void event_player_hit(struct player*, struct player*, uint16_t);
-void event_map_explode(uint16_t, uint16_t);
+void event_map_explode(struct room*, struct msgtype_map_explode*);
 void event_on_bonus(struct player*, struct bonus*);
-void event_disconnect_server(void);
-void event_disconnect_notify(uint8_t*);
-void event_connect_notify(struct player*);
-void event_connect_ok(struct player*, uint8_t);
-void send_events(void);
-void event_disconnect_client(struct msg_queue_node*);
-void event_connect_ask(struct msg_queue_node*);
-void event_shoot(struct msg_queue_node*);
-void event_walk(struct msg_queue_node*);
+void event_disconnect_server(struct room*);
+void event_disconnect_notify(struct room*, uint8_t*);
+void event_connect_notify(struct room*, struct player*);
+void event_connect_ok(struct room*, struct player*, uint8_t);
+void encode_events(struct room*);
+void send_events(struct room*);
+void event_disconnect_client(struct room*, struct msg_queue_node*);
+void event_connect_ask(struct room*, struct msg_queue_node*);
+void event_shoot(struct room*, struct region*, struct msg_queue_node*);
+void event_walk(struct room*, struct region*, struct msg_queue_node*);
+void event_walk_handoff(struct room*, struct region*, struct msg_queue_node*);
 
 #endif
@@ -0,0 +1,428 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "log.h"
+
+#ifdef _DEBUG_
+int log_level = LOG_DEBUG;
+#else
+int log_level = LOG_INFO;
+#endif
+
+static struct log_ring *log_rings[LOG_RINGS_MAX];
+static int log_nrings = 0;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *log_ring_own = NULL;
+static pthread_t log_thread;
+static bool log_running = false;
+static bool log_quit = false;
+
+static const char *log_levels[] = { "debug", "info", "warn" };
+
+enum log_arg_type {
+    LOG_ARG_NONE = 0,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR
+};
+
+/* Returns the level by its name or -1. */
+int log_level_find(const char *name)
+{
+    int i;
+
+    for(i = 0; i < (int) (sizeof(log_levels) / sizeof(log_levels[0])); i++) {
+        if(strcasecmp(name, log_levels[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Skips the conversion specification starting at `f', which points to
+ * '%', and returns the type of its argument.
+ */
+static enum log_arg_type log_spec(const char *f, const char **end)
+{
+    int longs = 0, size = 0;
+
+    f++;
+    while(*f != '\0' && strchr("-+ #0123456789.", *f) != NULL) {
+        f++;
+    }
+    while(*f == 'h') {
+        f++;
+    }
+    while(*f == 'l') {
+        longs++;
+        f++;
+    }
+    if(*f == 'z') {
+        size = 1;
+        f++;
+    }
+
+    *end = *f != '\0' ? f + 1 : f;
+
+    switch(*f) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        if(size) {
+            return LOG_ARG_SIZE;
+        }
+
+        return longs == 0 ? LOG_ARG_INT :
+            longs == 1 ? LOG_ARG_LONG : LOG_ARG_LLONG;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        return LOG_ARG_DOUBLE;
+    case 'p':
+        return LOG_ARG_PTR;
+    case 's':
+        return LOG_ARG_STR;
+    default:
+        return LOG_ARG_NONE;
+    }
+}
+
+/* Takes the arguments off `ap' as the format describes them, nothing is
+ * formatted here.
+ */
+static void log_record_fill(struct log_record *rec, int level,
+                            const char *format, va_list ap)
+{
+    const char *f = format;
+    size_t slen = 0;
+
+    rec->level = level;
+    rec->format = format;
+    rec->nargs = 0;
+
+    while((f = strchr(f, '%')) != NULL && rec->nargs < LOG_ARGS_MAX) {
+        union log_arg *arg = &(rec->args[rec->nargs]);
+        const char *str;
+        size_t len;
+
+        switch(log_spec(f, &f)) {
+        case LOG_ARG_NONE:
+            continue;
+        case LOG_ARG_INT:
+            arg->i = va_arg(ap, int);
+            break;
+        case LOG_ARG_LONG:
+            arg->l = va_arg(ap, long);
+            break;
+        case LOG_ARG_LLONG:
+            arg->ll = va_arg(ap, long long);
+            break;
+        case LOG_ARG_SIZE:
+            arg->z = va_arg(ap, size_t);
+            break;
+        case LOG_ARG_DOUBLE:
+            arg->d = va_arg(ap, double);
+            break;
+        case LOG_ARG_PTR:
+            arg->p = va_arg(ap, void *);
+            break;
+        case LOG_ARG_STR:
+            /* Strings are often freed before the record is printed. */
+            if((str = va_arg(ap, const char *)) == NULL) {
+                str = "(null)";
+            }
+            len = strlen(str);
+            if(slen + len >= LOG_STRINGS_LEN) {
+                len = slen < LOG_STRINGS_LEN ? LOG_STRINGS_LEN - slen - 1 : 0;
+            }
+            if(slen < LOG_STRINGS_LEN) {
+                memcpy(rec->strings + slen, str, len);
+                rec->strings[slen + len] = '\0';
+                arg->s = slen;
+                slen += len + 1;
+            } else {
+                arg->s = LOG_STRINGS_LEN - 1;
+            }
+            break;
+        }
+
+        rec->nargs++;
+    }
+}
+
+/* Formats the record, conversion by conversion, and writes it out. */
+static void log_record_print(struct log_record *rec)
+{
+    char text[LOG_TEXT_LEN], spec[16];
+    const char *f = rec->format;
+    size_t len = 0;
+    int nargs = 0;
+
+    while(*f != '\0' && len < sizeof(text) - 1) {
+        const char *start = f;
+        union log_arg *arg;
+        enum log_arg_type type;
+        size_t n;
+        int r = 0;
+
+        if(*f != '%') {
+            text[len++] = *f++;
+            continue;
+        }
+
+        type = log_spec(f, &f);
+        if(type == LOG_ARG_NONE) {
+            if(f[-1] == '%') {
+                text[len++] = '%';
+            }
+            continue;
+        }
+
+        /* Conversions past LOG_ARGS_MAX are printed as they are. */
+        if(nargs == rec->nargs) {
+            n = strlen(start) < sizeof(text) - 1 - len ?
+                strlen(start) : sizeof(text) - 1 - len;
+            memcpy(text + len, start, n);
+            len += n;
+            break;
+        }
+        arg = &(rec->args[nargs++]);
+
+        n = f - start < (ptrdiff_t) sizeof(spec) ?
+            (size_t) (f - start) : sizeof(spec) - 1;
+        memcpy(spec, start, n);
+        spec[n] = '\0';
+
+        switch(type) {
+        case LOG_ARG_INT:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->i);
+            break;
+        case LOG_ARG_LONG:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->l);
+            break;
+        case LOG_ARG_LLONG:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->ll);
+            break;
+        case LOG_ARG_SIZE:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->z);
+            break;
+        case LOG_ARG_DOUBLE:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->d);
+            break;
+        case LOG_ARG_PTR:
+            r = snprintf(text + len, sizeof(text) - len, spec, arg->p);
+            break;
+        case LOG_ARG_STR:
+            r = snprintf(text + len, sizeof(text) - len, spec,
+                         rec->strings + arg->s);
+            break;
+        case LOG_ARG_NONE:
+            break;
+        }
+
+        if(r > 0) {
+            len += (size_t) r < sizeof(text) - len ?
+                (size_t) r : sizeof(text) - len - 1;
+        }
+    }
+    text[len] = '\0';
+
+    fputs(text, rec->level >= LOG_WARN ? stderr : stdout);
+}
+
+/* Registers the ring of the calling thread, once per thread. */
+static struct log_ring *log_ring_get(void)
+{
+    struct log_ring *ring;
+
+    if(log_ring_own != NULL) {
+        return log_ring_own;
+    }
+
+    pthread_mutex_lock(&log_rings_mutex);
+    if(log_nrings < LOG_RINGS_MAX &&
+       (ring = calloc(1, sizeof(struct log_ring))) != NULL) {
+        log_rings[log_nrings] = ring;
+        __atomic_store_n(&log_nrings, log_nrings + 1, __ATOMIC_RELEASE);
+        log_ring_own = ring;
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    return log_ring_own;
+}
+
+void log_write(int level, const char *format, ...)
+{
+    struct log_ring *ring;
+    struct log_record *rec;
+    uint64_t head;
+    va_list ap;
+
+    /* Before the logging thread is started, after it is stopped and by
+     * threads left without a ring messages are written synchronously.
+     */
+    if(!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+       (ring = log_ring_get()) == NULL) {
+        struct log_record tmp;
+
+        va_start(ap, format);
+        log_record_fill(&tmp, level, format, ap);
+        va_end(ap);
+        log_record_print(&tmp);
+
+        return;
+    }
+
+    head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &(ring->records[head % LOG_RING_SIZE]);
+    rec->time = ticks_get();
+
+    va_start(ap, format);
+    log_record_fill(rec, level, format, ap);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Prints all records which are in the rings now, oldest first. Returns
+ * the number of printed records.
+ */
+static int log_drain(void)
+{
+    static uint64_t reported = 0;
+    uint64_t heads[LOG_RINGS_MAX], dropped;
+    int nrings = __atomic_load_n(&log_nrings, __ATOMIC_ACQUIRE);
+    int i, n = 0;
+
+    for(i = 0; i < nrings; i++) {
+        heads[i] = __atomic_load_n(&log_rings[i]->head, __ATOMIC_ACQUIRE);
+    }
+
+    for(;;) {
+        struct log_record *oldest = NULL;
+        int from = -1;
+
+        for(i = 0; i < nrings; i++) {
+            struct log_ring *ring = log_rings[i];
+
+            if(ring->tail < heads[i]) {
+                struct log_record *rec = &(ring->records[ring->tail % LOG_RING_SIZE]);
+
+                if(oldest == NULL || rec->time < oldest->time) {
+                    oldest = rec;
+                    from = i;
+                }
+            }
+        }
+
+        if(oldest == NULL) {
+            break;
+        }
+
+        log_record_print(oldest);
+        __atomic_store_n(&log_rings[from]->tail, log_rings[from]->tail + 1,
+                         __ATOMIC_RELEASE);
+        n++;
+    }
+
+    dropped = 0;
+    for(i = 0; i < nrings; i++) {
+        dropped += __atomic_load_n(&log_rings[i]->dropped, __ATOMIC_RELAXED);
+    }
+
+    if(dropped > reported) {
+        fprintf(stderr, "[ WARN ]: %llu log messages dropped.\n",
+                (unsigned long long) (dropped - reported));
+        reported = dropped;
+    }
+
+    if(n > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    return n;
+}
+
+static void *log_thread_func(void *arg)
+{
+    struct timespec req = { 0, 10000000 };
+
+    while(!__atomic_load_n(&log_quit, __ATOMIC_ACQUIRE)) {
+        if(log_drain() == 0) {
+            nanosleep(&req, NULL);
+        }
+    }
+
+    return arg;
+}
+
+void log_init(void)
+{
+    if(pthread_create(&log_thread, NULL, log_thread_func, NULL) != 0) {
+        perror("log: pthread_create");
+        return;
+    }
+
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+}
+
+/* Stops the logging thread, messages left in the rings are printed. Later
+ * messages are written synchronously.
+ */
+void log_free(void)
+{
+    int i;
+
+    if(!log_running) {
+        return;
+    }
+
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_quit, true, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    log_drain();
+
+    for(i = 0; i < log_nrings; i++) {
+        free(log_rings[i]);
+    }
+    log_nrings = 0;
+}
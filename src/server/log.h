@@ -0,0 +1,78 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/* Each thread which logs gets its own single-producer ring of fixed-size
+ * records. The producer only stores the format and raw arguments of the
+ * message, strings are copied into the record, and the logging thread
+ * formats the text while it drains all rings in the order of records'
+ * time. Formats must be literals, conversions other than integers,
+ * doubles, pointers and strings (such as `*' width) aren't supported.
+ * When a ring is full the message is dropped and counted, the producer
+ * never waits. Threads which couldn't get a ring (all LOG_RINGS_MAX are
+ * taken or allocation failed) write their messages synchronously.
+ */
+#define LOG_RINGS_MAX 128
+#define LOG_RING_SIZE 512
+#define LOG_TEXT_LEN 200
+#define LOG_ARGS_MAX 8
+#define LOG_STRINGS_LEN 96
+
+union log_arg {
+    int i;
+    long l;
+    long long ll;
+    size_t z;
+    double d;
+    const void *p;
+    /* Offset of a copied string in record's `strings'. */
+    size_t s;
+};
+
+struct log_record {
+    uint64_t time;
+    uint8_t level;
+    uint8_t nargs;
+    const char *format;
+    union log_arg args[LOG_ARGS_MAX];
+    char strings[LOG_STRINGS_LEN];
+};
+
+struct log_ring {
+    /* Written by the producer. */
+    uint64_t head;
+    uint64_t dropped;
+    uint8_t pad0[64 - 2 * sizeof(uint64_t)];
+    /* Written by the logging thread. */
+    uint64_t tail;
+    uint8_t pad1[64 - sizeof(uint64_t)];
+    struct log_record records[LOG_RING_SIZE];
+};
+
+void log_init(void);
+void log_free(void);
+int log_level_find(const char*);
+
+#endif
@@ -0,0 +1,265 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "timers.h"
+#include "server.h"
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+
+/* Upper bounds of histograms' buckets. */
+static const double metrics_tick_bounds[METRICS_TICK_BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025
+};
+static const uint64_t metrics_batch_bounds[METRICS_BATCH_BUCKETS] = {
+    1, 4, 16, 64, 128, MSGBATCH_INIT_SIZE
+};
+
+static int metrics_fd = -1;
+static char metrics_path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+static pthread_t metrics_thread;
+
+/* Accounts one tick which took `ns' nanoseconds. */
+void metrics_tick(struct room_metrics *m, uint64_t ns)
+{
+    int i = 0;
+
+    while(i < METRICS_TICK_BUCKETS && ns > metrics_tick_bounds[i] * 1e9) {
+        i++;
+    }
+
+    METRICS_ADD(m->tick_buckets[i], 1);
+    METRICS_ADD(m->tick_sum_ns, ns);
+}
+
+/* Accounts one batch of `n' messages sent to a player. */
+void metrics_batch(struct room_metrics *m, uint64_t n)
+{
+    int i = 0;
+
+    while(i < METRICS_BATCH_BUCKETS && n > metrics_batch_bounds[i]) {
+        i++;
+    }
+
+    METRICS_ADD(m->batch_buckets[i], 1);
+    METRICS_ADD(m->batch_sum, n);
+}
+
+#define LOAD(v) ((unsigned long long) __atomic_load_n(&(v), __ATOMIC_RELAXED))
+
+static void metrics_header(FILE *f, const char *name, const char *type,
+                           const char *help)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Per-room gauge or counter, `offset' is the field in room_metrics. */
+static void metrics_rooms(FILE *f, const char *name, const char *type,
+                          const char *help, size_t offset)
+{
+    int i;
+
+    metrics_header(f, name, type, help);
+    for(i = 0; i < nrooms; i++) {
+        uint64_t *v = (uint64_t *) ((uint8_t *) &(rooms[i]->metrics) + offset);
+
+        fprintf(f, "%s{room=\"%d\"} %llu\n", name, i, LOAD(*v));
+    }
+}
+
+static void metrics_write(FILE *f)
+{
+    int i, j;
+
+    metrics_header(f, "shooter_recv_packets_total", "counter",
+                   "Datagrams received by a receive shard.");
+    for(i = 0; i < nshards; i++) {
+        fprintf(f, "shooter_recv_packets_total{shard=\"%d\"} %llu\n", i,
+                LOAD(shards[i].packets));
+    }
+
+    metrics_header(f, "shooter_recv_bytes_total", "counter",
+                   "Bytes received by a receive shard.");
+    for(i = 0; i < nshards; i++) {
+        fprintf(f, "shooter_recv_bytes_total{shard=\"%d\"} %llu\n", i,
+                LOAD(shards[i].bytes));
+    }
+
+    metrics_rooms(f, "shooter_send_packets_total", "counter",
+                  "Datagrams sent by a room.",
+                  offsetof(struct room_metrics, packets_out));
+    metrics_rooms(f, "shooter_send_bytes_total", "counter",
+                  "Bytes sent by a room.",
+                  offsetof(struct room_metrics, bytes_out));
+    metrics_rooms(f, "shooter_msgqueue_depth", "gauge",
+                  "Messages handled by the last tick of a room.",
+                  offsetof(struct room_metrics, queue_depth));
+    metrics_rooms(f, "shooter_msgqueue_drops_total", "counter",
+                  "Messages dropped because the room's queue was full.",
+                  offsetof(struct room_metrics, queue_drops));
+    metrics_rooms(f, "shooter_players", "gauge", "Players in a room.",
+                  offsetof(struct room_metrics, players));
+    metrics_rooms(f, "shooter_bullets", "gauge", "Bullets in flight in a room.",
+                  offsetof(struct room_metrics, bullets));
+
+    metrics_header(f, "shooter_tick_duration_seconds", "histogram",
+                   "Duration of a room's tick.");
+    for(i = 0; i < nrooms; i++) {
+        struct room_metrics *m = &(rooms[i]->metrics);
+        unsigned long long count = 0;
+
+        for(j = 0; j <= METRICS_TICK_BUCKETS; j++) {
+            count += LOAD(m->tick_buckets[j]);
+            if(j < METRICS_TICK_BUCKETS) {
+                fprintf(f, "shooter_tick_duration_seconds_bucket"
+                        "{room=\"%d\",le=\"%g\"} %llu\n", i,
+                        metrics_tick_bounds[j], count);
+            } else {
+                fprintf(f, "shooter_tick_duration_seconds_bucket"
+                        "{room=\"%d\",le=\"+Inf\"} %llu\n", i, count);
+            }
+        }
+
+        fprintf(f, "shooter_tick_duration_seconds_sum{room=\"%d\"} %.9f\n",
+                i, LOAD(m->tick_sum_ns) / 1e9);
+        fprintf(f, "shooter_tick_duration_seconds_count{room=\"%d\"} %llu\n",
+                i, count);
+    }
+
+    metrics_header(f, "shooter_batch_messages", "histogram",
+                   "Messages in a batch sent to a player.");
+    for(i = 0; i < nrooms; i++) {
+        struct room_metrics *m = &(rooms[i]->metrics);
+        unsigned long long count = 0;
+
+        for(j = 0; j <= METRICS_BATCH_BUCKETS; j++) {
+            count += LOAD(m->batch_buckets[j]);
+            if(j < METRICS_BATCH_BUCKETS) {
+                fprintf(f, "shooter_batch_messages_bucket"
+                        "{room=\"%d\",le=\"%llu\"} %llu\n", i,
+                        (unsigned long long) metrics_batch_bounds[j], count);
+            } else {
+                fprintf(f, "shooter_batch_messages_bucket"
+                        "{room=\"%d\",le=\"+Inf\"} %llu\n", i, count);
+            }
+        }
+
+        fprintf(f, "shooter_batch_messages_sum{room=\"%d\"} %llu\n",
+                i, LOAD(m->batch_sum));
+        fprintf(f, "shooter_batch_messages_count{room=\"%d\"} %llu\n",
+                i, count);
+    }
+}
+
+/* Every connection gets the current metrics and is closed. */
+static void *metrics_thread_func(void *arg)
+{
+    while("someone scrapes") {
+        int fd = accept(metrics_fd, NULL, NULL);
+        FILE *f;
+
+        if(fd < 0) {
+            continue;
+        }
+
+        if((f = fdopen(fd, "w")) == NULL) {
+            close(fd);
+            continue;
+        }
+
+        metrics_write(f);
+        fclose(f);
+    }
+
+    return arg;
+}
+
+/* Starts serving metrics in Prometheus text format on Unix socket `path'. */
+enum metrics_enum_t metrics_init(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        WARN("metrics: socket path is too long: %s.\n", path);
+        return METRICS_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    strncpy(metrics_path, path, sizeof(metrics_path) - 1);
+
+    if((metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("metrics: socket");
+        return METRICS_ERROR;
+    }
+
+    unlink(path);
+    if(bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+       listen(metrics_fd, 8) < 0) {
+        perror("metrics: bind");
+        close(metrics_fd);
+        metrics_fd = -1;
+        return METRICS_ERROR;
+    }
+
+    if(pthread_create(&metrics_thread, NULL, metrics_thread_func, NULL) != 0) {
+        perror("metrics: pthread_create");
+        close(metrics_fd);
+        unlink(path);
+        metrics_fd = -1;
+        return METRICS_ERROR;
+    }
+
+    INFO("Metrics are served on %s.\n", path);
+
+    return METRICS_OK;
+}
+
+void metrics_free(void)
+{
+    if(metrics_fd < 0) {
+        return;
+    }
+
+    pthread_cancel(metrics_thread);
+    pthread_join(metrics_thread, NULL);
+    close(metrics_fd);
+    unlink(metrics_path);
+    metrics_fd = -1;
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* Metrics of a room. Every field has a single writer (the room's thread,
+ * or receive shards under the room's queue mutex for `queue_drops'), it is
+ * updated with relaxed atomics and read the same way by the exporter, so
+ * nothing is locked on the hot path.
+ * Histograms keep per-bucket counts, the exporter makes them cumulative.
+ */
+#define METRICS_TICK_BUCKETS 8
+#define METRICS_BATCH_BUCKETS 6
+
+struct room_metrics {
+    uint64_t tick_buckets[METRICS_TICK_BUCKETS + 1];
+    uint64_t tick_sum_ns;
+    uint64_t batch_buckets[METRICS_BATCH_BUCKETS + 1];
+    uint64_t batch_sum;
+    uint64_t queue_depth;
+    uint64_t queue_drops;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+    uint64_t players;
+    uint64_t bullets;
+};
+
+/* Adds `v' to a counter which has a single writer. */
+#define METRICS_ADD(counter, v)                                         \
+    __atomic_store_n(&(counter),                                        \
+                     __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (v), \
+                     __ATOMIC_RELAXED)
+
+#define METRICS_SET(gauge, v)                                   \
+    __atomic_store_n(&(gauge), (v), __ATOMIC_RELAXED)
+
+enum metrics_enum_t {
+    METRICS_ERROR = 0,
+    METRICS_OK
+};
+
+void metrics_tick(struct room_metrics*, uint64_t);
+void metrics_batch(struct room_metrics*, uint64_t);
+enum metrics_enum_t metrics_init(const char*);
+void metrics_free(void);
+
+#endif
@@ -0,0 +1,1043 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#define NET_URING
+#endif
+#endif
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "timers.h"
+#include "server.h"
+#include "net.h"
+
+#define NET_SENDQ_INIT_SIZE 64
+#define NET_SENDQ_DATA_INIT_SIZE (NET_SENDQ_INIT_SIZE * sizeof(struct msg) * 4)
+/* Datagrams per sendmmsg() call, it accepts at most UIO_MAXIOV (1024). */
+#define NET_SEND_BATCH 256
+
+struct net_backend *net = NULL;
+
+/* Asks the kernel to report the local address each datagram was sent to,
+ * so the reply can leave from the same address.
+ */
+enum net_enum_t net_socket_pktinfo(int fd, int family)
+{
+    int on = 1;
+    int r = -1;
+
+    if(family == AF_INET) {
+        r = setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    } else if(family == AF_INET6) {
+        r = setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+    }
+
+    if(r != 0) {
+        perror("server: setsockopt: PKTINFO");
+
+        return NET_ERROR;
+    }
+
+    return NET_OK;
+}
+
+/* Prepares `hdr' for receiving a datagram into `d'. */
+static void net_recv_prepare(struct msghdr *hdr, struct iovec *iov,
+                             struct net_dgram *d)
+{
+    iov->iov_base = d->buf;
+    iov->iov_len = sizeof(d->buf);
+
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = &(d->route.addr);
+    hdr->msg_namelen = sizeof(d->route.addr);
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = d->control;
+    hdr->msg_controllen = sizeof(d->control);
+}
+
+/* Fills route's local address from the PKTINFO control message. */
+static void net_recv_route(struct msghdr *hdr, struct net_dgram *d, int fd)
+{
+    struct cmsghdr *cmsg;
+
+    d->route.fd = fd;
+    d->route.ifindex = 0;
+    memset(&(d->route.local), 0, sizeof(d->route.local));
+
+    for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pi = (struct in_pktinfo *) CMSG_DATA(cmsg);
+            struct sockaddr_in *sin = (struct sockaddr_in *) &(d->route.local);
+
+            sin->sin_family = AF_INET;
+            sin->sin_addr = pi->ipi_addr;
+            d->route.ifindex = pi->ipi_ifindex;
+        } else if(cmsg->cmsg_level == IPPROTO_IPV6 &&
+                  cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *pi = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+            struct sockaddr_in6 *sin6 =
+                (struct sockaddr_in6 *) &(d->route.local);
+
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_addr = pi->ipi6_addr;
+            d->route.ifindex = pi->ipi6_ifindex;
+        }
+    }
+}
+
+static socklen_t net_addrlen(const struct sockaddr_storage *addr)
+{
+    return addr->ss_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+/* Prepares `hdr' for sending `node' from its route's local address. */
+static void net_send_prepare(struct msghdr *hdr, struct iovec *iov,
+                             uint8_t *control, struct net_sendq *q,
+                             struct net_sendq_node *node)
+{
+    struct net_route *route = &(node->route);
+    struct cmsghdr *cmsg;
+
+    iov->iov_base = q->data + node->offset;
+    iov->iov_len = node->len;
+
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = &(route->addr);
+    hdr->msg_namelen = net_addrlen(&(route->addr));
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+
+    memset(control, 0, NET_CONTROL_LEN);
+    hdr->msg_control = control;
+    cmsg = (struct cmsghdr *) control;
+
+    if(route->local.ss_family == AF_INET) {
+        struct in_pktinfo *pi = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        pi->ipi_spec_dst = ((struct sockaddr_in *) &(route->local))->sin_addr;
+        hdr->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    } else if(route->local.ss_family == AF_INET6) {
+        struct in6_pktinfo *pi = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+        pi->ipi6_addr = ((struct sockaddr_in6 *) &(route->local))->sin6_addr;
+        pi->ipi6_ifindex = route->ifindex;
+        hdr->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+    } else {
+        hdr->msg_control = NULL;
+    }
+}
+
+struct net_sendq *net_sendq_init(void)
+{
+    struct net_sendq *q;
+
+    q = malloc(sizeof(struct net_sendq));
+    q->count = 0;
+    q->nodes_size = NET_SENDQ_INIT_SIZE;
+    q->nodes = malloc(sizeof(struct net_sendq_node) * q->nodes_size);
+    q->data_len = 0;
+    q->data_size = NET_SENDQ_DATA_INIT_SIZE;
+    q->data = malloc(q->data_size);
+
+    return q;
+}
+
+void net_sendq_free(struct net_sendq *q)
+{
+    free(q->nodes);
+    free(q->data);
+    free(q);
+}
+
+void net_send(struct net_sendq *q, const void *buf, size_t len,
+              const struct net_route *route)
+{
+    struct net_sendq_node *node;
+
+    if(q->count == q->nodes_size) {
+        q->nodes_size *= 2;
+        q->nodes = realloc(q->nodes,
+                           sizeof(struct net_sendq_node) * q->nodes_size);
+    }
+
+    while(q->data_len + len > q->data_size) {
+        q->data_size *= 2;
+        q->data = realloc(q->data, q->data_size);
+    }
+
+    node = &(q->nodes[q->count++]);
+    memcpy(&(node->route), route, sizeof(struct net_route));
+    node->offset = q->data_len;
+    node->len = len;
+    memcpy(q->data + q->data_len, buf, len);
+    q->data_len += len;
+}
+
+void net_flush(struct net_sendq *q)
+{
+    net->flush(q);
+
+    q->count = 0;
+    q->data_len = 0;
+}
+
+/* poll(2) backend. It is the most portable one: one recvmsg() per readable
+ * socket per wakeup and one sendmsg() per datagram.
+ */
+static enum net_enum_t net_poll_init(struct recv_shard *shard)
+{
+    shard->net_data = NULL;
+
+    return NET_OK;
+}
+
+static void net_poll_free(struct recv_shard *shard)
+{
+    (void) shard;
+}
+
+static int net_poll_recv(struct recv_shard *shard, struct net_dgram *dgrams,
+                         int max)
+{
+    int i, count = 0;
+
+    while(count == 0) {
+        if(poll(shard->fds, shard->nfds, -1) <= 0) {
+            continue;
+        }
+
+        for(i = 0; i < shard->nfds && count < max; i++) {
+            if(shard->fds[i].revents & POLLIN) {
+                struct net_dgram *d = &(dgrams[count]);
+                struct msghdr hdr;
+                struct iovec iov;
+
+                net_recv_prepare(&hdr, &iov, d);
+                d->len = recvmsg(shard->fds[i].fd, &hdr, 0);
+                if(d->len < 0) {
+                    perror("server: recvmsg");
+                    continue;
+                }
+
+                net_recv_route(&hdr, d, shard->fds[i].fd);
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+/* poll() is a cancellation point itself. */
+static void net_poll_wake(struct recv_shard *shard)
+{
+    (void) shard;
+}
+
+static void net_poll_flush(struct net_sendq *q)
+{
+    size_t i;
+
+    for(i = 0; i < q->count; i++) {
+        struct net_sendq_node *node = &(q->nodes[i]);
+        uint8_t control[NET_CONTROL_LEN];
+        struct msghdr hdr;
+        struct iovec iov;
+
+        net_send_prepare(&hdr, &iov, control, q, node);
+        if(sendmsg(node->route.fd, &hdr, 0) < 0) {
+            perror("server: sendmsg");
+        }
+    }
+}
+
+#ifdef __linux__
+/* epoll(7) backend. Readable sockets are drained with recvmmsg() up to
+ * NET_RECV_BATCH datagrams per wakeup, and the whole tick's output goes
+ * out with as few sendmmsg() calls as there are sockets in use.
+ */
+struct net_epoll {
+    int epfd;
+    struct epoll_event events[RECV_SHARDS_MAX];
+    struct mmsghdr msgs[NET_RECV_BATCH];
+    struct iovec iovs[NET_RECV_BATCH];
+};
+
+static enum net_enum_t net_epoll_init(struct recv_shard *shard)
+{
+    struct net_epoll *ep;
+    int i;
+
+    ep = malloc(sizeof(struct net_epoll));
+    if((ep->epfd = epoll_create1(0)) < 0) {
+        perror("server: epoll_create1");
+        free(ep);
+
+        return NET_ERROR;
+    }
+
+    for(i = 0; i < shard->nfds; i++) {
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if(epoll_ctl(ep->epfd, EPOLL_CTL_ADD, shard->fds[i].fd, &ev) < 0) {
+            perror("server: epoll_ctl");
+            close(ep->epfd);
+            free(ep);
+
+            return NET_ERROR;
+        }
+    }
+
+    shard->net_data = ep;
+
+    return NET_OK;
+}
+
+static void net_epoll_free(struct recv_shard *shard)
+{
+    struct net_epoll *ep = shard->net_data;
+
+    close(ep->epfd);
+    free(ep);
+}
+
+static int net_epoll_recv(struct recv_shard *shard, struct net_dgram *dgrams,
+                          int max)
+{
+    struct net_epoll *ep = shard->net_data;
+    int count = 0;
+
+    while(count == 0) {
+        int i, n;
+
+        n = epoll_wait(ep->epfd, ep->events, shard->nfds, -1);
+
+        for(i = 0; i < n && count < max; i++) {
+            int fd = shard->fds[ep->events[i].data.u32].fd;
+            int j, got, want = max - count;
+
+            for(j = 0; j < want; j++) {
+                net_recv_prepare(&(ep->msgs[j].msg_hdr), &(ep->iovs[j]),
+                                 &(dgrams[count + j]));
+            }
+
+            got = recvmmsg(fd, ep->msgs, want, MSG_DONTWAIT, NULL);
+            if(got < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("server: recvmmsg");
+                }
+                continue;
+            }
+
+            for(j = 0; j < got; j++) {
+                dgrams[count + j].len = ep->msgs[j].msg_len;
+                net_recv_route(&(ep->msgs[j].msg_hdr), &(dgrams[count + j]),
+                               fd);
+            }
+
+            count += got;
+        }
+    }
+
+    return count;
+}
+
+/* epoll_wait() is a cancellation point itself. */
+static void net_epoll_wake(struct recv_shard *shard)
+{
+    (void) shard;
+}
+
+static void net_epoll_flush(struct net_sendq *q)
+{
+    struct mmsghdr msgs[NET_SEND_BATCH];
+    struct iovec iovs[NET_SEND_BATCH];
+    uint8_t controls[NET_SEND_BATCH][NET_CONTROL_LEN];
+    size_t i = 0;
+
+    /* Consecutive datagrams for the same socket go in one sendmmsg(). */
+    while(i < q->count) {
+        int fd = q->nodes[i].route.fd;
+        int n = 0, sent = 0;
+
+        while(i + n < q->count && n < NET_SEND_BATCH &&
+              q->nodes[i + n].route.fd == fd) {
+            net_send_prepare(&(msgs[n].msg_hdr), &(iovs[n]), controls[n],
+                             q, &(q->nodes[i + n]));
+            n++;
+        }
+
+        while(sent < n) {
+            int r = sendmmsg(fd, msgs + sent, n - sent, 0);
+
+            if(r < 0) {
+                perror("server: sendmmsg");
+                break;
+            }
+
+            sent += r;
+        }
+
+        i += n;
+    }
+}
+#endif
+
+#ifdef NET_URING
+/* io_uring(7) backend, driven by raw syscalls. Every shard keeps one
+ * multishot recvmsg() request on each of its sockets, the kernel puts
+ * datagrams into buffers it takes from a ring registered by the shard,
+ * and finished ones are collected with a single io_uring_enter(). Each
+ * buffer goes back to the ring as soon as its datagram is copied out.
+ * A multishot request ends on errors or when buffers run out, it is
+ * armed again then. Output is submitted as sendmsg() requests on a ring
+ * owned by the flushing thread. If the kernel has no usable io_uring,
+ * the epoll backend is used instead. io_uring_enter() is not
+ * a cancellation point, so every shard also polls an eventfd which
+ * wake() writes to.
+ */
+#define NET_URING_WAKE NET_RECV_BATCH
+/* Provided buffers per shard, a power of two. The completion queue is as
+ * long, so it may not be shorter than NET_RECV_BATCH.
+ */
+#define NET_URING_BUFS 256
+/* recvmsg() header, source address, control messages and payload. */
+#define NET_URING_BUF_LEN (sizeof(struct io_uring_recvmsg_out) + \
+                           sizeof(struct sockaddr_storage) + \
+                           NET_CONTROL_LEN + sizeof(struct msg))
+
+struct net_uring_ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    /* Requests queued since the last io_uring_enter(). */
+    unsigned pending;
+    /* Next one in the list of send rings. */
+    struct net_uring_ring *next;
+};
+
+struct net_uring {
+    struct net_uring_ring ring;
+    int wakefd;
+    /* Only lengths of the name and control parts matter to the kernel. */
+    struct msghdr hdrs[NET_RECV_BATCH];
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint16_t br_tail;
+    uint8_t bufs[NET_URING_BUFS][NET_URING_BUF_LEN];
+};
+
+/* Ring of the thread flushing send queues, set up on its first flush.
+ * Rings of all threads are kept in a list and torn down together with
+ * the first shard, nothing is flushed after that.
+ */
+static __thread struct net_uring_ring *net_uring_send = NULL;
+static __thread bool net_uring_send_failed = false;
+static struct net_uring_ring *net_uring_sends = NULL;
+static pthread_mutex_t net_uring_sends_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sets up a ring, its completion queue is twice as long as the
+ * submission one unless `cq_entries' is given.
+ */
+static enum net_enum_t net_uring_setup(struct net_uring_ring *ring,
+                                       unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(struct net_uring_ring));
+
+    if(cq_entries > 0) {
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->fd < 0) {
+        perror("server: io_uring_setup");
+
+        return NET_ERROR;
+    }
+
+    /* Without fast poll every socket request is punted to a worker. */
+    if(!(p.features & IORING_FEAT_FAST_POLL)) {
+        fprintf(stderr, "server: io_uring has no fast poll.\n");
+        close(ring->fd);
+
+        return NET_ERROR;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) {
+        perror("server: mmap: io_uring");
+        close(ring->fd);
+
+        return NET_ERROR;
+    }
+
+    if(ring->cq_len > 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) {
+            perror("server: mmap: io_uring");
+            munmap(ring->sq_ptr, ring->sq_len);
+            close(ring->fd);
+
+            return NET_ERROR;
+        }
+    } else {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        perror("server: mmap: io_uring");
+        if(ring->cq_len > 0) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->fd);
+
+        return NET_ERROR;
+    }
+
+    sq = ring->sq_ptr;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return NET_OK;
+}
+
+static void net_uring_teardown(struct net_uring_ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_len > 0) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/* Returns a zeroed request queued at the tail of the submission ring. The
+ * kernel sees it after the next io_uring_enter().
+ */
+static struct io_uring_sqe *net_uring_sqe(struct net_uring_ring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &(ring->sqes[index]);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return sqe;
+}
+
+/* Submits pending requests and waits for at least `wait' completions. */
+static int net_uring_enter(struct net_uring_ring *ring, unsigned wait)
+{
+    int r = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if(r < 0) {
+        if(errno != EINTR) {
+            perror("server: io_uring_enter");
+        }
+
+        return -1;
+    }
+
+    ring->pending -= r;
+
+    return r;
+}
+
+/* Queues buffer `bid' at the tail of the buffer ring, the kernel sees it
+ * after net_uring_bufs_publish().
+ */
+static void net_uring_buf_put(struct net_uring *u, uint16_t bid)
+{
+    struct io_uring_buf *b = &(u->br->bufs[u->br_tail & (NET_URING_BUFS - 1)]);
+
+    b->addr = (uint64_t) (uintptr_t) u->bufs[bid];
+    b->len = NET_URING_BUF_LEN;
+    b->bid = bid;
+    u->br_tail++;
+}
+
+static void net_uring_bufs_publish(struct net_uring *u)
+{
+    __atomic_store_n(&(u->br->tail), u->br_tail, __ATOMIC_RELEASE);
+}
+
+static enum net_enum_t net_uring_bufs_setup(struct net_uring *u)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    u->br_len = NET_URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(u->br == MAP_FAILED) {
+        perror("server: mmap: io_uring buffers");
+
+        return NET_ERROR;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = NET_URING_BUFS;
+    reg.bgid = 0;
+    if(syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_PBUF_RING,
+               &reg, 1) < 0) {
+        perror("server: io_uring_register: PBUF_RING");
+        munmap(u->br, u->br_len);
+
+        return NET_ERROR;
+    }
+
+    u->br_tail = 0;
+    for(i = 0; i < NET_URING_BUFS; i++) {
+        net_uring_buf_put(u, i);
+    }
+    net_uring_bufs_publish(u);
+
+    return NET_OK;
+}
+
+static void net_uring_recv_arm(struct recv_shard *shard, struct net_uring *u,
+                               int i)
+{
+    struct io_uring_sqe *sqe = net_uring_sqe(&(u->ring));
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = shard->fds[i].fd;
+    sqe->addr = (uint64_t) (uintptr_t) &(u->hdrs[i]);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = i;
+}
+
+/* Copies the datagram out of the buffer the kernel has put it in. */
+static void net_uring_recv_copy(struct recv_shard *shard, struct net_uring *u,
+                                struct io_uring_cqe *cqe, struct net_dgram *d)
+{
+    int i = cqe->user_data;
+    uint8_t *buf = u->bufs[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+    uint8_t *name = buf + sizeof(struct io_uring_recvmsg_out);
+    uint8_t *control = name + u->hdrs[i].msg_namelen;
+    uint8_t *payload = control + u->hdrs[i].msg_controllen;
+    struct msghdr hdr;
+
+    memset(&(d->route.addr), 0, sizeof(d->route.addr));
+    memcpy(&(d->route.addr), name,
+           out->namelen < sizeof(d->route.addr) ?
+           out->namelen : sizeof(d->route.addr));
+
+    d->len = out->payloadlen < sizeof(d->buf) ?
+        out->payloadlen : sizeof(d->buf);
+    memcpy(d->buf, payload, d->len);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_control = control;
+    hdr.msg_controllen = out->controllen;
+    net_recv_route(&hdr, d, shard->fds[i].fd);
+}
+
+static void net_uring_wake_arm(struct net_uring *u)
+{
+    struct io_uring_sqe *sqe = net_uring_sqe(&(u->ring));
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = u->wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = NET_URING_WAKE;
+}
+
+/* Shards are set up one by one before any of them runs, so the first one
+ * still may switch the backend for all of them.
+ */
+static enum net_enum_t net_uring_fallback(struct recv_shard *shard)
+{
+    if(shard->id == 0) {
+        fprintf(stderr, "server: io_uring is unavailable, "
+                        "falling back to epoll.\n");
+        net = net_backend_find("epoll");
+
+        return net->init(shard);
+    }
+
+    return NET_ERROR;
+}
+
+static enum net_enum_t net_uring_init(struct recv_shard *shard)
+{
+    struct net_uring *u;
+    int i;
+
+    u = malloc(sizeof(struct net_uring));
+    if(shard->nfds >= NET_RECV_BATCH ||
+       (u->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        free(u);
+
+        return net_uring_fallback(shard);
+    }
+
+    if(net_uring_setup(&(u->ring), NET_RECV_BATCH,
+                       NET_URING_BUFS) == NET_ERROR) {
+        close(u->wakefd);
+        free(u);
+
+        return net_uring_fallback(shard);
+    }
+
+    if(net_uring_bufs_setup(u) == NET_ERROR) {
+        net_uring_teardown(&(u->ring));
+        close(u->wakefd);
+        free(u);
+
+        return net_uring_fallback(shard);
+    }
+
+    for(i = 0; i < shard->nfds; i++) {
+        memset(&(u->hdrs[i]), 0, sizeof(struct msghdr));
+        u->hdrs[i].msg_namelen = sizeof(struct sockaddr_storage);
+        u->hdrs[i].msg_controllen = NET_CONTROL_LEN;
+        net_uring_recv_arm(shard, u, i);
+    }
+    net_uring_wake_arm(u);
+
+    shard->net_data = u;
+
+    return NET_OK;
+}
+
+static void net_uring_free(struct recv_shard *shard)
+{
+    struct net_uring *u = shard->net_data;
+
+    net_uring_teardown(&(u->ring));
+    munmap(u->br, u->br_len);
+    close(u->wakefd);
+    free(u);
+
+    if(shard->id == 0) {
+        pthread_mutex_lock(&net_uring_sends_mutex);
+        while(net_uring_sends != NULL) {
+            struct net_uring_ring *ring = net_uring_sends;
+
+            net_uring_sends = ring->next;
+            net_uring_teardown(ring);
+            free(ring);
+        }
+        net_uring_send = NULL;
+        pthread_mutex_unlock(&net_uring_sends_mutex);
+    }
+}
+
+static int net_uring_recv(struct recv_shard *shard, struct net_dgram *dgrams,
+                          int max)
+{
+    struct net_uring *u = shard->net_data;
+    struct net_uring_ring *ring = &(u->ring);
+    int count = 0;
+
+    while(count == 0) {
+        unsigned head, tail;
+
+        if(net_uring_enter(ring, 1) < 0) {
+            continue;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for(; head != tail && count < max; head++) {
+            struct io_uring_cqe *cqe = &(ring->cqes[head & *ring->cq_mask]);
+            int i = cqe->user_data;
+
+            /* Nothing but wake() writes to the eventfd, the poll isn't
+             * armed again: the thread is cancelled right here.
+             */
+            if(i == NET_URING_WAKE) {
+                pthread_testcancel();
+                continue;
+            }
+
+            if(cqe->res < 0) {
+                /* Out of buffers, the rest waits in the socket until
+                 * the request is armed again.
+                 */
+                if(cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+                   cqe->res != -EINTR) {
+                    fprintf(stderr, "server: recvmsg: %s\n",
+                            strerror(-cqe->res));
+                }
+            } else if(cqe->flags & IORING_CQE_F_BUFFER) {
+                net_uring_recv_copy(shard, u, cqe, &(dgrams[count++]));
+                net_uring_buf_put(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+
+            if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                net_uring_recv_arm(shard, u, i);
+            }
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        net_uring_bufs_publish(u);
+    }
+
+    return count;
+}
+
+static void net_uring_wake(struct recv_shard *shard)
+{
+    struct net_uring *u = shard->net_data;
+    uint64_t one = 1;
+
+    if(write(u->wakefd, &one, sizeof(one)) < 0) {
+        perror("server: write: eventfd");
+    }
+}
+
+static void net_uring_flush(struct net_sendq *q)
+{
+    struct msghdr hdrs[NET_SEND_BATCH];
+    struct iovec iovs[NET_SEND_BATCH];
+    uint8_t controls[NET_SEND_BATCH][NET_CONTROL_LEN];
+    struct net_uring_ring *ring;
+    size_t i = 0;
+
+    if(net_uring_send == NULL && !net_uring_send_failed) {
+        ring = malloc(sizeof(struct net_uring_ring));
+        if(net_uring_setup(ring, NET_SEND_BATCH, 0) == NET_OK) {
+            net_uring_send = ring;
+            pthread_mutex_lock(&net_uring_sends_mutex);
+            ring->next = net_uring_sends;
+            net_uring_sends = ring;
+            pthread_mutex_unlock(&net_uring_sends_mutex);
+        } else {
+            free(ring);
+            net_uring_send_failed = true;
+        }
+    }
+
+    if((ring = net_uring_send) == NULL) {
+        net_epoll_flush(q);
+
+        return;
+    }
+
+    while(i < q->count) {
+        unsigned n = 0, done = 0;
+
+        while(i + n < q->count && n < NET_SEND_BATCH) {
+            struct io_uring_sqe *sqe = net_uring_sqe(ring);
+            struct net_sendq_node *node = &(q->nodes[i + n]);
+
+            net_send_prepare(&(hdrs[n]), &(iovs[n]), controls[n], q, node);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = node->route.fd;
+            sqe->addr = (uint64_t) (uintptr_t) &(hdrs[n]);
+            sqe->len = 1;
+            sqe->user_data = n;
+            n++;
+        }
+
+        /* Datagrams live on the stack, all of them must be sent before
+         * the next batch reuses it.
+         */
+        while(done < n) {
+            unsigned head, tail;
+
+            if(net_uring_enter(ring, 1) < 0) {
+                continue;
+            }
+
+            head = *ring->cq_head;
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+            for(; head != tail; head++, done++) {
+                struct io_uring_cqe *cqe =
+                    &(ring->cqes[head & *ring->cq_mask]);
+
+                if(cqe->res < 0) {
+                    fprintf(stderr, "server: sendmsg: %s\n",
+                            strerror(-cqe->res));
+                }
+            }
+
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        i += n;
+    }
+}
+#endif
+
+/* Backend without network, replay ticks rooms with it: output is dropped
+ * and nothing is ever received. It is not in net_backends[], a server
+ * started with it would never hear from anybody.
+ */
+static enum net_enum_t net_null_init(struct recv_shard *shard)
+{
+    shard->net_data = NULL;
+
+    return NET_OK;
+}
+
+static void net_null_free(struct recv_shard *shard)
+{
+    (void) shard;
+}
+
+static void net_null_wake(struct recv_shard *shard)
+{
+    (void) shard;
+}
+
+static int net_null_recv(struct recv_shard *shard, struct net_dgram *dgrams,
+                         int max)
+{
+    (void) shard;
+    (void) dgrams;
+    (void) max;
+
+    pause();
+
+    return 0;
+}
+
+static void net_null_flush(struct net_sendq *q)
+{
+    (void) q;
+}
+
+struct net_backend net_null = {
+    "null", net_null_init, net_null_free, net_null_recv, net_null_wake,
+    net_null_flush
+};
+
+struct net_backend net_backends[] = {
+#ifdef __linux__
+    { "epoll", net_epoll_init, net_epoll_free, net_epoll_recv,
+      net_epoll_wake, net_epoll_flush },
+#endif
+#ifdef NET_URING
+    { "io_uring", net_uring_init, net_uring_free, net_uring_recv,
+      net_uring_wake, net_uring_flush },
+#endif
+    { "poll", net_poll_init, net_poll_free, net_poll_recv, net_poll_wake,
+      net_poll_flush }
+};
+
+/* Returns backend by its name or the default one if name is NULL. */
+struct net_backend *net_backend_find(const char *name)
+{
+    size_t i;
+
+    if(name == NULL) {
+        return &(net_backends[0]);
+    }
+
+    for(i = 0; i < sizeof(net_backends) / sizeof(struct net_backend); i++) {
+        if(strcmp(net_backends[i].name, name) == 0) {
+            return &(net_backends[i]);
+        }
+    }
+
+    return NULL;
+}
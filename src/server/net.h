@@ -0,0 +1,87 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __NET_H__
+#define __NET_H__
+
+/* Maximum number of datagrams taken from the sockets by one recv() call. */
+#define NET_RECV_BATCH 32
+/* Room for a single IP_PKTINFO or IPV6_PKTINFO control message. */
+#define NET_CONTROL_LEN 64
+
+enum net_enum_t {
+    NET_ERROR = 0,
+    NET_OK
+};
+
+struct net_dgram {
+    uint8_t buf[sizeof(struct msg)];
+    ssize_t len;
+    struct net_route route;
+    uint8_t control[NET_CONTROL_LEN];
+};
+
+/* Outgoing datagrams are not sent immediately, they are collected during
+ * the tick and the backend submits all of them at once in flush().
+ * Payloads are copied to `data', because callers often pass buffers which
+ * live on the stack or are reset right after the call.
+ */
+struct net_sendq_node {
+    struct net_route route;
+    size_t offset;
+    size_t len;
+};
+
+struct net_sendq {
+    struct net_sendq_node *nodes;
+    size_t count;
+    size_t nodes_size;
+    uint8_t *data;
+    size_t data_len;
+    size_t data_size;
+};
+
+/* I/O backend's API. Each receive shard keeps backend's private state in
+ * `net_data', recv() blocks until at least one datagram is received.
+ * wake() is called from a signal handler after the shard's thread was
+ * cancelled, it makes recv() reach a cancellation point.
+ */
+struct net_backend {
+    const char *name;
+    enum net_enum_t (*init)(struct recv_shard*);
+    void (*free)(struct recv_shard*);
+    int (*recv)(struct recv_shard*, struct net_dgram*, int);
+    void (*wake)(struct recv_shard*);
+    void (*flush)(struct net_sendq*);
+};
+
+struct net_backend *net_backend_find(const char*);
+enum net_enum_t net_socket_pktinfo(int, int);
+struct net_sendq *net_sendq_init(void);
+void net_sendq_free(struct net_sendq*);
+void net_send(struct net_sendq*, const void*, size_t, const struct net_route*);
+void net_flush(struct net_sendq*);
+
+extern struct net_backend *net;
+extern struct net_backend net_null;
+
+#endif
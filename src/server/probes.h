@@ -0,0 +1,87 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* USDT (SystemTap SDT) static probes of provider `shooterd'. A probe is a
+ * single nop in the code and a note in the ELF, tools like bpftrace patch
+ * it only while they are attached, e.g.
+ *     bpftrace -e 'usdt:./shooterd:shooterd:tick_end { @ = hist(arg2); }'
+ * Without <sys/sdt.h> (systemtap-sdt-dev) probes compile to nothing.
+ * Example scripts are in tools/bpftrace.
+ *
+ * Every event_* handler fires its probe on entry and `event_return' on
+ * each way out, so a tracer can time it; see tools/bpftrace/events.bt.
+ *
+ * Probes and their arguments:
+ *     recv                    shard, player id, message type, bytes
+ *     queue_push              room, player id, message type, depth
+ *     queue_drop              room, player id, message type
+ *     queue_pop               room, player id, message type
+ *     tick_start              room, tick
+ *     tick_end                room, tick, duration in ns
+ *     event_walk              room, player id, direction
+ *     event_walk_handoff      room, player id, direction
+ *     event_shoot             room, player id, direction
+ *     event_connect_ask       room
+ *     event_disconnect_client room, player id
+ *     event_on_bonus          player id, bonus type
+ *     event_player_hit        target id, killer id, damage
+ *     event_player_killed     target id, killer id
+ *     event_map_explode       room, x, y
+ *     event_return            handler's name
+ *     batch_overflow          messages in the full batch, message type
+ *     send                    room, bytes
+ */
+#if defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define PROBES_ENABLED
+# endif
+#endif
+
+#ifdef PROBES_ENABLED
+# define PROBE1(name, a)                DTRACE_PROBE1(shooterd, name, a)
+# define PROBE2(name, a, b)             DTRACE_PROBE2(shooterd, name, a, b)
+# define PROBE3(name, a, b, c)          DTRACE_PROBE3(shooterd, name, a, b, c)
+# define PROBE4(name, a, b, c, d)       DTRACE_PROBE4(shooterd, name, a, b, c, d)
+
+static inline void probe_return(const char **name)
+{
+    DTRACE_PROBE1(shooterd, event_return, *name);
+}
+
+/* Fires `event_return' with `name' when the enclosing block is left. */
+# define PROBE_RETURN(name)                                             \
+    const char *probe_return_                                           \
+    __attribute__((cleanup(probe_return))) = (name)
+#else
+# define PROBE1(name, a)                do {} while(0)
+# define PROBE2(name, a, b)             do {} while(0)
+# define PROBE3(name, a, b, c)          do {} while(0)
+# define PROBE4(name, a, b, c, d)       do {} while(0)
+# define PROBE_RETURN(name)             do {} while(0)
+#endif
+
+#endif
@@ -0,0 +1,374 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "timers.h"
+#include "server.h"
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+#include "region.h"
+#include "record.h"
+
+static void record_put(FILE *f, uint64_t v, int bytes)
+{
+    int i;
+
+    for(i = 0; i < bytes; i++) {
+        fputc((v >> (i * 8)) & 0xff, f);
+    }
+}
+
+/* Returns false at the end of the file. */
+static bool record_get(FILE *f, uint64_t *v, int bytes)
+{
+    int i, c;
+
+    *v = 0;
+    for(i = 0; i < bytes; i++) {
+        if((c = fgetc(f)) == EOF) {
+            return false;
+        }
+        *v |= (uint64_t) c << (i * 8);
+    }
+
+    return true;
+}
+
+struct record *record_open(const char *path, struct room *r, uint64_t seed)
+{
+    struct record *rec;
+    uint8_t name[MAP_NAME_MAX_LEN];
+    FILE *f;
+
+    if((f = fopen(path, "wb")) == NULL) {
+        perror("record: fopen");
+        return NULL;
+    }
+
+    rec = malloc(sizeof(struct record));
+    rec->f = f;
+
+    memset(name, 0, sizeof(name));
+    snprintf((char *) name, sizeof(name), "%s", (char *) r->map->name);
+
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), f);
+    record_put(f, RECORD_VERSION, 1);
+    record_put(f, r->id, 1);
+    record_put(f, seed, 8);
+    fwrite(name, 1, sizeof(name), f);
+
+    return rec;
+}
+
+/* Writes messages which tick `tick' is going to handle. */
+void record_tick(struct record *rec, uint64_t tick, struct msg_queue *q)
+{
+    uint8_t buf[sizeof(struct msg)];
+    ssize_t i;
+
+    if(q->top < 0) {
+        return;
+    }
+
+    record_put(rec->f, RECORD_TICK, 1);
+    record_put(rec->f, tick, 8);
+    record_put(rec->f, q->top + 1, 2);
+    for(i = 0; i <= q->top; i++) {
+        msg_pack(q->nodes[i].data, buf);
+        fwrite(buf, 1, sizeof(buf), rec->f);
+    }
+}
+
+void record_hash(struct record *rec, uint64_t tick, uint64_t hash)
+{
+    record_put(rec->f, RECORD_HASH, 1);
+    record_put(rec->f, tick, 8);
+    record_put(rec->f, hash, 8);
+}
+
+void record_close(struct record *rec, uint64_t tick, uint64_t hash)
+{
+    record_put(rec->f, RECORD_END, 1);
+    record_put(rec->f, tick, 8);
+    record_put(rec->f, hash, 8);
+    fclose(rec->f);
+    free(rec);
+}
+
+static uint64_t hash_add(uint64_t h, uint64_t v, int bytes)
+{
+    int i;
+
+    for(i = 0; i < bytes; i++) {
+        h = (h ^ ((v >> (i * 8)) & 0xff)) * 1099511628211ULL; /* FNV-1a */
+    }
+
+    return h;
+}
+
+/* Hash of everything the simulation changes: players, bullets, bonuses,
+ * the map and the generator. Everything is walked in a fixed order.
+ */
+uint64_t world_hash(struct room *r)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i, j;
+
+    h = hash_add(h, r->nticks, 8);
+    h = hash_add(h, r->rng.state, 8);
+
+    for(i = 0; i < MAX_PLAYERS; i++) {
+        struct player *p;
+
+        if(r->players->slots[i] == NULL) {
+            continue;
+        }
+
+        p = r->players->slots[i]->p;
+        h = hash_add(h, p->id, 1);
+        h = hash_add(h, p->pos_x, 2);
+        h = hash_add(h, p->pos_y, 2);
+        h = hash_add(h, p->hp, 2);
+        h = hash_add(h, p->armor, 2);
+        h = hash_add(h, p->weapons.current, 1);
+        for(j = 0; j < WEAPON_SLOTS_MAX; j++) {
+            h = hash_add(h, p->weapons.slots[j], 1);
+            h = hash_add(h, p->weapons.bullets[j], 2);
+        }
+    }
+
+    for(i = 0; i < r->regions_count; i++) {
+        struct bullets_node *node;
+
+        for(node = r->regions[i].bullets->root; node != NULL;
+            node = node->next) {
+            struct bullet *b = node->b;
+
+            h = hash_add(h, b->type, 1);
+            h = hash_add(h, b->x, 2);
+            h = hash_add(h, b->y, 2);
+            h = hash_add(h, b->direction, 1);
+        }
+    }
+
+    for(i = 0; i < r->spawns_count; i++) {
+        struct bonus *b = &(r->spawns[i].bonus);
+
+        h = hash_add(h, bonuses_search(region_of(r, b->x, b->y)->bonuses,
+                                       b->x, b->y) != NULL, 1);
+        h = hash_add(h, r->spawns[i].timer.expires, 8);
+    }
+
+    /* Server's cells are walls or empty, so a chunk is its wall bitmap.
+     * Shared chunks are told by identity, only materialised ones are read.
+     */
+    for(i = 0; i < r->map->chunks_w * r->map->chunks_h; i++) {
+        struct map_chunk *chunk = r->map->chunks[i];
+
+        h = hash_add(h, i, 4);
+        if(chunk == &map_chunk_empty) {
+            h = hash_add(h, 0, 1);
+        } else if(chunk == &map_chunk_wall) {
+            h = hash_add(h, 1, 1);
+        } else {
+            h = hash_add(h, 2, 1);
+            for(j = 0; j < MAP_CHUNK_SIZE; j++) {
+                h = hash_add(h, r->map->walls[i]->rows[j], 8);
+            }
+        }
+    }
+
+    return h;
+}
+
+/* Runs empty ticks up to tick `tick'. */
+static void replay_until(struct room *r, uint64_t tick)
+{
+    while(r->nticks < tick) {
+        room_tick(r);
+    }
+}
+
+/* Reports only the first difference, the following ones are its echoes. */
+static bool replay_check(struct room *r, uint64_t tick, uint64_t hash,
+                         bool first)
+{
+    uint64_t h = world_hash(r);
+
+    if(h != hash) {
+        if(first) {
+            fprintf(stderr, "replay: world first differs at tick %llu: "
+                    "%016llx, recorded %016llx.\n", (unsigned long long) tick,
+                    (unsigned long long) h, (unsigned long long) hash);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/* Re-simulates a recorded room as fast as it can, without network.
+ * Returns the exit status: success if all the hashes match. The verdict is
+ * printed directly, not through the log which may drop or filter it.
+ */
+int replay_run(const char *path, int nworkers)
+{
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    uint8_t mapname[MAP_NAME_MAX_LEN + 1], buf[sizeof(struct msg)];
+    uint64_t version, id, seed, kind = 0, tick, hash, count, i;
+    uint64_t t0, ns, checks = 0, matches = 0, connects = 0;
+    struct msg_queue_node qnode;
+    struct net_route route;
+    struct msg m;
+    struct room *r;
+    bool ok = true, end = false;
+    FILE *f;
+
+    if((f = fopen(path, "rb")) == NULL) {
+        perror("replay: fopen");
+        return EXIT_FAILURE;
+    }
+
+    memset(mapname, 0, sizeof(mapname));
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+       memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0 ||
+       !record_get(f, &version, 1) || version != RECORD_VERSION ||
+       !record_get(f, &id, 1) || !record_get(f, &seed, 8) ||
+       fread(mapname, 1, MAP_NAME_MAX_LEN, f) != MAP_NAME_MAX_LEN) {
+        fprintf(stderr, "replay: %s is not a record.\n", path);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+
+    net = &net_null;
+    router = router_init();
+    stencils_init();
+    if((r = room_init(id, mapname, nworkers, seed)) == NULL) {
+        fprintf(stderr, "replay: map couldn't be loaded: %s.\n", mapname);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    rooms[0] = r;
+    nrooms = 1;
+
+    /* Nothing is sent, every player just needs an address of its own. */
+    memset(&route, 0, sizeof(route));
+    route.fd = -1;
+    route.addr.ss_family = AF_INET;
+    qnode.route = &route;
+    qnode.data = &m;
+
+    printf("replay: room %llu, map %s, seed %llu.\n", (unsigned long long) id,
+           mapname, (unsigned long long) seed);
+    fflush(stdout);
+
+    t0 = ticks_get();
+    while(!end && record_get(f, &kind, 1)) {
+        if(!record_get(f, &tick, 8)) {
+            break;
+        }
+        /* Ticks only go forward, and even an idle room records its
+         * checkpoints, so a far jump means a broken file rather than a
+         * reason to spin here for ages.
+         */
+        if(tick < r->nticks || tick - r->nticks > RECORD_CHECKPOINT_TICKS) {
+            kind = 0;
+        }
+
+        switch(kind) {
+        case RECORD_TICK:
+            if(!record_get(f, &count, 2)) {
+                end = true;
+                break;
+            }
+
+            replay_until(r, tick - 1);
+            for(i = 0; i < count; i++) {
+                if(fread(buf, 1, sizeof(buf), f) != sizeof(buf) ||
+                   !msg_unpack(buf, &m)) {
+                    end = true;
+                    break;
+                }
+                if(m.type == MSGTYPE_CONNECT_ASK) {
+                    ((struct sockaddr_in *) &route.addr)->sin_port =
+                        htons(++connects);
+                }
+                room_push(r, &qnode);
+            }
+            room_tick(r);
+            break;
+        case RECORD_HASH:
+        case RECORD_END:
+            if(!record_get(f, &hash, 8)) {
+                end = true;
+                break;
+            }
+
+            replay_until(r, tick);
+            if(replay_check(r, tick, hash, ok)) {
+                matches++;
+            } else {
+                ok = false;
+            }
+            checks++;
+            end = kind == RECORD_END;
+            break;
+        default:
+            fprintf(stderr, "replay: record is corrupted.\n");
+            end = true;
+            ok = false;
+            break;
+        }
+    }
+    ns = ticks_get() - t0;
+
+    if(ok && kind != RECORD_END) {
+        fprintf(stderr, "replay: record ends abruptly, was the server "
+                "killed?\n");
+    }
+
+    printf("replay: %llu ticks in %.3f s, %.0f ticks/s, %llu of %llu hashes "
+           "match.\n", (unsigned long long) r->nticks, ns / 1e9,
+           ns > 0 ? r->nticks * 1e9 / ns : 0, (unsigned long long) matches,
+           (unsigned long long) checks);
+
+    fclose(f);
+    room_free(r);
+    router_free(router);
+    stencils_free();
+
+    return ok && checks > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
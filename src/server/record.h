@@ -0,0 +1,60 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+/* Record of a room's input. The simulation is deterministic given the
+ * map, the seed and the messages each tick has taken from the queue, so
+ * these are all what is written, the output is not. The log is
+ * append-only, integers are little-endian:
+ *     header: "SHOOTREC", version (1), room id (1), seed (8), map (32)
+ *     tick:   RECORD_TICK (1), tick (8), count (2), packed messages
+ *     hash:   RECORD_HASH (1), tick (8), hash of the world (8)
+ *     end:    RECORD_END (1), tick (8), hash of the world (8)
+ * Messages are kept in the order of the queue, so the replay pops them in
+ * the same order. Hashes are written every RECORD_CHECKPOINT_TICKS, the
+ * replay compares them to find where it diverged.
+ */
+#define RECORD_MAGIC "SHOOTREC"
+#define RECORD_VERSION 2
+#define RECORD_CHECKPOINT_TICKS (FPS * 10)
+
+enum record_enum_t {
+    RECORD_TICK = 1,
+    RECORD_HASH,
+    RECORD_END
+};
+
+struct record {
+    FILE *f;
+};
+
+struct record *record_open(const char*, struct room*, uint64_t);
+void record_tick(struct record*, uint64_t, struct msg_queue*);
+void record_hash(struct record*, uint64_t, uint64_t);
+void record_close(struct record*, uint64_t, uint64_t);
+uint64_t world_hash(struct room*);
+int replay_run(const char*, int);
+
+#endif
@@ -0,0 +1,438 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "timers.h"
+#include "server.h"
+#include "events.h"
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+#include "region.h"
+#include "trace.h"
+#include "probes.h"
+
+/* Makes room for one more element in a region's array. */
+static void *region_reserve(void *arr, uint16_t count, uint16_t *size,
+                            size_t elem)
+{
+    if(count < *size) {
+        return arr;
+    }
+
+    *size = *size > 0 ? *size * 2 : 8;
+
+    return realloc(arr, *size * elem);
+}
+
+void regions_init(struct room *r)
+{
+    uint16_t rows, col, row;
+
+    r->regions_cols = (r->map->width + REGION_SIZE - 1) / REGION_SIZE;
+    rows = (r->map->height + REGION_SIZE - 1) / REGION_SIZE;
+    r->regions_count = r->regions_cols * rows;
+    r->regions = malloc(sizeof(struct region) * r->regions_count);
+    memset(r->regions, 0, sizeof(struct region) * r->regions_count);
+
+    for(row = 0; row < rows; row++) {
+        for(col = 0; col < r->regions_cols; col++) {
+            struct region *rg = &(r->regions[row * r->regions_cols + col]);
+
+            rg->x = col * REGION_SIZE;
+            rg->y = row * REGION_SIZE;
+            rg->width = r->map->width - rg->x < REGION_SIZE ?
+                r->map->width - rg->x : REGION_SIZE;
+            rg->height = r->map->height - rg->y < REGION_SIZE ?
+                r->map->height - rg->y : REGION_SIZE;
+            rg->bullets = bullets_init();
+            rg->bonuses = bonuses_init();
+        }
+    }
+
+    r->occupancy = calloc((size_t) r->map->chunks_w * r->map->chunks_h,
+                          sizeof(struct map_bits *));
+}
+
+void regions_free(struct room *r)
+{
+    uint16_t i;
+
+    for(i = 0; i < r->regions_count; i++) {
+        struct region *rg = &(r->regions[i]);
+
+        bullets_free(rg->bullets);
+        bonuses_free(rg->bonuses);
+        free(rg->players);
+        free(rg->inbox);
+        free(rg->deferred);
+        free(rg->bullets_handoff);
+        free(rg->impacts);
+        free(rg->bonuses_taken);
+    }
+
+    for(i = 0; i < r->map->chunks_w * r->map->chunks_h; i++) {
+        free(r->occupancy[i]);
+    }
+
+    free(r->occupancy);
+    free(r->regions);
+}
+
+/* Returns the region which contains position (x, y), positions outside of
+ * the map belong to the nearest region.
+ */
+struct region *region_of(struct room *r, uint16_t x, uint16_t y)
+{
+    uint16_t col = x > 0 ? (x - 1) / REGION_SIZE : 0;
+    uint16_t row = y > 0 ? (y - 1) / REGION_SIZE : 0;
+    uint16_t rows = r->regions_count / r->regions_cols;
+
+    if(col >= r->regions_cols) {
+        col = r->regions_cols - 1;
+    }
+
+    if(row >= rows) {
+        row = rows - 1;
+    }
+
+    return &(r->regions[row * r->regions_cols + col]);
+}
+
+void region_player_add(struct region *rg, struct player *p)
+{
+    rg->players = region_reserve(rg->players, rg->players_count,
+                                 &rg->players_size, sizeof(struct player *));
+    rg->players[rg->players_count++] = p;
+}
+
+void region_player_remove(struct region *rg, struct player *p)
+{
+    uint16_t i;
+
+    for(i = 0; i < rg->players_count; i++) {
+        if(rg->players[i] == p) {
+            /* Keep the order, the merge depends on it. */
+            memmove(&(rg->players[i]), &(rg->players[i + 1]),
+                    (rg->players_count - i - 1) * sizeof(struct player *));
+            rg->players_count--;
+
+            return;
+        }
+    }
+}
+
+/* Marks position (x, y) as occupied by a player. A chunk is owned by one
+ * region only, so regions may do it in parallel.
+ */
+void occupancy_add(struct room *r, uint16_t x, uint16_t y)
+{
+    struct map_bits **bits;
+
+    if(x == 0 || y == 0 || x > r->map->width || y > r->map->height) {
+        return;
+    }
+
+    bits = &(r->occupancy[((y - 1) >> MAP_CHUNK_BITS) * r->map->chunks_w +
+                          ((x - 1) >> MAP_CHUNK_BITS)]);
+    if(*bits == NULL) {
+        *bits = calloc(1, sizeof(struct map_bits));
+    }
+
+    map_bits_mark(*bits, (x - 1) & MAP_CHUNK_MASK, (y - 1) & MAP_CHUNK_MASK, 1);
+}
+
+/* Player of region `rg' has left position (x, y), the position is still
+ * occupied if another player of the region stands there.
+ */
+void occupancy_remove(struct room *r, struct region *rg, uint16_t x,
+                      uint16_t y)
+{
+    struct map_bits *bits;
+    uint16_t i;
+
+    if(x == 0 || y == 0 || x > r->map->width || y > r->map->height) {
+        return;
+    }
+
+    for(i = 0; i < rg->players_count; i++) {
+        if(rg->players[i]->pos_x == x && rg->players[i]->pos_y == y) {
+            return;
+        }
+    }
+
+    bits = r->occupancy[((y - 1) >> MAP_CHUNK_BITS) * r->map->chunks_w +
+                        ((x - 1) >> MAP_CHUNK_BITS)];
+    if(bits != NULL) {
+        map_bits_mark(bits, (x - 1) & MAP_CHUNK_MASK, (y - 1) & MAP_CHUNK_MASK, 0);
+    }
+}
+
+bool occupancy_has(struct room *r, uint16_t x, uint16_t y)
+{
+    struct map_bits *bits;
+
+    if(x == 0 || y == 0 || x > r->map->width || y > r->map->height) {
+        return false;
+    }
+
+    bits = r->occupancy[((y - 1) >> MAP_CHUNK_BITS) * r->map->chunks_w +
+                        ((x - 1) >> MAP_CHUNK_BITS)];
+
+    return bits != NULL &&
+        (bits->rows[(y - 1) & MAP_CHUNK_MASK] >> ((x - 1) & MAP_CHUNK_MASK)) & 1;
+}
+
+/* Same as collision_check_player(), but players of region `rg' only are
+ * taken into account.
+ */
+enum collision_enum_t region_collision_check_player(struct region *rg,
+                                                    struct player *p,
+                                                    struct map *m)
+{
+    uint16_t i;
+
+    if(p->pos_x <= 0 || p->pos_y <= 0 || p->pos_x >= m->width + 1 ||
+       p->pos_y >= m->height + 1 ||
+       MAP_OBJ(m, p->pos_x - 1, p->pos_y - 1) == MAP_WALL) {
+        return COLLISION_WALL;
+    }
+
+    for(i = 0; i < rg->players_count; i++) {
+        struct player *sp = rg->players[i];
+
+        if(sp != p && sp->pos_x == p->pos_x && sp->pos_y == p->pos_y) {
+            return COLLISION_PLAYER;
+        }
+    }
+
+    return COLLISION_NONE;
+}
+
+void region_defer(struct region *rg, struct msg_queue_node *qnode)
+{
+    rg->deferred = region_reserve(rg->deferred, rg->deferred_count,
+                                  &rg->deferred_size,
+                                  sizeof(struct msg_queue_node *));
+    rg->deferred[rg->deferred_count++] = qnode;
+}
+
+/* Whether input of player `id' is already deferred in this tick. */
+static bool region_deferred(struct region *rg, uint8_t id)
+{
+    uint16_t i;
+
+    for(i = 0; i < rg->deferred_count; i++) {
+        if(rg->deferred[i]->data->header.id == id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void region_bullet_handoff(struct region *rg, struct bullet *b)
+{
+    rg->bullets_handoff = region_reserve(rg->bullets_handoff,
+                                         rg->bullets_handoff_count,
+                                         &rg->bullets_handoff_size,
+                                         sizeof(struct bullet));
+    memcpy(&(rg->bullets_handoff[rg->bullets_handoff_count++]), b,
+           sizeof(struct bullet));
+}
+
+void region_impact(struct region *rg, struct bullet *b)
+{
+    rg->impacts = region_reserve(rg->impacts, rg->impacts_count,
+                                 &rg->impacts_size, sizeof(struct bullet));
+    memcpy(&(rg->impacts[rg->impacts_count++]), b, sizeof(struct bullet));
+}
+
+void region_bonus_taken(struct region *rg, uint8_t spawn)
+{
+    rg->bonuses_taken = region_reserve(rg->bonuses_taken,
+                                       rg->bonuses_taken_count,
+                                       &rg->bonuses_taken_size,
+                                       sizeof(uint8_t));
+    rg->bonuses_taken[rg->bonuses_taken_count++] = spawn;
+}
+
+static void region_events_func(void *arg, uint32_t i)
+{
+    struct room *r = arg;
+    struct region *rg = &(r->regions[i]);
+    uint16_t j;
+
+    for(j = 0; j < rg->inbox_count; j++) {
+        struct msg_queue_node *qnode = rg->inbox[j];
+
+        if(region_deferred(rg, qnode->data->header.id)) {
+            region_defer(rg, qnode);
+            continue;
+        }
+
+        switch(qnode->data->type) {
+        case MSGTYPE_WALK:
+            event_walk(r, rg, qnode);
+            break;
+        case MSGTYPE_SHOOT:
+            event_shoot(r, rg, qnode);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void region_bullets_func(void *arg, uint32_t i)
+{
+    struct room *r = arg;
+
+    bullets_proceed(r, &(r->regions[i]));
+}
+
+/* Simulates one tick of the room:
+ * 1. connects are handled and walks/shoots are dispatched to the regions of
+ *    the players who sent them;
+ * 2. regions handle their walks and shoots in parallel;
+ * 3. steps over the borders are applied, followed by the rest of input of
+ *    those players;
+ * 4. regions move their bullets in parallel;
+ * 5. bullets which left their regions are handed off and explosions are
+ *    applied;
+ * 6. disconnects are handled, so nobody leaves in the middle of the tick.
+ * Merges (1, 3, 5, 6) go region by region in the same order every time,
+ * thus result doesn't depend on how regions were spread between workers.
+ */
+void regions_simulate(struct room *r, struct msg_queue *q)
+{
+    struct msg_queue_node *disconnects[MSGQUEUE_INIT_SIZE];
+    struct msg_queue_node *qnode;
+    int ndisconnects = 0, i;
+    uint16_t j, k;
+    TRACE_SCOPE("regions_simulate");
+
+    for(j = 0; j < r->regions_count; j++) {
+        struct region *rg = &(r->regions[j]);
+
+        rg->inbox_count = 0;
+        rg->deferred_count = 0;
+        rg->bullets_handoff_count = 0;
+        rg->impacts_count = 0;
+        rg->bonuses_taken_count = 0;
+    }
+
+    while((qnode = msgqueue_pop(q)) != NULL) {
+        struct players_slot *slot;
+        struct region *rg;
+
+        /* TODO: check seq. */
+        PROBE3(queue_pop, r->id, qnode->data->header.id, qnode->data->type);
+
+        if(qnode->data->type == MSGTYPE_CONNECT_ASK) {
+            event_connect_ask(r, qnode);
+            continue;
+        }
+
+        if((slot = r->players->slots[qnode->data->header.id]) == NULL) {
+            WARN("Message from unknown player id: %u\n",
+                 qnode->data->header.id);
+            continue;
+        }
+
+        switch(qnode->data->type) {
+        case MSGTYPE_DISCONNECT_CLIENT:
+            disconnects[ndisconnects++] = qnode;
+            break;
+        case MSGTYPE_WALK:
+        case MSGTYPE_SHOOT:
+            rg = region_of(r, slot->p->pos_x, slot->p->pos_y);
+            rg->inbox = region_reserve(rg->inbox, rg->inbox_count,
+                                       &rg->inbox_size,
+                                       sizeof(struct msg_queue_node *));
+            rg->inbox[rg->inbox_count++] = qnode;
+            break;
+        default:
+            WARN("Unknown event\n");
+            break;
+        }
+    }
+
+    workers_run(r->workers, r->regions_count, 1, region_events_func, r);
+
+    for(j = 0; j < r->regions_count; j++) {
+        struct region *rg = &(r->regions[j]);
+
+        for(k = 0; k < rg->deferred_count; k++) {
+            struct msg_queue_node *qnode = rg->deferred[k];
+            struct player *p = r->players->slots[qnode->data->header.id]->p;
+            struct region *from = region_of(r, p->pos_x, p->pos_y);
+
+            if(qnode->data->type == MSGTYPE_WALK) {
+                event_walk_handoff(r, from, qnode);
+            } else {
+                event_shoot(r, from, qnode);
+            }
+        }
+    }
+
+    workers_run(r->workers, r->regions_count, 1, region_bullets_func, r);
+
+    for(j = 0; j < r->regions_count; j++) {
+        struct region *rg = &(r->regions[j]);
+
+        for(k = 0; k < rg->bullets_handoff_count; k++) {
+            struct bullet *b = &(rg->bullets_handoff[k]);
+
+            bullets_add(region_of(r, b->x, b->y)->bullets, b);
+        }
+
+        for(k = 0; k < rg->impacts_count; k++) {
+            bullet_explode(r, &(rg->impacts[k]));
+        }
+    }
+
+    for(i = 0; i < ndisconnects; i++) {
+        event_disconnect_client(r, disconnects[i]);
+    }
+
+    for(j = 0; j < r->regions_count; j++) {
+        struct region *rg = &(r->regions[j]);
+
+        for(k = 0; k < rg->bonuses_taken_count; k++) {
+            timers_add(&r->timers, &(r->spawns[rg->bonuses_taken[k]].timer),
+                       BONUS_RESPAWN_TICKS);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __REGION_H__
+#define __REGION_H__
+
+/* Side of a region in map cells. */
+#define REGION_SIZE 64
+
+#if REGION_SIZE % MAP_CHUNK_SIZE != 0
+#error "Map chunk must not cross regions' borders"
+#endif
+
+/* Positions of players and bullets are 1-based. */
+#define REGION_CONTAINS(rg, px, py)                         \
+    ((px) > (rg)->x && (px) <= (rg)->x + (rg)->width &&     \
+     (py) > (rg)->y && (py) <= (rg)->y + (rg)->height)
+
+/* The map of a room is partitioned into rectangular regions which are
+ * simulated in parallel. A region owns the players and bullets located in
+ * its rectangle and may change only them during the parallel phase, the
+ * map and players of other regions are read-only then.
+ * Whatever crosses the border or affects other regions (moves to a
+ * neighbour region, bullets leaving the region, explosions) is put to the
+ * region's output and applied by the merge on the room's thread, region by
+ * region, in the same order each time.
+ */
+struct region {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    struct player **players;
+    uint16_t players_count;
+    uint16_t players_size;
+    struct bullets *bullets;
+    struct bonuses *bonuses;
+    /* Input of the tick: walk and shoot messages of region's players. */
+    struct msg_queue_node **inbox;
+    uint16_t inbox_count;
+    uint16_t inbox_size;
+    /* Output of the tick. Once a walk of a player crosses the border, it
+     * and all the player's later input of the tick are deferred to the
+     * merge, so they are still applied in order.
+     */
+    struct msg_queue_node **deferred;
+    uint16_t deferred_count;
+    uint16_t deferred_size;
+    struct bullet *bullets_handoff;
+    uint16_t bullets_handoff_count;
+    uint16_t bullets_handoff_size;
+    struct bullet *impacts;
+    uint16_t impacts_count;
+    uint16_t impacts_size;
+    /* Spawn points whose bonuses have been picked up. */
+    uint8_t *bonuses_taken;
+    uint16_t bonuses_taken_count;
+    uint16_t bonuses_taken_size;
+};
+
+void regions_init(struct room*);
+void regions_free(struct room*);
+struct region *region_of(struct room*, uint16_t, uint16_t);
+void region_player_add(struct region*, struct player*);
+void region_player_remove(struct region*, struct player*);
+void occupancy_add(struct room*, uint16_t, uint16_t);
+void occupancy_remove(struct room*, struct region*, uint16_t, uint16_t);
+bool occupancy_has(struct room*, uint16_t, uint16_t);
+enum collision_enum_t region_collision_check_player(struct region*,
+                                                    struct player*,
+                                                    struct map*);
+void region_defer(struct region*, struct msg_queue_node*);
+void region_bullet_handoff(struct region*, struct bullet*);
+void region_impact(struct region*, struct bullet*);
+void region_bonus_taken(struct region*, uint8_t);
+void regions_simulate(struct room*, struct msg_queue*);
+
+#endif
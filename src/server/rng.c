@@ -0,0 +1,75 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#include "rng.h"
+
+/* Different streams give independent sequences for the same seed. */
+void rng_seed(struct rng *rng, uint64_t seed, uint64_t stream)
+{
+    rng->state = 0;
+    rng->inc = (stream << 1) | 1;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+uint32_t rng_next(struct rng *rng)
+{
+    uint64_t old = rng->state;
+    uint32_t xorshifted, rot;
+
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    xorshifted = ((old >> 18) ^ old) >> 27;
+    rot = old >> 59;
+
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/* Uniform number in [0, n), 0 if `n' is 0. Lemire's multiply-and-reject
+ * avoids both the division and the modulo bias of `rand() % n'.
+ */
+uint32_t rng_range(struct rng *rng, uint32_t n)
+{
+    uint64_t m;
+    uint32_t l, t;
+
+    if(n == 0) {
+        return 0;
+    }
+
+    m = (uint64_t) rng_next(rng) * n;
+    l = (uint32_t) m;
+
+    if(l < n) {
+        t = -n % n;
+
+        while(l < t) {
+            m = (uint64_t) rng_next(rng) * n;
+            l = (uint32_t) m;
+        }
+    }
+
+    return m >> 32;
+}
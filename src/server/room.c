@@ -0,0 +1,388 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "timers.h"
+#include "server.h"
+#include "events.h"
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+#include "region.h"
+#include "record.h"
+#include "trace.h"
+#include "probes.h"
+
+struct room *rooms[ROOMS_MAX];
+int nrooms = 0;
+struct router *router = NULL;
+
+/* Rooms are seeded with the same `seed', the room's id selects its own
+ * stream, so a match is reproduced with the same seed and maps.
+ */
+struct room *room_init(uint8_t id, uint8_t *mapname, int nworkers,
+                       uint64_t seed)
+{
+    struct room *r;
+    uint8_t i;
+
+    r = malloc(sizeof(struct room));
+    memset(r, 0, sizeof(struct room));
+
+    if((r->map = map_load(mapname)) == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    if(r->map->respawns_count == 0) {
+        WARN("Map has no respawn points: %s.\n", mapname);
+        map_unload(r->map);
+        free(r);
+        return NULL;
+    }
+
+    r->id = id;
+    timers_init(&r->timers, 0);
+    r->players = players_init();
+    regions_init(r);
+    r->spawns_count = r->map->bonuses_count;
+    r->spawns = calloc(r->spawns_count + 1, sizeof(struct bonus_spawn));
+    for(i = 0; i < r->spawns_count; i++) {
+        struct bonus *b = &(r->spawns[i].bonus);
+
+        b->type = r->map->bonuses[i].type;
+        b->index = r->map->bonuses[i].index;
+        b->x = r->map->bonuses[i].w + 1;
+        b->y = r->map->bonuses[i].h + 1;
+        b->spawn = i;
+        r->spawns[i].room = r;
+        timer_init(&(r->spawns[i].timer), bonus_spawn_func, &(r->spawns[i]));
+    }
+    r->msgqueue = msgqueue_init();
+    r->msgqueue_back = msgqueue_init();
+    pthread_mutex_init(&r->msgqueue_mutex, NULL);
+    r->sendq = net_sendq_init();
+    r->workers = workers_init(nworkers);
+    rng_seed(&r->rng, seed, id);
+
+    /* Bonuses appear on the first tick. */
+    for(i = 0; i < r->spawns_count; i++) {
+        timers_add(&r->timers, &(r->spawns[i].timer), 0);
+    }
+
+    return r;
+}
+
+void room_free(struct room *r)
+{
+    if(r->record != NULL) {
+        record_close(r->record, r->nticks, world_hash(r));
+    }
+    workers_free(r->workers);
+    net_sendq_free(r->sendq);
+    pthread_mutex_destroy(&r->msgqueue_mutex);
+    msgqueue_free(r->msgqueue);
+    msgqueue_free(r->msgqueue_back);
+    free(r->spawns);
+    regions_free(r);
+    players_free(r->players);
+    map_unload(r->map);
+    free(r);
+}
+
+void room_push(struct room *r, struct msg_queue_node *qnode)
+{
+    pthread_mutex_lock(&r->msgqueue_mutex);
+    if(msgqueue_push(r->msgqueue, qnode) == MSGQUEUE_ERROR) {
+        PROBE3(queue_drop, r->id, qnode->data->header.id, qnode->data->type);
+        __atomic_add_fetch(&r->metrics.queue_drops, 1, __ATOMIC_RELAXED);
+        WARN("server: msgqueue_push: couldn't push data into queue "
+             "of room %u.\n", r->id);
+    } else {
+        PROBE4(queue_push, r->id, qnode->data->header.id, qnode->data->type,
+               r->msgqueue->top + 1);
+    }
+    pthread_mutex_unlock(&r->msgqueue_mutex);
+}
+
+/* One tick of the room: handles messages pushed by receive shards since
+ * the previous tick, updates the world and sends the difference to the
+ * players.
+ */
+void room_tick(struct room *r)
+{
+    uint64_t t, t0, t1, t2, t3, bullets = 0;
+    struct msg_queue *q;
+    uint16_t i;
+
+    t0 = ticks_cycles();
+    PROBE2(tick_start, r->id, r->nticks + 1);
+
+    pthread_mutex_lock(&r->msgqueue_mutex);
+    q = r->msgqueue;
+    r->msgqueue = r->msgqueue_back;
+    r->msgqueue_back = q;
+    pthread_mutex_unlock(&r->msgqueue_mutex);
+    METRICS_SET(r->metrics.queue_depth, q->top + 1);
+
+    if(r->record != NULL) {
+        record_tick(r->record, r->nticks + 1, q);
+    }
+
+    /* Timers of the tick go first, then messages(events). */
+    t = TRACE_NOW();
+    timers_advance(&r->timers, r->nticks + 1);
+    trace_span("timers_advance", t, TRACE_NOW());
+    regions_simulate(r, q);
+
+    t1 = ticks_cycles();
+    encode_events(r);
+    t2 = ticks_cycles();
+    send_events(r);
+    t = TRACE_NOW();
+    net_flush(r->sendq);
+    t3 = ticks_cycles();
+    trace_span("net_flush", t, t3);
+    trace_span("tick", t0, t3);
+
+    for(i = 0; i < r->regions_count; i++) {
+        bullets += r->regions[i].bullets->count;
+    }
+    METRICS_SET(r->metrics.bullets, bullets);
+    METRICS_SET(r->metrics.players, r->players->count);
+    metrics_tick(&r->metrics, ticks_cycles_to_ns(t3 - t0));
+    PROBE3(tick_end, r->id, r->nticks + 1, ticks_cycles_to_ns(t3 - t0));
+
+    __atomic_add_fetch(&r->phases[TICK_PHASE_SIMULATE], t1 - t0,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->phases[TICK_PHASE_ENCODE], t2 - t1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->phases[TICK_PHASE_SEND], t3 - t2,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->nticks, 1, __ATOMIC_RELAXED);
+
+    if(r->record != NULL && r->nticks % RECORD_CHECKPOINT_TICKS == 0) {
+        record_hash(r->record, r->nticks, world_hash(r));
+    }
+}
+
+/* The room's thread: ticks the room every 1000 / FPS ms. */
+void *room_mngr_func(void *arg)
+{
+    struct room *r = arg;
+    struct ticks ticks;
+
+    ticks_start(&ticks);
+
+    while("teh internetz exists") {
+        ticks_wait(&ticks, TICK_NS);
+
+        /* The tick must not be interrupted in the middle, quit() cancels
+         * the thread while it sleeps only.
+         */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        room_tick(r);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return arg;
+}
+
+static uint32_t router_hash(struct sockaddr_storage *addr)
+{
+    uint8_t *key;
+    size_t i, len;
+    uint32_t h = 2166136261u; /* FNV-1a */
+
+    if(addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+
+        h = (h ^ (sin6->sin6_port & 0xff)) * 16777619u;
+        h = (h ^ (sin6->sin6_port >> 8)) * 16777619u;
+        key = sin6->sin6_addr.s6_addr;
+        len = sizeof(sin6->sin6_addr);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+
+        h = (h ^ (sin->sin_port & 0xff)) * 16777619u;
+        h = (h ^ (sin->sin_port >> 8)) * 16777619u;
+        key = (uint8_t *) &(sin->sin_addr);
+        len = sizeof(sin->sin_addr);
+    }
+
+    for(i = 0; i < len; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+
+    return h % ROUTER_BUCKETS;
+}
+
+static bool router_addr_equal(struct sockaddr_storage *a,
+                              struct sockaddr_storage *b)
+{
+    if(a->ss_family != b->ss_family) {
+        return false;
+    }
+
+    if(a->ss_family == AF_INET6) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+        struct sockaddr_in6 *b6 = (struct sockaddr_in6 *) b;
+
+        return a6->sin6_port == b6->sin6_port &&
+            memcmp(&(a6->sin6_addr), &(b6->sin6_addr),
+                   sizeof(a6->sin6_addr)) == 0;
+    } else {
+        struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+        struct sockaddr_in *b4 = (struct sockaddr_in *) b;
+
+        return a4->sin_port == b4->sin_port &&
+            a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+}
+
+static struct room *router_search(struct router *rt,
+                                  struct sockaddr_storage *addr)
+{
+    struct router_node *node = rt->buckets[router_hash(addr)];
+
+    while(node != NULL) {
+        if(router_addr_equal(&(node->addr), addr)) {
+            return node->room;
+        }
+
+        node = node->next;
+    }
+
+    return NULL;
+}
+
+struct router *router_init(void)
+{
+    struct router *rt;
+
+    rt = malloc(sizeof(struct router));
+    memset(rt->buckets, 0, sizeof(rt->buckets));
+    pthread_rwlock_init(&rt->lock, NULL);
+
+    return rt;
+}
+
+void router_free(struct router *rt)
+{
+    int i;
+
+    for(i = 0; i < ROUTER_BUCKETS; i++) {
+        struct router_node *node = rt->buckets[i], *next;
+
+        while(node != NULL) {
+            next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+
+    pthread_rwlock_destroy(&rt->lock);
+    free(rt);
+}
+
+/* Returns the room where the sender of the message plays. The sender of
+ * CONNECT_ASK which is not routed yet is sent to the least loaded room.
+ * Returns NULL for unknown senders and when all rooms are full.
+ */
+struct room *router_route(struct router *rt, struct msg_queue_node *qnode)
+{
+    struct sockaddr_storage *addr = &(qnode->route->addr);
+    struct router_node *node;
+    struct room *room;
+    int i;
+
+    pthread_rwlock_rdlock(&rt->lock);
+    room = router_search(rt, addr);
+    pthread_rwlock_unlock(&rt->lock);
+
+    if(room != NULL || qnode->data->type != MSGTYPE_CONNECT_ASK) {
+        return room;
+    }
+
+    pthread_rwlock_wrlock(&rt->lock);
+
+    /* Could be routed by another shard meanwhile. */
+    if((room = router_search(rt, addr)) == NULL) {
+        for(i = 0; i < nrooms; i++) {
+            if(rooms[i]->assigned < MAX_PLAYERS - 1 &&
+               (room == NULL || rooms[i]->assigned < room->assigned)) {
+                room = rooms[i];
+            }
+        }
+
+        if(room != NULL) {
+            uint32_t h = router_hash(addr);
+
+            node = malloc(sizeof(struct router_node));
+            memcpy(&(node->addr), addr, sizeof(struct sockaddr_storage));
+            node->room = room;
+            node->next = rt->buckets[h];
+            rt->buckets[h] = node;
+            room->assigned++;
+        }
+    }
+
+    pthread_rwlock_unlock(&rt->lock);
+
+    return room;
+}
+
+void router_unroute(struct router *rt, struct sockaddr_storage *addr)
+{
+    struct router_node **pnode, *node;
+
+    pthread_rwlock_wrlock(&rt->lock);
+
+    for(pnode = &(rt->buckets[router_hash(addr)]); *pnode != NULL;
+        pnode = &((*pnode)->next)) {
+        node = *pnode;
+
+        if(router_addr_equal(&(node->addr), addr)) {
+            *pnode = node->next;
+            node->room->assigned--;
+            free(node);
+
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&rt->lock);
+}
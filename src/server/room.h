@@ -0,0 +1,103 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __ROOM_H__
+#define __ROOM_H__
+
+#define ROOMS_MAX 64
+#define ROUTER_BUCKETS 1024
+
+/* Room is an independent match: its own map, players, bullets and bonuses,
+ * ticked by its own thread. Receive shards push messages to the room's
+ * queue, the room's thread swaps it with `msgqueue_back' once per tick.
+ */
+struct room {
+    uint8_t id;
+    pthread_t thread;
+    struct map *map;
+    struct players_slots *players;
+    /* Bonus spawn points of the map, lying bonuses are owned by regions. */
+    struct bonus_spawn *spawns;
+    uint8_t spawns_count;
+    /* Map is partitioned to regions, they own players, bullets and
+     * bonuses.
+     */
+    struct region *regions;
+    uint16_t regions_count;
+    uint16_t regions_cols;
+    /* Cells occupied by players, per map chunk. NULL chunk is vacant. */
+    struct map_bits **occupancy;
+    pthread_mutex_t msgqueue_mutex;
+    struct msg_queue *msgqueue;
+    struct msg_queue *msgqueue_back;
+    /* Datagrams sent during the tick, flushed at the end of it. */
+    struct net_sendq *sendq;
+    /* Pool which encodes output for the players. */
+    struct workers *workers;
+    struct world_view view;
+    /* Deferred work, keyed on the number of the tick. */
+    struct timers timers;
+    /* Damage rolls and respawns, used by the room's thread only. */
+    struct rng rng;
+    /* Number of addresses routed to the room, guarded by router's lock. */
+    uint16_t assigned;
+    /* Cumulative, updated by the room's thread with relaxed atomics.
+     * Phases are in ticks_cycles() units.
+     */
+    uint64_t phases[TICK_PHASES];
+    uint64_t nticks;
+    struct room_metrics metrics;
+    /* Log of the room's input, NULL unless the match is recorded. */
+    struct record *record;
+};
+
+/* Router maps player's address to the room it plays in. Receive shards
+ * look it up for each datagram, the lock is taken for writing only when
+ * a player connects or leaves.
+ */
+struct router_node {
+    struct router_node *next;
+    struct sockaddr_storage addr;
+    struct room *room;
+};
+
+struct router {
+    pthread_rwlock_t lock;
+    struct router_node *buckets[ROUTER_BUCKETS];
+};
+
+struct room *room_init(uint8_t, uint8_t*, int, uint64_t);
+void room_free(struct room*);
+void room_push(struct room*, struct msg_queue_node*);
+void room_tick(struct room*);
+void *room_mngr_func(void*);
+struct router *router_init(void);
+void router_free(struct router*);
+struct room *router_route(struct router*, struct msg_queue_node*);
+void router_unroute(struct router*, struct sockaddr_storage*);
+
+extern struct room *rooms[];
+extern int nrooms;
+extern struct router *router;
+
+#endif
@@ -20,11 +20,14 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h> /* time() */
 #include <string.h>
+#include <limits.h>
 #include <error.h>
 #include <unistd.h>
 #include <signal.h>
@@ -38,24 +41,28 @@
 #endif
 
 #include "../cdata.h"
+#include "timers.h"
 #include "server.h"
 #include "events.h"
-
-struct msg_queue *msgqueue = NULL;
-struct players_slots *players = NULL;
-struct bonuses *bonuses = NULL;
-struct bullets *bullets = NULL;
-pthread_mutex_t msgqueue_mutex;
-pthread_cond_t queue_mngr_cond;
-pthread_t recv_mngr_thread, queue_mngr_thread;
+#include "net.h"
+#include "workers.h"
+#include "rng.h"
+#include "metrics.h"
+#include "room.h"
+#include "region.h"
+#include "record.h"
+#include "log.h"
+#include "trace.h"
+#include "probes.h"
+
+pthread_t stats_mngr_thread;
 pthread_attr_t common_attr;
-struct ticks *queue_mngr_ticks;
-struct map *map;
-struct pollfd *fds = NULL;
-int nfds; /* number of file descriptors (sockets, really) in fds array */
-/* This array contains copies of ai_family of each fd
- * We need it to figure out which socket to use to send data to client */
-int *fd_families = NULL;
+struct recv_shard *shards = NULL;
+int nshards = 1;
+/* Threads encoding output for the players of each room. */
+int nworkers = 1;
+/* Interval in seconds between ingest reports, 0 disables them. */
+int stats_interval = 0;
 
 struct players_slots *players_init(void)
 {
@@ -106,7 +113,7 @@ struct player *players_occupy(struct players_slots *slots, struct player *p)
         oslot->prev = pslot;
         oslot->next = NULL;
         oslot->p = player_init();
-        memcpy(oslot->p->addr, p->addr, sizeof(struct sockaddr_storage));
+        memcpy(oslot->p->route, p->route, sizeof(struct net_route));
         strncpy((char *) oslot->p->nick, (char *) p->nick, NICK_MAX_LEN);
 
         if(slots->root == NULL) {
@@ -169,10 +176,11 @@ struct msg_queue *msgqueue_init(void)
 
     for(i = 0; i < MSGQUEUE_INIT_SIZE; i++) {
         q->nodes[i].data = malloc(sizeof(struct msg));
-        q->nodes[i].addr = malloc(sizeof(struct sockaddr_storage));
+        q->nodes[i].route = malloc(sizeof(struct net_route));
     }
 
     q->top = -1;
+    q->head = 0;
 
     return q;
 }
@@ -183,7 +191,7 @@ void msgqueue_free(struct msg_queue *q)
 
     for(i = 0; i < MSGQUEUE_INIT_SIZE; i++) {
         free(q->nodes[i].data);
-        free(q->nodes[i].addr);
+        free(q->nodes[i].route);
     }
 
     free(q);
@@ -195,8 +203,8 @@ enum msg_queue_enum_t msgqueue_push(struct msg_queue *q,
     if(q->top < MSGQUEUE_INIT_SIZE - 1) {
         q->top++;
 
-        memcpy(q->nodes[q->top].addr, qnode->addr,
-                sizeof(struct sockaddr_storage));
+        memcpy(q->nodes[q->top].route, qnode->route,
+                sizeof(struct net_route));
         memcpy(q->nodes[q->top].data, qnode->data, sizeof(struct msg));
 
         return MSGQUEUE_OK;
@@ -207,55 +215,128 @@ enum msg_queue_enum_t msgqueue_push(struct msg_queue *q,
 
 struct msg_queue_node *msgqueue_pop(struct msg_queue *q)
 {
-    if(q->top >= 0) {
-        return &(q->nodes[q->top--]);
+    if(q->head <= q->top) {
+        return &(q->nodes[q->head++]);
     }
 
+    /* Drained, the queue is filled from the start again. */
+    q->top = -1;
+    q->head = 0;
+
     return NULL;
 }
 
-void bullet_explode(struct bullet *b)
+/* Cells covered by explosions, one circular stencil per weapon. Radius is
+ * the weapon's one cut to what a map_explode message can carry.
+ */
+static struct stencil {
+    int8_t dx;
+    int8_t dy;
+} *stencils[WEAPON_SLOTS_MAX];
+static uint16_t stencils_count[WEAPON_SLOTS_MAX];
+static uint8_t stencils_radius[WEAPON_SLOTS_MAX];
+
+void stencils_init(void)
 {
-    int w, h;
+    int i, dx, dy;
+
+    for(i = 0; i < WEAPON_SLOTS_MAX; i++) {
+        int radius = weapons[i].explode_radius;
+
+        if(radius > MAP_EXPLODE_RADIUS_MAX) {
+            WARN("Explosion radius of %s is cut to %d.\n",
+                 weapons[i].name, MAP_EXPLODE_RADIUS_MAX);
+            radius = MAP_EXPLODE_RADIUS_MAX;
+        }
+
+        stencils_radius[i] = radius;
 
-    for(w = b->x - weapons[b->type].explode_radius,
-        h = b->y - weapons[b->type].explode_radius;
-        w <= b->x + weapons[b->type].explode_radius;
-        w++, h++) {
-        struct players_slot *slot = players->root;
+        stencils[i] = malloc(sizeof(struct stencil) *
+                             (radius * 2 + 1) * (radius * 2 + 1));
+        stencils_count[i] = 0;
 
-        if(w <= 0 || h <= 0 || w > map->width + 1 || h > map->height + 1) {
+        for(dy = -radius; dy <= radius; dy++) {
+            for(dx = -radius; dx <= radius; dx++) {
+                if(dx * dx + dy * dy <= radius * radius + radius) {
+                    struct stencil *s = &(stencils[i][stencils_count[i]++]);
+
+                    s->dx = dx;
+                    s->dy = dy;
+                }
+            }
+        }
+    }
+}
+
+void stencils_free(void)
+{
+    int i;
+
+    for(i = 0; i < WEAPON_SLOTS_MAX; i++) {
+        free(stencils[i]);
+    }
+}
+
+/* Damages every player within the weapon's stencil around the bullet and
+ * destroys walls there, all destroyed walls are reported by one message.
+ */
+void bullet_explode(struct room *r, struct bullet *b)
+{
+    struct map *map = r->map;
+    const struct weapon *weapon = &(weapons[b->type]);
+    struct msgtype_map_explode explode;
+    int radius = stencils_radius[b->type], side = radius * 2 + 1;
+    bool destroyed = false;
+    uint16_t i, j;
+    TRACE_SCOPE("bullet_explode");
+
+    memset(&explode, 0, sizeof(explode));
+    explode.w = b->x - 1;
+    explode.h = b->y - 1;
+    explode.radius = radius;
+
+    for(i = 0; i < stencils_count[b->type]; i++) {
+        struct stencil *s = &(stencils[b->type][i]);
+        int w = b->x + s->dx, h = b->y + s->dy;
+        struct region *rg;
+
+        if(w <= 0 || h <= 0 || w > map->width || h > map->height) {
             continue;
         }
 
-        if(map->objs[h - 1][w - 1] == MAP_WALL) {
-            if(weapons[b->type].explode_map) {
-                map->objs[h - 1][w - 1] = MAP_EMPTY;
+        if(MAP_OBJ(map, w - 1, h - 1) == MAP_WALL) {
+            if(weapon->explode_map) {
+                int bit = (s->dy + radius) * side + s->dx + radius;
 
-                event_map_explode(w - 1, h - 1);
+                map_set(map, w - 1, h - 1, MAP_EMPTY);
+                explode.mask[bit / 8] |= 1 << (bit % 8);
+                destroyed = true;
             }
 
             continue;
         }
 
-        while(slot != NULL) {
-            struct player *p = slot->p;
+        if(!occupancy_has(r, w, h)) {
+            continue;
+        }
+
+        rg = region_of(r, w, h);
+        for(j = 0; j < rg->players_count; j++) {
+            struct player *p = rg->players[j];
 
             if(p->pos_x == w && p->pos_y == h) {
                 uint16_t damage;
 
-                srand((unsigned int) time(NULL));
-
-                damage = rand() % (weapons[b->type].damage_max -
-                    weapons[b->type].damage_min) + weapons[b->type].damage_min;
+                damage = rng_range(&r->rng, weapon->damage_max -
+                                   weapon->damage_min) + weapon->damage_min;
                 event_player_hit(p, b->player, damage);
-
-                break;
             }
-
-            slot = slot->next;
         }
     }
+
+    if(destroyed) {
+        event_map_explode(r, &explode);
+    }
 }
 
 struct bullets *bullets_init(void)
@@ -265,6 +346,7 @@ struct bullets *bullets_init(void)
     bullets = malloc(sizeof(struct bullets));
     bullets->root = NULL;
     bullets->last = NULL;
+    bullets->count = 0;
 
     return bullets;
 }
@@ -297,6 +379,10 @@ struct bullet *bullets_add(struct bullets *bullets, struct bullet *b)
     new->prev = last;
     new->next = NULL;
 
+    if(last != NULL) {
+        last->next = new;
+    }
+
     new->b->player = b->player;
     new->b->type = b->type;
     new->b->x = b->x;
@@ -310,6 +396,7 @@ struct bullet *bullets_add(struct bullets *bullets, struct bullet *b)
     if(bullets->root == NULL) {
         bullets->root = new;
     }
+    bullets->count++;
 
     return new->b;
 }
@@ -338,11 +425,12 @@ enum bullets_enum_t bullets_remove(struct bullets *bullets, struct bullet *b)
             if(pbullet != NULL) {
                 pbullet->next = nbullet;
             } else {
-                bullets->root = NULL;
+                bullets->root = nbullet;
             }
 
             free(bullet->b);
             free(bullet);
+            bullets->count--;
 
             return BULLETS_OK;
         }
@@ -353,110 +441,101 @@ enum bullets_enum_t bullets_remove(struct bullets *bullets, struct bullet *b)
     return BULLETS_ERROR;
 }
 
-void bullets_proceed(struct bullets *bullets)
+/* Moves bullets of region `rg'. Map and players are read-only here,
+ * because regions are proceeded in parallel: explosions and bullets which
+ * stop outside of the region are left to the merge.
+ * A bullet's path for the tick is a segment along its row or column, the
+ * first wall and the first player on it are looked up in the bitmaps of
+ * the map and of the occupancy, so the cost doesn't depend on the speed.
+ */
+void bullets_proceed(struct room *r, struct region *rg)
 {
+    struct bullets *bullets = rg->bullets;
+    struct map *map = r->map;
     struct bullets_node *bullet = bullets->root;
+    TRACE_SCOPE("bullets_proceed");
 
     while(bullet != NULL) {
         struct bullet *b = bullet->b;
-        struct weapon *w = &(weapons[b->type]);
-        int bx = b->x;
-        int by = b->y;
-
-        for(;;) {
-            struct players_slot *slot = players->root;
-
-            switch(b->direction) {
-            case DIRECTION_LEFT:
-                if(w->bullets_distance > 0 && b->x < bx - w->bullets_speed) {
-                    goto outer;
-                }
-
-                if(w->bullets_distance > 0 && b->x < b->sx
-                        - w->bullets_distance) {
-                    bullet = bullet->next;
-                    bullets_remove(bullets, b);
-                    goto outer;
-                }
-
-                b->x--;
-
-                break;
-            case DIRECTION_RIGHT:
-                if(w->bullets_distance > 0 && b->x > bx + w->bullets_speed) {
-                    goto outer;
-                }
-
-                if(w->bullets_distance > 0 && b->x > b->sx
-                            + w->bullets_distance) {
-                    bullet = bullet->next;
-                    bullets_remove(bullets, b);
-                    goto outer;
-                }
-
-                b->x++;
-
-                break;
-            case DIRECTION_UP:
-                if(w->bullets_distance > 0 && b->y < by - w->bullets_speed) {
-                    goto outer;
-                }
+        const struct weapon *w = &(weapons[b->type]);
+        int dx = 0, dy = 0, n, border, hit, wall, player, flown, left;
+
+        switch(b->direction) {
+        case DIRECTION_LEFT:
+            dx = -1;
+            border = b->x;
+            flown = b->sx - b->x;
+            break;
+        case DIRECTION_RIGHT:
+            dx = 1;
+            border = map->width - 1 - b->x;
+            flown = b->x - b->sx;
+            break;
+        case DIRECTION_UP:
+            dy = -1;
+            border = b->y;
+            flown = b->sy - b->y;
+            break;
+        case DIRECTION_DOWN:
+            dy = 1;
+            border = map->height - 1 - b->y;
+            flown = b->y - b->sy;
+            break;
+        default:
+            bullet = bullet->next;
+            continue;
+        }
 
-                if(w->bullets_distance > 0 && b->y < b->sy
-                            - w->bullets_distance) {
-                    bullet = bullet->next;
-                    bullets_remove(bullets, b);
-                    goto outer;
-                }
+        /* Bullets with no distance limit reach their target at once,
+         * the others fly `bullets_speed' + 1 cells per tick and vanish
+         * one cell after the limit.
+         */
+        if(w->bullets_distance > 0) {
+            left = w->bullets_distance + 1 - flown;
+            n = left < w->bullets_speed + 1 ? left : w->bullets_speed + 1;
+        } else {
+            left = INT_MAX;
+            n = INT_MAX;
+        }
 
-                b->y--;
+        if(border < 1) {
+            border = 1;
+        }
 
-                break;
-            case DIRECTION_DOWN:
-                if(w->bullets_distance > 0 && b->y > by + w->bullets_speed) {
-                    goto outer;
-                }
+        /* The map's border stops a bullet like a wall does. */
+        hit = border <= n ? border : 0;
 
-                if(w->bullets_distance > 0 && b->y > b->sy
-                            + w->bullets_distance) {
-                    bullet = bullet->next;
-                    bullets_remove(bullets, b);
-                    goto outer;
-                }
+        wall = map_bits_scan(map->walls, map, b->x - 1, b->y - 1,
+                             b->direction, hit > 0 ? hit : n);
+        if(wall > 0) {
+            hit = wall;
+        }
 
-                b->y++;
+        player = map_bits_scan(r->occupancy, map, b->x - 1, b->y - 1,
+                               b->direction, hit > 0 ? hit : n);
+        if(player > 0) {
+            hit = player;
+        }
 
-                break;
-            default:
-                break;
-            }
+        bullet = bullet->next;
 
-            if(b->y <= 0 || b->x <= 0 ||
-               b->y >= map->height - 1 || b->x >= map->width - 1 ||
-               map->objs[b->y - 1][b->x - 1] == MAP_WALL) {
-                bullet = bullet->next;
-                bullet_explode(b);
+        if(hit > 0) {
+            b->x += dx * hit;
+            b->y += dy * hit;
+            region_impact(rg, b);
+            bullets_remove(bullets, b);
+        } else if(n == left || n <= 0) {
+            /* The bullet has flown its distance. */
+            bullets_remove(bullets, b);
+        } else {
+            /* The bullet has flown its distance for this tick. */
+            b->x += dx * n;
+            b->y += dy * n;
+            if(!REGION_CONTAINS(rg, b->x, b->y)) {
+                region_bullet_handoff(rg, b);
                 bullets_remove(bullets, b);
-                goto outer;
-            }
-
-            while(slot != NULL) {
-                struct player *p = slot->p;
-
-                if(p->pos_x == b->x && p->pos_y == b->y) {
-                    bullet = bullet->next;
-                    bullet_explode(b);
-                    bullets_remove(bullets, b);
-                    goto outer;
-                }
-
-                slot = slot->next;
             }
         }
-        // TODO: remove this hack
-        bullet = bullet->next;
-    outer:
-        continue;
     }
 }
 
@@ -465,8 +544,7 @@ struct bonuses *bonuses_init(void)
     struct bonuses *bonuses;
 
     bonuses = malloc(sizeof(struct bonuses));
-    bonuses->root = NULL;
-    bonuses->count = 0;
+    memset(bonuses, 0, sizeof(struct bonuses));
 
     return bonuses;
 }
@@ -474,15 +552,17 @@ struct bonuses *bonuses_init(void)
 void bonuses_free(struct bonuses *bonuses)
 {
     struct bonuses_node *cbonus, *nbonus;
+    int i;
 
-    nbonus = bonuses->root;
+    for(i = 0; i < BONUSES_BUCKETS; i++) {
+        nbonus = bonuses->buckets[i];
 
-    while(nbonus != NULL) {
-        cbonus = nbonus;
-        nbonus = nbonus->next;
+        while(nbonus != NULL) {
+            cbonus = nbonus;
+            nbonus = nbonus->next;
 
-        free(cbonus->b);
-        free(cbonus);
+            free(cbonus);
+        }
     }
 
     free(bonuses);
@@ -490,13 +570,11 @@ void bonuses_free(struct bonuses *bonuses)
 
 struct bonus *bonuses_search(struct bonuses *bonuses, uint16_t x, uint16_t y)
 {
-    struct bonuses_node *bonus = bonuses->root;
+    struct bonuses_node *bonus = bonuses->buckets[BONUSES_HASH(x, y)];
 
     while(bonus != NULL) {
-        struct bonus *b = bonus->b;
-
-        if(b->x == x && b->y == y) {
-            return b;
+        if(bonus->b.x == x && bonus->b.y == y) {
+            return &(bonus->b);
         }
 
         bonus = bonus->next;
@@ -507,188 +585,287 @@ struct bonus *bonuses_search(struct bonuses *bonuses, uint16_t x, uint16_t y)
 
 struct bonus *bonuses_add(struct bonuses *bonuses, struct bonus *b)
 {
-    struct bonuses_node *bonus = bonuses->root;
-    struct bonuses_node *pbonus = NULL;
-
-    for(;;) {
-        if(bonus == NULL) {
-            bonus = malloc(sizeof(struct bonuses_node));
-            bonus->prev = pbonus;
-            bonus->next = NULL;
-            bonus->b = malloc(sizeof(struct bonus));
-            memcpy(bonus->b, b, sizeof(struct bonus));
-
-            break;
-        }
+    struct bonuses_node **bucket = &(bonuses->buckets[BONUSES_HASH(b->x, b->y)]);
+    struct bonuses_node *bonus;
 
-        pbonus = bonus;
-        bonus = bonus->next;
-    }
+    bonus = malloc(sizeof(struct bonuses_node));
+    memcpy(&(bonus->b), b, sizeof(struct bonus));
+    bonus->next = *bucket;
+    *bucket = bonus;
+    bonuses->count++;
 
-    return bonus->b;
+    return &(bonus->b);
 }
 
 enum bonuses_enum_t bonuses_remove(struct bonuses *bonuses, struct bonus *b)
 {
-    struct bonuses_node *bonus = bonuses->root;
-
-    while(bonus != NULL) {
-        if(bonus->b == b) {
-            struct bonuses_node *prev, *next;
-
-            prev = bonus->prev;
-            next = bonus->next;
+    struct bonuses_node **bonus = &(bonuses->buckets[BONUSES_HASH(b->x, b->y)]);
 
-            prev->next = next;
-            next->prev = prev;
+    while(*bonus != NULL) {
+        if(&((*bonus)->b) == b) {
+            struct bonuses_node *next = (*bonus)->next;
 
-            free(bonus->b);
-            free(bonus);
+            free(*bonus);
+            *bonus = next;
+            bonuses->count--;
 
             return BONUSES_OK;
         }
 
-        bonus = bonus->next;
+        bonus = &((*bonus)->next);
     }
 
     return BONUSES_ERROR;
 }
 
-/* This thread recieves messages from clients and pushes them to msgqueue. */
-void *recv_mngr_func(void *arg)
+/* Gives player `p' of region `rg' the bonus it stands on. Spawn points
+ * belong to the region of their cell, so regions may call it in parallel,
+ * the respawn is scheduled by the merge.
+ */
+void bonuses_pickup(struct region *rg, struct player *p)
+{
+    struct bonus *bonus = bonuses_search(rg->bonuses, p->pos_x, p->pos_y);
+
+    if(bonus == NULL) {
+        return;
+    }
+
+    event_on_bonus(p, bonus);
+    region_bonus_taken(rg, bonus->spawn);
+    bonuses_remove(rg->bonuses, bonus);
+}
+
+/* Timer of a spawn point: puts its bonus back on the map. */
+void bonus_spawn_func(void *arg)
 {
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    struct msg_queue_node *qnode;
+    struct bonus_spawn *spawn = arg;
+    struct bonus *b = &(spawn->bonus);
 
-    qnode = malloc(sizeof(struct msg_queue_node));
-    qnode->data = malloc(sizeof(struct msg));
-    qnode->addr = malloc(sizeof(struct sockaddr_storage));
+    bonuses_add(region_of(spawn->room, b->x, b->y)->bonuses, b);
+}
 
-    queue_mngr_ticks = ticks_start();
+/* This thread recieves messages from clients and pushes them to
+ * the msgqueue of the room they play in.
+ */
+void *recv_mngr_func(void *arg)
+{
+    struct recv_shard *shard = arg;
+    struct net_dgram dgrams[NET_RECV_BATCH];
+    struct msg_queue_node qnode;
+    struct msg m;
+
+    qnode.data = &m;
 
     while("hope is not dead") {
-        int n = poll(fds, nfds, -1);
-        if(n > 0)
-            for(n = 0; n < nfds; n++)
-                if(fds[n].revents & POLLIN) {
-                    uint8_t buf[sizeof(struct msg)];
-
-                    if(ticks_get_diff(queue_mngr_ticks) > 1000 / FPS) {
-                        ticks_update(queue_mngr_ticks);
-                        pthread_cond_signal(&queue_mngr_cond);
-                    }
-
-                    if(recvfrom(fds[n].fd, buf, sizeof(struct msg), 0,
-                                (struct sockaddr *) &client_addr,
-                                &client_addr_len) != sizeof (struct msg)) {
-                        perror("server: recvfrom");
-                        continue;
-                    }
-
-                    if (msg_unpack(buf, qnode->data))
-                    {
-                        qnode->addr = &client_addr;
-                        pthread_mutex_lock(&msgqueue_mutex);
-                        if(msgqueue_push(msgqueue, qnode) == MSGQUEUE_ERROR) {
-                            WARN("server: msgqueue_push: couldn't push data"\
-                                    "into queue.\n");
-                        }
-                        pthread_mutex_unlock(&msgqueue_mutex);
-                    }
-                    else
-                    {
-                        WARN("server: packet malformed.\n");
-                        continue;
-                    }
-                }
+        int i, n = net->recv(shard, dgrams, NET_RECV_BATCH);
+
+        __atomic_add_fetch(&shard->packets, n, __ATOMIC_RELAXED);
+
+        for(i = 0; i < n; i++) {
+            struct room *room;
+
+            if(dgrams[i].len > 0) {
+                __atomic_add_fetch(&shard->bytes, dgrams[i].len,
+                                   __ATOMIC_RELAXED);
+            }
+
+            if(dgrams[i].len != sizeof(struct msg) ||
+               !msg_unpack(dgrams[i].buf, &m)) {
+                WARN("server: packet malformed.\n");
+                continue;
+            }
+            PROBE4(recv, shard->id, m.header.id, m.type, dgrams[i].len);
+
+            qnode.route = &(dgrams[i].route);
+            if((room = router_route(router, &qnode)) == NULL) {
+                DEBUG("server: message from unknown player, dropped.\n");
+                continue;
+            }
+
+            room_push(room, &qnode);
+        }
     }
 
     return arg;
 }
 
-void *queue_mngr_func(void *arg)
+/* Prints how many packets per second each shard has received since
+ * the previous report and how long tick phases of each room took on
+ * average.
+ */
+void *stats_mngr_func(void *arg)
 {
-    struct msg_queue_node *qnode;
-
-    sleep(1);
-
-    while("teh internetz exists") {
-        pthread_cond_wait(&queue_mngr_cond, &msgqueue_mutex);
-
-        /* Handle messages(events). */
-        while((qnode = msgqueue_pop(msgqueue)) != NULL) {
-            /* TODO: check seq. */
-
-            switch(qnode->data->type) {
-            case MSGTYPE_CONNECT_ASK:
-                event_connect_ask(qnode);
-                break;
-            case MSGTYPE_DISCONNECT_CLIENT:
-                event_disconnect_client(qnode);
-                break;
-            case MSGTYPE_WALK:
-                event_walk(qnode);
-                break;
-            case MSGTYPE_SHOOT:
-                event_shoot(qnode);
-                break;
-            default:
-                WARN("Unknown event\n");
-                break;
-            }
+    static uint64_t packets[RECV_SHARDS_MAX];
+    static uint64_t phases[ROOMS_MAX][TICK_PHASES], nticks[ROOMS_MAX];
+
+    while("somebody watches") {
+        uint64_t total = 0;
+        int i, j;
+
+        sleep(stats_interval);
+
+        for(i = 0; i < nshards; i++) {
+            uint64_t n = __atomic_load_n(&shards[i].packets, __ATOMIC_RELAXED);
+
+            INFO("recv: shard %d: %llu pkt/s\n", i,
+                 (unsigned long long) ((n - packets[i]) / stats_interval));
+            total += n - packets[i];
+            packets[i] = n;
         }
 
-        send_events();
+        INFO("recv: %d shard(s): %llu pkt/s\n", nshards,
+             (unsigned long long) (total / stats_interval));
 
-        pthread_mutex_unlock(&msgqueue_mutex);
+        for(i = 0; i < nrooms; i++) {
+            uint64_t cur[TICK_PHASES], d[TICK_PHASES], n;
+
+            n = __atomic_load_n(&rooms[i]->nticks, __ATOMIC_RELAXED);
+            for(j = 0; j < TICK_PHASES; j++) {
+                cur[j] = __atomic_load_n(&rooms[i]->phases[j],
+                                         __ATOMIC_RELAXED);
+                d[j] = cur[j] - phases[i][j];
+                phases[i][j] = cur[j];
+            }
+
+            if(n > nticks[i]) {
+                uint64_t t = n - nticks[i];
+
+                INFO("room %d: tick: simulate %llu us, encode %llu us, "
+                     "send %llu us\n", i,
+                     (unsigned long long) (ticks_cycles_to_ns(d[TICK_PHASE_SIMULATE]) / t / 1000),
+                     (unsigned long long) (ticks_cycles_to_ns(d[TICK_PHASE_ENCODE]) / t / 1000),
+                     (unsigned long long) (ticks_cycles_to_ns(d[TICK_PHASE_SEND]) / t / 1000));
+            }
+            nticks[i] = n;
+        }
     }
+
+    return arg;
 }
 
 void quit(int signum)
 {
-    int i;
+    int i, j;
 
     if(signum > 0) {
-        pthread_cancel(recv_mngr_thread);
-        pthread_cancel(queue_mngr_thread);
+        for(i = 0; i < nshards; i++) {
+            pthread_cancel(shards[i].thread);
+            net->wake(&shards[i]);
+        }
+        for(i = 0; i < nrooms; i++) {
+            pthread_cancel(rooms[i]->thread);
+        }
+        if(stats_interval > 0) {
+            pthread_cancel(stats_mngr_thread);
+        }
     }
 
-    pthread_join(recv_mngr_thread, NULL);
-    pthread_join(queue_mngr_thread, NULL);
+    for(i = 0; i < nshards; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    for(i = 0; i < nrooms; i++) {
+        pthread_join(rooms[i]->thread, NULL);
+    }
+    if(stats_interval > 0) {
+        pthread_join(stats_mngr_thread, NULL);
+    }
 
-    event_disconnect_server();
-    send_events();
+    for(i = 0; i < nrooms; i++) {
+        event_disconnect_server(rooms[i]);
+        send_events(rooms[i]);
+        net_flush(rooms[i]->sendq);
+        room_free(rooms[i]);
+    }
 
-    for(i = 0; i < nfds; i++)
-        close(fds[i].fd);
-    free(fds);
-    free(fd_families);
-    map_unload(map);
-    msgqueue_free(msgqueue);
-    players_free(players);
-    bonuses_free(bonuses);
+    for(i = 0; i < nshards; i++) {
+        net->free(&shards[i]);
+        for(j = 0; j < shards[i].nfds; j++) {
+            close(shards[i].fds[j].fd);
+        }
+        free(shards[i].fds);
+    }
+    free(shards);
+    router_free(router);
+    stencils_free();
+    metrics_free();
+    trace_free();
+    log_free();
     pthread_attr_destroy(&common_attr);
-    pthread_mutex_destroy(&msgqueue_mutex);
-    pthread_cond_destroy(&queue_mngr_cond);
     pthread_exit(NULL);
 }
 
 /* sendto() substitute
- * Figures out which socket to use to send data to specified player
- * Arguments list is shorter because we don't use flags argument */
-void send_to(const void *buf, size_t len, const struct sockaddr *dest,
-        socklen_t addrlen) {
-    int i;
-    sa_family_t dest_sock_family = dest->sa_family;
-    for(i = 0; i < nfds; i++) {
-        if(fd_families[i] == dest_sock_family) {
-            /* No flags, thus 0 */
-            sendto(fds[i].fd, buf, len, 0, dest, addrlen);
-        }
+ * Queues exactly one datagram on the socket the player is bound to. */
+void send_to(struct room *r, const void *buf, size_t len,
+             const struct net_route *route)
+{
+    PROBE2(send, r->id, len);
+    METRICS_ADD(r->metrics.packets_out, 1);
+    METRICS_ADD(r->metrics.bytes_out, len);
+    net_send(r->sendq, buf, len, route);
+}
+
+#ifndef _BENCH_
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-b backend] [-l level] [-m maps] [-M socket]\n"
+            "          [-p port] [-P file] [-r threads] [-R file]\n"
+            "          [-s seconds] [-S seed] [-T file] [-w threads]\n"
+            "  -b backend  I/O backend: epoll (default on Linux), io_uring\n"
+            "              (falls back to epoll) or poll\n"
+            "  -l level    lowest level of logged messages: debug, info\n"
+            "              or warn\n"
+            "  -m maps     comma separated maps from data/maps, one room\n"
+            "              is hosted per map (up to %d)\n"
+            "  -M socket   serve metrics in Prometheus text format on this\n"
+            "              Unix socket\n"
+            "  -p port     UDP port to listen on (6006)\n"
+            "  -P file     replay a recorded room without network as fast\n"
+            "              as possible and check hashes of its world\n"
+            "  -r threads  number of receive threads, each one owns a\n"
+            "              SO_REUSEPORT socket per address (1..%d)\n"
+            "  -R file     record input of rooms to this file, with\n"
+            "              several maps to file.<room>\n"
+            "  -s seconds  report ingest packets/second and tick phase\n"
+            "              timings at this interval\n"
+            "  -S seed     seed of rooms' random generators, a match\n"
+            "              replays with the same seed\n"
+            "  -T file     record timings of tick phases and event\n"
+            "              handlers, dump the last ones to this file in\n"
+            "              Chrome trace format on SIGUSR1\n"
+            "  -w threads  number of threads encoding output for players\n"
+            "              of each room (1..%d)\n",
+            name, ROOMS_MAX, RECV_SHARDS_MAX, WORKERS_MAX);
+    exit(EXIT_FAILURE);
+}
+#endif
+
+/* Pins thread to its own CPU, so receive shards and rooms don't migrate
+ * and fight for the same core.
+ */
+void thread_pin(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(ncpus <= 1) {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu % ncpus, &cpus);
+    if(pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+        WARN("Couldn't set affinity of the thread to CPU %d.\n", cpu);
     }
+#else
+    (void) thread;
+    (void) cpu;
+#endif
 }
 
+#ifndef _BENCH_
 /* TODO: write function sync_mngr_func()
  * which will be check seq number of
  * each client and if necessary send
@@ -699,72 +876,215 @@ int main(int argc, char **argv)
     struct addrinfo *addr_res = NULL;
     struct addrinfo hints;
     struct addrinfo *addr;
-    int err, sockopt = 1;
+    char *maps = "default.map", *mapname, *metrics = NULL, *trace = NULL;
+    char *record = NULL, *replay = NULL, *port = "6006";
+    int err, i, opt, sockopt = 1;
+    int nfds = 0; /* number of bound addresses, a shard has a socket per one */
+    uint64_t seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+
+    net = net_backend_find(NULL);
+
+    while((opt = getopt(argc, argv, "b:l:m:M:p:P:r:R:s:S:T:w:")) != -1) {
+        switch(opt) {
+        case 'b':
+            if((net = net_backend_find(optarg)) == NULL) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            if((log_level = log_level_find(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            maps = optarg;
+            break;
+        case 'M':
+            metrics = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'P':
+            replay = optarg;
+            break;
+        case 'r':
+            nshards = atoi(optarg);
+            if(nshards < 1 || nshards > RECV_SHARDS_MAX) {
+                usage(argv[0]);
+            }
+            break;
+        case 'R':
+            record = optarg;
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'T':
+            trace = optarg;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if(nworkers < 1 || nworkers > WORKERS_MAX) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     signal(SIGINT, quit);
     signal(SIGHUP, quit);
     signal(SIGQUIT, quit);
 
-    /* TODO: from config or args. */
-    map = map_load((uint8_t *) "default.map");
-    if(map == NULL) {
-        WARN("Map couldn't be loaded: %s.\n", "default.map");
-        exit(EXIT_FAILURE);
+    /* Before any thread is started, they must not take SIGUSR1. */
+    if(trace != NULL) {
+        trace_init(trace);
+    }
+
+    log_init();
+    ticks_calibrate();
+
+    if(replay != NULL) {
+        err = replay_run(replay, nworkers);
+        trace_free();
+        log_free();
+
+        return err;
+    }
+
+    INFO("Random seed: %llu.\n", (unsigned long long) seed);
+
+    router = router_init();
+    stencils_init();
+
+    for(mapname = strtok(maps, ","); mapname != NULL;
+        mapname = strtok(NULL, ",")) {
+        if(nrooms == ROOMS_MAX) {
+            usage(argv[0]);
+        }
+
+        rooms[nrooms] = room_init(nrooms, (uint8_t *) mapname, nworkers,
+                                  seed);
+        if(rooms[nrooms] == NULL) {
+            WARN("Map couldn't be loaded: %s.\n", mapname);
+            exit(EXIT_FAILURE);
+        }
+
+        nrooms++;
     }
 
-    msgqueue = msgqueue_init();
-    players = players_init();
-    bonuses = bonuses_init();
-    bullets = bullets_init();
+    for(i = 0; record != NULL && i < nrooms; i++) {
+        char path[4096];
+
+        if(nrooms > 1) {
+            snprintf(path, sizeof(path), "%s.%d", record, i);
+        } else {
+            snprintf(path, sizeof(path), "%s", record);
+        }
+
+        if((rooms[i]->record = record_open(path, rooms[i], seed)) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
     memset(&hints, 0, sizeof(hints));
     //hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
     hints.ai_flags = AI_ADDRCONFIG;
     hints.ai_socktype = SOCK_DGRAM;
-    err = getaddrinfo(NULL, "6006", &hints, &addr_res);
+    err = getaddrinfo(NULL, port, &hints, &addr_res);
     if(err != 0)
         error(EXIT_FAILURE, 0, "getaddrinfo: %s", gai_strerror(err));
 
     for(addr = addr_res; addr != NULL; addr = addr->ai_next) {
         nfds++;
     }
-    fds = (struct pollfd *)malloc(sizeof(struct pollfd) * nfds);
-    fd_families = (int*)malloc(sizeof(int) * nfds);
+    shards = malloc(sizeof(struct recv_shard) * nshards);
 
-    for(nfds = 0, addr = addr_res; addr != NULL; addr = addr->ai_next) {
-        fds[nfds].fd = socket(addr->ai_family, addr->ai_socktype,
-                addr->ai_protocol);
-        if(fds[nfds].fd == -1) {
-            perror("socket");
-            exit(EXIT_FAILURE);
-        }
+    for(i = 0; i < nshards; i++) {
+        struct recv_shard *shard = &shards[i];
+
+        memset(shard, 0, sizeof(struct recv_shard));
+        shard->id = i;
+        shard->fds = malloc(sizeof(struct pollfd) * nfds);
+
+        for(addr = addr_res; addr != NULL; addr = addr->ai_next) {
+            struct pollfd *pfd = &(shard->fds[shard->nfds]);
+
+            pfd->fd = socket(addr->ai_family, addr->ai_socktype,
+                    addr->ai_protocol);
+            if(pfd->fd == -1) {
+                perror("socket");
+                exit(EXIT_FAILURE);
+            }
 
-        fds[nfds].events = POLLIN;
-        setsockopt(fds[nfds].fd, SOL_SOCKET, SO_REUSEADDR, &sockopt,
-                sizeof(sockopt));
+            pfd->events = POLLIN;
+            setsockopt(pfd->fd, SOL_SOCKET, SO_REUSEADDR, &sockopt,
+                    sizeof(sockopt));
+            if(net_socket_pktinfo(pfd->fd, addr->ai_family) == NET_ERROR) {
+                exit(EXIT_FAILURE);
+            }
+            if(nshards > 1 && setsockopt(pfd->fd, SOL_SOCKET, SO_REUSEPORT,
+                        &sockopt, sizeof(sockopt)) != 0) {
+                perror("setsockopt: SO_REUSEPORT");
+                exit(EXIT_FAILURE);
+            }
+
+            if(bind(pfd->fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+                perror("bind");
+                close(pfd->fd);
+                exit(EXIT_FAILURE);
+            } else {
+                shard->nfds++;
+            }
+        }
 
-        if(bind(fds[nfds].fd, addr->ai_addr, addr->ai_addrlen) != 0) {
-            perror("bind");
-            close(fds[nfds].fd);
+        if(net->init(shard) == NET_ERROR) {
+            WARN("I/O backend couldn't init: %s.\n", net->name);
             exit(EXIT_FAILURE);
-        } else {
-            fd_families[nfds] = addr->ai_family;
-            nfds++;
         }
     }
-    freeaddrinfo(addr);
-
-    pthread_mutex_init(&msgqueue_mutex, NULL);
-    pthread_cond_init(&queue_mngr_cond, NULL);
+    freeaddrinfo(addr_res);
 
     pthread_attr_init(&common_attr);
     pthread_attr_setdetachstate(&common_attr, PTHREAD_CREATE_JOINABLE);
 
-    pthread_create(&recv_mngr_thread, &common_attr, recv_mngr_func, NULL);
-    pthread_create(&queue_mngr_thread, &common_attr, queue_mngr_func, NULL);
+    for(i = 0; i < nshards; i++) {
+        pthread_create(&shards[i].thread, &common_attr, recv_mngr_func,
+                       &shards[i]);
+        if(nshards > 1) {
+            thread_pin(shards[i].thread, i);
+        }
+    }
+
+    /* Rooms take CPUs after the receive shards. */
+    for(i = 0; i < nrooms; i++) {
+        pthread_create(&rooms[i]->thread, &common_attr, room_mngr_func,
+                       rooms[i]);
+        if(nshards > 1 || nrooms > 1) {
+            thread_pin(rooms[i]->thread, nshards + i);
+        }
+    }
+
+    if(stats_interval > 0) {
+        pthread_create(&stats_mngr_thread, &common_attr, stats_mngr_func,
+                       NULL);
+    }
+
+    if(metrics != NULL && metrics_init(metrics) == METRICS_ERROR) {
+        WARN("Metrics couldn't be served on %s.\n", metrics);
+    }
+
+    INFO("Started %d receive thread(s) with %s backend and %d room(s).\n",
+         nshards, net->name, nrooms);
 
     quit(0);
 
     return 0;
 }
+#endif
 /* vim:set expandtab: */
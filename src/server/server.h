@@ -23,16 +23,39 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
-#define MSGQUEUE_INIT_SIZE 64
+#define MSGQUEUE_INIT_SIZE (MAX_PLAYERS * 4)
 
 struct msg_queue_node {
     struct msg *data;
-    struct sockaddr_storage *addr;
+    struct net_route *route;
 };
 
+/* Messages are popped in the order they were pushed: inputs of a player
+ * must be applied in the order of their seqs, as the client predicted
+ * them. `top' is the last pushed one, `head' the next one to pop.
+ */
 struct msg_queue {
     struct msg_queue_node nodes[MSGQUEUE_INIT_SIZE];
     ssize_t top;
+    ssize_t head;
+};
+
+#define RECV_SHARDS_MAX 64
+
+/* Each receive shard owns one SO_REUSEPORT socket per bound address and
+ * a thread servicing them. The kernel spreads datagrams between shards,
+ * shard pushes decoded messages to the queue of the player's room.
+ */
+struct recv_shard {
+    uint8_t id;
+    pthread_t thread;
+    struct pollfd *fds;
+    int nfds;
+    /* Private state of the I/O backend. */
+    void *net_data;
+    /* Updated by the shard's thread only, read with relaxed atomics. */
+    uint64_t packets;
+    uint64_t bytes;
 };
 
 enum bullets_enum_t {
@@ -59,6 +82,7 @@ struct bullets_node {
 struct bullets {
     struct bullets_node *root;
     struct bullets_node *last;
+    uint32_t count;
 };
 
 enum bonuses_enum_t {
@@ -70,18 +94,60 @@ struct bonus {
     uint8_t type;
     uint8_t index;
     uint16_t x;
-    uint16_t y;    
+    uint16_t y;
+    /* Index of the spawn point in the room, it respawns the bonus. */
+    uint8_t spawn;
 };
 
+/* Bonuses lying on the map, hashed by their cell, so a player's step
+ * checks a single bucket whatever number of bonuses is on the map.
+ */
+#define BONUSES_BUCKETS 64
+#define BONUSES_HASH(x, y) ((((x) * 31u) ^ (y)) & (BONUSES_BUCKETS - 1))
+
 struct bonuses_node {
     struct bonuses_node *next;
-    struct bonuses_node *prev;
-    struct bonus *b;
+    struct bonus b;
 };
 
 struct bonuses {
-    struct bonuses_node *root;
-    uint8_t count;
+    struct bonuses_node *buckets[BONUSES_BUCKETS];
+    uint16_t count;
+};
+
+/* Bonus spawn point of a room, taken bonus appears again after
+ * BONUS_RESPAWN_TICKS by the spawn's timer.
+ */
+#define BONUS_RESPAWN_TICKS (FPS * 20)
+
+struct bonus_spawn {
+    struct bonus bonus;
+    struct room *room;
+    struct timer timer;
+};
+
+/* Read-only copy of the world taken after the simulation of a tick.
+ * Encoders of different players read it concurrently, each of them writes
+ * only to its own player's msgbatch.
+ */
+struct world_view_player {
+    struct player *p;
+    uint16_t pos_x;
+    uint16_t pos_y;
+};
+
+struct world_view {
+    /* Number of the tick, clients order snapshots by it. */
+    uint32_t tick;
+    uint16_t count;
+    struct world_view_player players[MAX_PLAYERS];
+};
+
+enum {
+    TICK_PHASE_SIMULATE = 0,
+    TICK_PHASE_ENCODE,
+    TICK_PHASE_SEND,
+    TICK_PHASES
 };
 
 struct players_slots *players_init(void);
@@ -92,27 +158,28 @@ struct msg_queue *msgqueue_init(void);
 void msgqueue_free(struct msg_queue*);
 enum msg_queue_enum_t msgqueue_push(struct msg_queue*, struct msg_queue_node*);
 struct msg_queue_node *msgqueue_pop(struct msg_queue*);
-void bullet_explode(struct bullet*);
+struct room;
+struct region;
+
+void stencils_init(void);
+void stencils_free(void);
+void bullet_explode(struct room*, struct bullet*);
 struct bullets *bullets_init(void);
 void bullets_free(struct bullets*);
 struct bullet *bullets_add(struct bullets*, struct bullet*);
 enum bullets_enum_t bullets_remove(struct bullets*, struct bullet*);
-void bullets_proceed(struct bullets*);
+void bullets_proceed(struct room*, struct region*);
 struct bonuses *bonuses_init(void);
 void bonuses_free(struct bonuses*);
 struct bonus *bonuses_search(struct bonuses*, uint16_t, uint16_t);
 struct bonus *bonuses_add(struct bonuses*, struct bonus*);
 enum bonuses_enum_t bonuses_remove(struct bonuses*, struct bonus*);
-void send_to(const void *buf, size_t len, const struct sockaddr *dest,
-        socklen_t addrlen);
-    
-extern struct msg_queue *msgqueue;
-extern struct players_slots *players;
-extern struct bonuses *bonuses;
-extern struct bullets *bullets;
-extern struct map *map;
-extern struct pollfd *fds;
-extern int nfds;
-extern int *fd_families;
+void bonuses_pickup(struct region*, struct player*);
+void bonus_spawn_func(void*);
+void send_to(struct room*, const void*, size_t, const struct net_route*);
+void thread_pin(pthread_t, int);
+
+extern struct recv_shard *shards;
+extern int nshards;
 
 #endif
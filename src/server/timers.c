@@ -0,0 +1,152 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "timers.h"
+
+void timers_init(struct timers *ts, uint64_t now)
+{
+    int l, s;
+
+    ts->now = now;
+    ts->count = 0;
+
+    for(l = 0; l < TIMERS_LEVELS; l++) {
+        for(s = 0; s < TIMERS_SLOTS; s++) {
+            ts->slots[l][s].next = &(ts->slots[l][s]);
+            ts->slots[l][s].prev = &(ts->slots[l][s]);
+        }
+    }
+}
+
+void timer_init(struct timer *t, void (*func)(void*), void *arg)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+    t->func = func;
+    t->arg = arg;
+}
+
+bool timer_pending(struct timer *t)
+{
+    return t->next != NULL;
+}
+
+static void timers_link(struct timers *ts, struct timer *t)
+{
+    uint64_t diff = t->expires ^ ts->now;
+    struct timer *head;
+    int l = 0;
+
+    while(l < TIMERS_LEVELS - 1 && (diff >> (TIMERS_BITS * (l + 1))) != 0) {
+        l++;
+    }
+
+    if((diff >> (TIMERS_BITS * (l + 1))) != 0) {
+        /* Expires after the top level wraps: park it in the first slot of
+         * the top level, it is linked again on the wrap.
+         */
+        head = &(ts->slots[l][0]);
+    } else {
+        head = &(ts->slots[l][(t->expires >> (TIMERS_BITS * l)) & TIMERS_MASK]);
+    }
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void timers_unlink(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* Runs `t->func' `delay' ticks later, delay 0 means the next tick. */
+void timers_add(struct timers *ts, struct timer *t, uint64_t delay)
+{
+    if(timer_pending(t)) {
+        timers_cancel(ts, t);
+    }
+
+    t->expires = ts->now + (delay > 0 ? delay : 1);
+    timers_link(ts, t);
+    ts->count++;
+}
+
+void timers_cancel(struct timers *ts, struct timer *t)
+{
+    if(timer_pending(t)) {
+        timers_unlink(t);
+        ts->count--;
+    }
+}
+
+/* Moves timers of the current slot of level `l' to the lower levels. */
+static void timers_cascade(struct timers *ts, int l)
+{
+    struct timer *head = &(ts->slots[l][(ts->now >> (TIMERS_BITS * l)) & TIMERS_MASK]);
+    struct timer *t, *next;
+
+    t = head->next;
+    head->next = head;
+    head->prev = head;
+
+    for(; t != head; t = next) {
+        next = t->next;
+        timers_link(ts, t);
+    }
+}
+
+/* Runs timers which expire up to tick `now' inclusive. Callbacks may add
+ * and cancel timers.
+ */
+void timers_advance(struct timers *ts, uint64_t now)
+{
+    while(ts->now < now) {
+        struct timer *head, *t;
+        int l;
+
+        ts->now++;
+
+        for(l = TIMERS_LEVELS - 1; l > 0; l--) {
+            if((ts->now & ((1ULL << (TIMERS_BITS * l)) - 1)) == 0) {
+                timers_cascade(ts, l);
+            }
+        }
+
+        head = &(ts->slots[0][ts->now & TIMERS_MASK]);
+        while((t = head->next) != head) {
+            timers_unlink(t);
+            ts->count--;
+            t->func(t->arg);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __TIMERS_H__
+#define __TIMERS_H__
+
+/* Hierarchical timing wheel keyed on tick number. Level `l' has
+ * TIMERS_SLOTS slots of TIMERS_SLOTS^l ticks each; a timer is put to the
+ * level of the highest group of bits where its expiry differs from the
+ * current tick and is moved one level down when that slot comes up.
+ * Adding and cancelling a timer is O(1), a tick costs the number of timers
+ * expiring or cascading in it.
+ */
+#define TIMERS_BITS 6
+#define TIMERS_SLOTS (1 << TIMERS_BITS)
+#define TIMERS_MASK (TIMERS_SLOTS - 1)
+#define TIMERS_LEVELS 4
+
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires;
+    void (*func)(void*);
+    void *arg;
+};
+
+struct timers {
+    uint64_t now;
+    uint32_t count;
+    /* Heads of circular lists of slots. */
+    struct timer slots[TIMERS_LEVELS][TIMERS_SLOTS];
+};
+
+void timers_init(struct timers*, uint64_t);
+void timer_init(struct timer*, void (*)(void*), void*);
+bool timer_pending(struct timer*);
+void timers_add(struct timers*, struct timer*, uint64_t);
+void timers_cancel(struct timers*, struct timer*);
+void timers_advance(struct timers*, uint64_t);
+
+#endif
@@ -0,0 +1,222 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "../cdata.h"
+#include "trace.h"
+
+bool trace_enabled = false;
+
+static struct trace_ring *trace_rings[TRACE_RINGS_MAX];
+static int trace_nrings = 0;
+static pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *trace_ring_own = NULL;
+static __thread bool trace_ring_failed = false;
+static const char *trace_path;
+static pthread_t trace_thread;
+
+/* Registers the ring of the calling thread, once per thread. */
+static struct trace_ring *trace_ring_get(void)
+{
+    if(trace_ring_own != NULL || trace_ring_failed) {
+        return trace_ring_own;
+    }
+
+    pthread_mutex_lock(&trace_rings_mutex);
+    if(trace_nrings < TRACE_RINGS_MAX &&
+       (trace_ring_own = calloc(1, sizeof(struct trace_ring))) != NULL) {
+        trace_rings[trace_nrings] = trace_ring_own;
+        __atomic_store_n(&trace_nrings, trace_nrings + 1, __ATOMIC_RELEASE);
+    } else {
+        trace_ring_failed = true;
+    }
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    return trace_ring_own;
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end)
+{
+    struct trace_ring *ring;
+    struct trace_span *span;
+
+    if(!trace_enabled || (ring = trace_ring_get()) == NULL) {
+        return;
+    }
+
+    span = &(ring->spans[ring->head % TRACE_RING_SIZE]);
+    span->name = name;
+    span->start = start;
+    span->end = end;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_scope_end(struct trace_scope *scope)
+{
+    if(scope->start != 0) {
+        trace_span(scope->name, scope->start, ticks_cycles());
+    }
+}
+
+/* Copies spans of the ring which weren't overwritten while they were
+ * copied. Returns their number.
+ */
+static uint64_t trace_ring_snapshot(struct trace_ring *ring,
+                                    struct trace_span *spans)
+{
+    uint64_t head, from, to, i, n = 0;
+
+    to = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    from = to > TRACE_RING_SIZE ? to - TRACE_RING_SIZE : 0;
+
+    for(i = from; i < to; i++) {
+        spans[i - from] = ring->spans[i % TRACE_RING_SIZE];
+    }
+
+    /* The owner may be writing the span at `head' right now. */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(head + 1 > from + TRACE_RING_SIZE) {
+        n = head + 1 - TRACE_RING_SIZE - from;
+        if(n > to - from) {
+            n = to - from;
+        }
+        memmove(spans, spans + n, (to - from - n) * sizeof(struct trace_span));
+    }
+
+    return to - from - n;
+}
+
+static void trace_dump(void)
+{
+    struct trace_span *spans;
+    uint64_t base = UINT64_MAX, n[TRACE_RINGS_MAX], i;
+    int nrings = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE), j;
+    bool first = true;
+    FILE *f;
+
+    if((spans = malloc(sizeof(struct trace_span) * TRACE_RING_SIZE *
+                       (nrings > 0 ? nrings : 1))) == NULL) {
+        WARN("trace: not enough memory for the dump.\n");
+        return;
+    }
+
+    for(j = 0; j < nrings; j++) {
+        struct trace_span *s = spans + (size_t) j * TRACE_RING_SIZE;
+
+        n[j] = trace_ring_snapshot(trace_rings[j], s);
+        for(i = 0; i < n[j]; i++) {
+            if(s[i].start < base) {
+                base = s[i].start;
+            }
+        }
+    }
+
+    if((f = fopen(trace_path, "w")) == NULL) {
+        perror("trace: fopen");
+        free(spans);
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(j = 0; j < nrings; j++) {
+        struct trace_span *s = spans + (size_t) j * TRACE_RING_SIZE;
+
+        for(i = 0; i < n[j]; i++) {
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+                    s[i].name, j + 1,
+                    ticks_cycles_to_ns(s[i].start - base) / 1000.0,
+                    ticks_cycles_to_ns(s[i].end - s[i].start) / 1000.0);
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    free(spans);
+
+    INFO("trace: %d thread(s) dumped to %s.\n", nrings, trace_path);
+}
+
+/* SIGUSR1 is blocked in all threads, this one takes it synchronously. */
+static void *trace_thread_func(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while("someone looks") {
+        if(sigwait(&set, &sig) == 0) {
+            trace_dump();
+        }
+    }
+
+    return arg;
+}
+
+/* Enables tracing, spans are dumped to `path' on SIGUSR1. Must be called
+ * before other threads are started, so they inherit the signal mask.
+ */
+void trace_init(const char *path)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    trace_path = path;
+    if(pthread_create(&trace_thread, NULL, trace_thread_func, NULL) != 0) {
+        perror("trace: pthread_create");
+        return;
+    }
+
+    trace_enabled = true;
+}
+
+void trace_free(void)
+{
+    int i;
+
+    if(!trace_enabled) {
+        return;
+    }
+
+    trace_enabled = false;
+    pthread_cancel(trace_thread);
+    pthread_join(trace_thread, NULL);
+
+    for(i = 0; i < trace_nrings; i++) {
+        free(trace_rings[i]);
+    }
+    trace_nrings = 0;
+}
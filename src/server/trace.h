@@ -0,0 +1,67 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Profiler of the ticks. Each thread records spans (name, start and end in
+ * ticks_cycles() units) into its own ring which keeps the last
+ * TRACE_RING_SIZE of them, old spans are overwritten. On SIGUSR1 all rings
+ * are dumped to a file in Chrome trace format (chrome://tracing, Perfetto).
+ * Nothing is recorded unless tracing was enabled by trace_init().
+ */
+#define TRACE_RINGS_MAX 128
+#define TRACE_RING_SIZE 32768
+
+struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct trace_ring {
+    /* Written by the owner only. */
+    uint64_t head;
+    struct trace_span spans[TRACE_RING_SIZE];
+};
+
+struct trace_scope {
+    const char *name;
+    uint64_t start;
+};
+
+extern bool trace_enabled;
+
+#define TRACE_NOW() (trace_enabled ? ticks_cycles() : 0)
+
+/* Records a span from here to the end of the enclosing block. */
+#define TRACE_SCOPE(name)                                               \
+    struct trace_scope trace_scope_                                     \
+    __attribute__((cleanup(trace_scope_end))) = { (name), TRACE_NOW() }
+
+void trace_span(const char*, uint64_t, uint64_t);
+void trace_scope_end(struct trace_scope*);
+void trace_init(const char*);
+void trace_free(void);
+
+#endif
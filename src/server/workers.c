@@ -0,0 +1,187 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "workers.h"
+
+struct workers_thread_arg {
+    struct workers *w;
+    int index;
+};
+
+/* Takes chunks of range `r' until it is exhausted. */
+static void workers_range_drain(struct workers *w, struct workers_range *r)
+{
+    uint32_t i, begin, end;
+
+    while((begin = __atomic_fetch_add(&r->next, w->grain,
+                                      __ATOMIC_RELAXED)) < r->end) {
+        end = begin + w->grain < r->end ? begin + w->grain : r->end;
+
+        for(i = begin; i < end; i++) {
+            w->func(w->arg, i);
+        }
+    }
+}
+
+static void workers_job(struct workers *w, int index)
+{
+    int i;
+
+    workers_range_drain(w, &(w->ranges[index]));
+
+    /* Own range is done, steal from the others. */
+    for(i = 1; i < w->count; i++) {
+        workers_range_drain(w, &(w->ranges[(index + i) % w->count]));
+    }
+}
+
+static void *workers_thread_func(void *arg)
+{
+    struct workers_thread_arg *ta = arg;
+    struct workers *w = ta->w;
+    int index = ta->index;
+    uint64_t generation = 0;
+
+    free(ta);
+
+    for(;;) {
+        pthread_mutex_lock(&w->mutex);
+        while(!w->quit && w->generation == generation) {
+            pthread_cond_wait(&w->start_cond, &w->mutex);
+        }
+
+        if(w->quit) {
+            pthread_mutex_unlock(&w->mutex);
+            break;
+        }
+
+        generation = w->generation;
+        pthread_mutex_unlock(&w->mutex);
+
+        workers_job(w, index);
+
+        pthread_mutex_lock(&w->mutex);
+        if(--w->pending == 0) {
+            pthread_cond_signal(&w->done_cond);
+        }
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    return NULL;
+}
+
+/* Starts `count - 1' threads, the caller of workers_run() is a worker
+ * too. With count 1 jobs just run serially on the calling thread.
+ */
+struct workers *workers_init(int count)
+{
+    struct workers *w;
+    int i;
+
+    w = malloc(sizeof(struct workers));
+    memset(w, 0, sizeof(struct workers));
+    w->count = count;
+    w->threads = malloc(sizeof(pthread_t) * count);
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->start_cond, NULL);
+    pthread_cond_init(&w->done_cond, NULL);
+
+    for(i = 1; i < count; i++) {
+        struct workers_thread_arg *ta = malloc(sizeof(*ta));
+
+        ta->w = w;
+        ta->index = i;
+        pthread_create(&(w->threads[i]), NULL, workers_thread_func, ta);
+    }
+
+    return w;
+}
+
+void workers_free(struct workers *w)
+{
+    int i;
+
+    pthread_mutex_lock(&w->mutex);
+    w->quit = true;
+    pthread_cond_broadcast(&w->start_cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    for(i = 1; i < w->count; i++) {
+        pthread_join(w->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->start_cond);
+    pthread_cond_destroy(&w->done_cond);
+    free(w->threads);
+    free(w);
+}
+
+/* Calls func(arg, i) for each i in [0, n) and returns when all calls are
+ * finished. Items are split evenly between workers and taken by chunks
+ * of `grain' items.
+ */
+void workers_run(struct workers *w, uint32_t n, uint32_t grain,
+                 void (*func)(void*, uint32_t), void *arg)
+{
+    uint32_t per = n / w->count, rest = n % w->count, begin = 0;
+    int i;
+
+    w->func = func;
+    w->arg = arg;
+    w->grain = grain > 0 ? grain : 1;
+
+    for(i = 0; i < w->count; i++) {
+        uint32_t len = per + ((uint32_t) i < rest ? 1 : 0);
+
+        w->ranges[i].next = begin;
+        w->ranges[i].end = begin + len;
+        begin += len;
+    }
+
+    if(w->count == 1) {
+        workers_job(w, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    w->pending = w->count - 1;
+    w->generation++;
+    pthread_cond_broadcast(&w->start_cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    workers_job(w, 0);
+
+    pthread_mutex_lock(&w->mutex);
+    while(w->pending > 0) {
+        pthread_cond_wait(&w->done_cond, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
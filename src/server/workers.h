@@ -0,0 +1,62 @@
+/* Copyright (c) 2011, 2012 Michael Nedokushev <grouzen.hexy@gmail.com>
+ * Copyright (c) 2011, 2012 Alexander Batischev <eual.jp@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#define WORKERS_MAX 64
+
+/* Each worker owns a range of items. The owner and thieves take chunks
+ * of the range by the same atomic increment of `next', so a worker which
+ * finishes its own range early steals the rest of the others' ranges.
+ * Ranges are padded to a cache line to avoid false sharing.
+ */
+struct workers_range {
+    uint32_t next;
+    uint32_t end;
+    uint8_t pad[64 - 2 * sizeof(uint32_t)];
+};
+
+struct workers {
+    /* Number of workers including the thread which calls workers_run(). */
+    int count;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation;
+    int pending;
+    bool quit;
+    /* Current job. */
+    void (*func)(void*, uint32_t);
+    void *arg;
+    uint32_t grain;
+    struct workers_range ranges[WORKERS_MAX];
+};
+
+struct workers *workers_init(int);
+void workers_free(struct workers*);
+void workers_run(struct workers*, uint32_t, uint32_t,
+                 void (*)(void*, uint32_t), void*);
+
+#endif